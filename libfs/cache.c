@@ -0,0 +1,878 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "disk.h"
+
+#define cache_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Marks the end of a list */
+#define NIL SIZE_MAX
+
+/* Number of blocks cache_readv() hands to disk_readv() at once */
+#define CACHE_BATCH 256
+
+/* Maximum number of independently locked parts of the cache */
+#define CACHE_SHARDS 16
+
+/* Cached block description */
+struct cache_entry {
+	/* Disk block held in this entry (NIL if unused) */
+	size_t block;
+	/* Set if the cached copy is newer than the disk */
+	int dirty;
+	/* Set while cache_flush() writes a copy of the entry back */
+	int writing;
+	/* Set while cache_prefetch() reads the block in */
+	int loading;
+	/* Next entry in the same hash bucket */
+	size_t hnext;
+	/* Neighbours in the LRU list */
+	size_t prev, next;
+};
+
+/*
+ * Part of the cache holding the blocks whose index modulo the number of shards
+ * is the shard's index. Each shard has its own entries, hash buckets, LRU list
+ * and lock, so that threads working on different blocks rarely contend.
+ */
+struct cache_shard {
+	pthread_mutex_t lock;
+	/* Signaled when cache_flush() or cache_prefetch() is done with entries */
+	pthread_cond_t flushed;
+	/* Entries being written back by cache_flush() */
+	size_t nr_writing;
+	/* Entries being read in by cache_prefetch() */
+	size_t nr_loading;
+	/* Hash buckets (power of two), head entry of each chain */
+	size_t *buckets;
+	size_t nr_buckets;
+	/* Most and least recently used entries */
+	size_t lru_head, lru_tail;
+	struct cache_stats stats;
+};
+
+/* Block cache instance */
+struct cache {
+	/* Disk the blocks belong to, and the size of its blocks */
+	struct disk *disk;
+	size_t block_size;
+	/* Number of entries (0 if the cache is disabled) */
+	size_t nr;
+	struct cache_entry *entries;
+	/* Block contents, entry i lives at data + i * block_size */
+	char *data;
+	/* Hash buckets of all the shards */
+	size_t *buckets;
+	size_t nr_shards;
+	struct cache_shard shards[CACHE_SHARDS];
+	/* Requests that went to disk while the cache is disabled */
+	size_t uncached;
+	/* Number of dirty entries in all the shards */
+	size_t nr_dirty;
+	/* Serializes cache_flush(), which owns the staging buffer */
+	pthread_mutex_t flush_lock;
+	/* Copies of the blocks cache_flush() writes back */
+	char *staging;
+	/* Read request of each entry, used by cache_prefetch() */
+	struct block_req *reqs;
+	/* Serializes the collection of completed cache_prefetch() reads */
+	pthread_mutex_t reap_lock;
+	/* Number of cache_prefetch() reads in flight */
+	size_t nr_inflight;
+};
+
+static struct cache_shard *shard_of(struct cache *c, size_t block)
+{
+	return &c->shards[block % c->nr_shards];
+}
+
+static size_t hash_block(struct cache *c, struct cache_shard *sh, size_t block)
+{
+	return (block / c->nr_shards * 2654435761u) & (sh->nr_buckets - 1);
+}
+
+static char *entry_data(struct cache *c, size_t e)
+{
+	return c->data + e * c->block_size;
+}
+
+static void lru_unlink(struct cache *c, struct cache_shard *sh, size_t e)
+{
+	struct cache_entry *ent = &c->entries[e];
+
+	if (ent->prev != NIL)
+		c->entries[ent->prev].next = ent->next;
+	else
+		sh->lru_head = ent->next;
+	if (ent->next != NIL)
+		c->entries[ent->next].prev = ent->prev;
+	else
+		sh->lru_tail = ent->prev;
+}
+
+static void lru_push_front(struct cache *c, struct cache_shard *sh, size_t e)
+{
+	struct cache_entry *ent = &c->entries[e];
+
+	ent->prev = NIL;
+	ent->next = sh->lru_head;
+	if (sh->lru_head != NIL)
+		c->entries[sh->lru_head].prev = e;
+	sh->lru_head = e;
+	if (sh->lru_tail == NIL)
+		sh->lru_tail = e;
+}
+
+static void lru_push_back(struct cache *c, struct cache_shard *sh, size_t e)
+{
+	struct cache_entry *ent = &c->entries[e];
+
+	ent->next = NIL;
+	ent->prev = sh->lru_tail;
+	if (sh->lru_tail != NIL)
+		c->entries[sh->lru_tail].next = e;
+	sh->lru_tail = e;
+	if (sh->lru_head == NIL)
+		sh->lru_head = e;
+}
+
+static size_t lookup(struct cache *c, struct cache_shard *sh, size_t block)
+{
+	size_t e = sh->buckets[hash_block(c, sh, block)];
+
+	while (e != NIL && c->entries[e].block != block)
+		e = c->entries[e].hnext;
+
+	return e;
+}
+
+static void hash_remove(struct cache *c, struct cache_shard *sh, size_t e)
+{
+	size_t *link = &sh->buckets[hash_block(c, sh, c->entries[e].block)];
+
+	while (*link != e)
+		link = &c->entries[*link].hnext;
+	*link = c->entries[e].hnext;
+}
+
+/* Mark entry @e clean or dirty, keeping count of the dirty ones */
+static void set_dirty(struct cache *c, size_t e, int dirty)
+{
+	if (c->entries[e].dirty == dirty)
+		return;
+
+	c->entries[e].dirty = dirty;
+	if (dirty)
+		__atomic_fetch_add(&c->nr_dirty, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_fetch_sub(&c->nr_dirty, 1, __ATOMIC_RELAXED);
+}
+
+static int writeback(struct cache *c, struct cache_shard *sh, size_t e)
+{
+	if (disk_write(c->disk, c->entries[e].block, entry_data(c, e)))
+		return -1;
+
+	set_dirty(c, e, 0);
+	sh->stats.writebacks++;
+
+	return 0;
+}
+
+/*
+ * Wait, with the lock of @sh held, until cache_flush() is done with entry @e.
+ * Its copy must reach the disk before the entry is written again or evicted,
+ * or the disk could end up with the older content.
+ */
+static void wait_writing(struct cache_shard *sh, struct cache_entry *ent)
+{
+	while (ent->writing)
+		pthread_cond_wait(&sh->flushed, &sh->lock);
+}
+
+/*
+ * Take the least recently used entry of @sh that isn't being written back or
+ * read in, and rebind it to @block, writing back its previous content if needed. The entry
+ * is moved to the front of the LRU list.
+ *
+ * The lock of @sh is held throughout, so the caller must first make sure with
+ * wait_claimable() that such an entry exists.
+ */
+static size_t claim(struct cache *c, struct cache_shard *sh, size_t block)
+{
+	size_t e = sh->lru_tail;
+	struct cache_entry *ent;
+
+	while (c->entries[e].writing || c->entries[e].loading)
+		e = c->entries[e].prev;
+	ent = &c->entries[e];
+
+	if (ent->block != NIL) {
+		if (ent->dirty && writeback(c, sh, e))
+			return NIL;
+		hash_remove(c, sh, e);
+		sh->stats.evictions++;
+	}
+
+	ent->block = block;
+	set_dirty(c, e, 0);
+	ent->hnext = sh->buckets[hash_block(c, sh, block)];
+	sh->buckets[hash_block(c, sh, block)] = e;
+
+	lru_unlink(c, sh, e);
+	lru_push_front(c, sh, e);
+
+	return e;
+}
+
+/*
+ * Wait, with the lock of @sh held, until claim() can take an entry of @sh.
+ * Since the lock may be dropped meanwhile, lookups must come afterwards.
+ */
+static void wait_claimable(struct cache_shard *sh)
+{
+	while (sh->nr_writing + sh->nr_loading == sh->stats.capacity)
+		pthread_cond_wait(&sh->flushed, &sh->lock);
+}
+
+/* Drop entry @e of @sh, whose content is not needed, so it is reused first */
+static void discard(struct cache *c, struct cache_shard *sh, size_t e)
+{
+	hash_remove(c, sh, e);
+	c->entries[e].block = NIL;
+	set_dirty(c, e, 0);
+	lru_unlink(c, sh, e);
+	lru_push_back(c, sh, e);
+}
+
+/*
+ * Collect the reads started by cache_prefetch() that have completed, waiting
+ * for at least @min of them, and hand their entries over to the other calls.
+ * Called with reap_lock held.
+ */
+static void reap(struct cache *c, size_t min)
+{
+	struct block_req *done[CACHE_BATCH];
+	int n = disk_complete(c->disk, done, CACHE_BATCH, min);
+
+	for (int i = 0; i < n; i++) {
+		size_t e = done[i] - c->reqs;
+		struct cache_shard *sh = shard_of(c, done[i]->block);
+
+		pthread_mutex_lock(&sh->lock);
+		c->entries[e].loading = 0;
+		sh->nr_loading--;
+		if (done[i]->result)
+			discard(c, sh, e);
+		pthread_cond_broadcast(&sh->flushed);
+		pthread_mutex_unlock(&sh->lock);
+	}
+	if (n > 0)
+		__atomic_fetch_sub(&c->nr_inflight, n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Look @block up in @sh, with its lock held, once claim() can take an entry of
+ * @sh. If cache_prefetch() is reading the block in, wait for the read to
+ * complete first: its content isn't there yet, and must not overwrite newer
+ * content either.
+ */
+static size_t find(struct cache *c, struct cache_shard *sh, size_t block)
+{
+	size_t e;
+
+	for (;;) {
+		wait_claimable(sh);
+		e = lookup(c, sh, block);
+		if (e == NIL || !c->entries[e].loading)
+			return e;
+
+		/* Whoever holds reap_lock may be collecting our read already */
+		pthread_mutex_unlock(&sh->lock);
+		pthread_mutex_lock(&c->reap_lock);
+		pthread_mutex_lock(&sh->lock);
+		if (c->entries[e].loading) {
+			pthread_mutex_unlock(&sh->lock);
+			reap(c, 1);
+			pthread_mutex_lock(&sh->lock);
+		}
+		pthread_mutex_unlock(&c->reap_lock);
+	}
+}
+
+/* Set up shard @s with entries [@first, @first + @nr) */
+static void shard_init(struct cache *c, size_t s, size_t first, size_t nr,
+		       size_t *buckets, size_t nr_buckets)
+{
+	struct cache_shard *sh = &c->shards[s];
+
+	pthread_mutex_init(&sh->lock, NULL);
+	pthread_cond_init(&sh->flushed, NULL);
+	sh->buckets = buckets;
+	sh->nr_buckets = nr_buckets;
+	sh->lru_head = sh->lru_tail = NIL;
+	sh->stats.capacity = nr;
+
+	for (size_t i = 0; i < nr_buckets; i++)
+		buckets[i] = NIL;
+	for (size_t i = first; i < first + nr; i++) {
+		c->entries[i].block = NIL;
+		c->entries[i].dirty = 0;
+		c->entries[i].writing = 0;
+		c->entries[i].loading = 0;
+		c->entries[i].hnext = NIL;
+		c->entries[i].next = NIL;
+		c->entries[i].prev = sh->lru_tail;
+		if (sh->lru_tail != NIL)
+			c->entries[sh->lru_tail].next = i;
+		else
+			sh->lru_head = i;
+		sh->lru_tail = i;
+	}
+}
+
+struct cache *cache_init(struct disk *disk, size_t nr_blocks)
+{
+	struct cache *c;
+	size_t per_shard, nr_buckets = 1;
+
+	if (!(c = calloc(1, sizeof(*c)))) {
+		cache_error("unable to allocate cache");
+		return NULL;
+	}
+	c->disk = disk;
+	c->block_size = disk_block_size(disk);
+	pthread_mutex_init(&c->flush_lock, NULL);
+	pthread_mutex_init(&c->reap_lock, NULL);
+
+	if (nr_blocks) {
+		c->nr_shards = nr_blocks < CACHE_SHARDS ? nr_blocks
+							: CACHE_SHARDS;
+		per_shard = (nr_blocks + c->nr_shards - 1) / c->nr_shards;
+		while (nr_buckets < 2 * per_shard)
+			nr_buckets <<= 1;
+
+		c->entries = malloc(nr_blocks * sizeof(*c->entries));
+		c->data = malloc(nr_blocks * c->block_size);
+		c->buckets = malloc(c->nr_shards * nr_buckets *
+				    sizeof(size_t));
+		c->staging = malloc(CACHE_BATCH * c->block_size);
+		c->reqs = malloc(nr_blocks * sizeof(*c->reqs));
+		if (!c->entries || !c->data || !c->buckets || !c->staging ||
+		    !c->reqs) {
+			cache_error("unable to allocate %zu blocks", nr_blocks);
+			free(c->entries);
+			free(c->data);
+			free(c->buckets);
+			free(c->staging);
+			free(c->reqs);
+			pthread_mutex_destroy(&c->flush_lock);
+			pthread_mutex_destroy(&c->reap_lock);
+			free(c);
+			return NULL;
+		}
+
+		/* The first nr_blocks % nr_shards shards get one more entry */
+		for (size_t s = 0, first = 0; s < c->nr_shards; s++) {
+			size_t nr = nr_blocks / c->nr_shards +
+				(s < nr_blocks % c->nr_shards);
+
+			shard_init(c, s, first, nr, c->buckets + s * nr_buckets,
+				   nr_buckets);
+			first += nr;
+		}
+
+		/* Let an io_uring engine pin the slab, plain I/O works too */
+		disk_register_buffer(disk, c->data, nr_blocks * c->block_size);
+	}
+
+	c->nr = nr_blocks;
+
+	return c;
+}
+
+int cache_destroy(struct cache *c, struct cache_stats *stats)
+{
+	int ret;
+
+	if (!c) {
+		cache_error("cache not set up");
+		return -1;
+	}
+
+	/* The reads in flight land in the slab */
+	pthread_mutex_lock(&c->reap_lock);
+	while (__atomic_load_n(&c->nr_inflight, __ATOMIC_RELAXED))
+		reap(c, 1);
+	pthread_mutex_unlock(&c->reap_lock);
+
+	ret = cache_flush(c);
+
+	if (c->nr)
+		disk_register_buffer(c->disk, NULL, 0);
+
+	if (stats)
+		cache_get_stats(c, stats);
+
+	for (size_t s = 0; s < c->nr_shards; s++) {
+		pthread_mutex_destroy(&c->shards[s].lock);
+		pthread_cond_destroy(&c->shards[s].flushed);
+	}
+	pthread_mutex_destroy(&c->flush_lock);
+	pthread_mutex_destroy(&c->reap_lock);
+
+	free(c->entries);
+	free(c->data);
+	free(c->buckets);
+	free(c->staging);
+	free(c->reqs);
+	free(c);
+
+	return ret;
+}
+
+int cache_read(struct cache *c, size_t block, void *buf)
+{
+	struct cache_shard *sh;
+	size_t e;
+	int ret = 0;
+
+	if (!c) {
+		cache_error("cache not set up");
+		return -1;
+	}
+
+	if (!c->nr) {
+		__atomic_fetch_add(&c->uncached, 1, __ATOMIC_RELAXED);
+		return disk_read(c->disk, block, buf);
+	}
+
+	sh = shard_of(c, block);
+	pthread_mutex_lock(&sh->lock);
+
+	e = find(c, sh, block);
+	if (e != NIL) {
+		sh->stats.hits++;
+		lru_unlink(c, sh, e);
+		lru_push_front(c, sh, e);
+		memcpy(buf, entry_data(c, e), c->block_size);
+		goto out;
+	}
+
+	sh->stats.misses++;
+	if ((e = claim(c, sh, block)) == NIL) {
+		ret = -1;
+		goto out;
+	}
+
+	if (disk_read(c->disk, block, entry_data(c, e))) {
+		/* Don't keep garbage around under this block number */
+		discard(c, sh, e);
+		ret = -1;
+		goto out;
+	}
+
+	memcpy(buf, entry_data(c, e), c->block_size);
+
+out:
+	pthread_mutex_unlock(&sh->lock);
+	return ret;
+}
+
+int cache_write(struct cache *c, size_t block, const void *buf)
+{
+	struct cache_shard *sh;
+	size_t e;
+
+	if (!c) {
+		cache_error("cache not set up");
+		return -1;
+	}
+
+	if (!c->nr)
+		return disk_write(c->disk, block, buf);
+
+	/* Fail now rather than at write-back time */
+	if (block >= (size_t)disk_count(c->disk)) {
+		cache_error("block index out of bounds (%zu)", block);
+		return -1;
+	}
+
+	sh = shard_of(c, block);
+	pthread_mutex_lock(&sh->lock);
+
+	e = find(c, sh, block);
+	if (e != NIL) {
+		sh->stats.hits++;
+		lru_unlink(c, sh, e);
+		lru_push_front(c, sh, e);
+	} else {
+		/* The whole block gets replaced, no need to fetch it */
+		sh->stats.misses++;
+		if ((e = claim(c, sh, block)) == NIL) {
+			pthread_mutex_unlock(&sh->lock);
+			return -1;
+		}
+	}
+
+	/* The flushed copy is older, but stays consistent */
+	memcpy(entry_data(c, e), buf, c->block_size);
+	set_dirty(c, e, 1);
+
+	pthread_mutex_unlock(&sh->lock);
+
+	return 0;
+}
+
+/*
+ * The vectored calls don't hold any lock while they wait on the disk. The
+ * file-system never reads and writes a block at the same time, so the only race
+ * left is two readers missing on the same block, in which case the second one
+ * keeps the copy the first one inserted.
+ */
+int cache_readv(struct cache *c, const size_t *blocks, void *const *bufs,
+		size_t count)
+{
+	size_t mblocks[CACHE_BATCH];
+	void *mbufs[CACHE_BATCH];
+	size_t i, n, nmiss;
+
+	if (!c) {
+		cache_error("cache not set up");
+		return -1;
+	}
+
+	if (!c->nr) {
+		__atomic_fetch_add(&c->uncached, count, __ATOMIC_RELAXED);
+		return disk_readv(c->disk, blocks, bufs, count);
+	}
+
+	for (i = 0; i < count; i += n) {
+		n = count - i < CACHE_BATCH ? count - i : CACHE_BATCH;
+
+		/* Serve the hits, and gather the misses */
+		nmiss = 0;
+		for (size_t j = i; j < i + n; j++) {
+			struct cache_shard *sh = shard_of(c, blocks[j]);
+			size_t e;
+
+			pthread_mutex_lock(&sh->lock);
+			e = find(c, sh, blocks[j]);
+			if (e != NIL) {
+				sh->stats.hits++;
+				lru_unlink(c, sh, e);
+				lru_push_front(c, sh, e);
+				memcpy(bufs[j], entry_data(c, e), c->block_size);
+			} else {
+				sh->stats.misses++;
+				mblocks[nmiss] = blocks[j];
+				mbufs[nmiss] = bufs[j];
+				nmiss++;
+			}
+			pthread_mutex_unlock(&sh->lock);
+		}
+
+		if (disk_readv(c->disk, mblocks, mbufs, nmiss))
+			return -1;
+
+		/* Keep a copy of what was just read */
+		for (size_t j = 0; j < nmiss; j++) {
+			struct cache_shard *sh = shard_of(c, mblocks[j]);
+			size_t e;
+			int ret = 0;
+
+			pthread_mutex_lock(&sh->lock);
+			wait_claimable(sh);
+			if (lookup(c, sh, mblocks[j]) == NIL) {
+				if ((e = claim(c, sh, mblocks[j])) != NIL)
+					memcpy(entry_data(c, e), mbufs[j],
+					       c->block_size);
+				else
+					ret = -1;
+			}
+			pthread_mutex_unlock(&sh->lock);
+
+			if (ret)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Each block read ahead gets its entry right away, marked as loading, and the
+ * read lands straight in the entry. Calls that need the entry meanwhile wait
+ * for the read with find(). At most half of a shard is read in at once, so
+ * prefetching never stalls the other calls for want of entries.
+ */
+int cache_prefetch(struct cache *c, const size_t *blocks, size_t count)
+{
+	int ret = 0;
+
+	if (!c) {
+		cache_error("cache not set up");
+		return -1;
+	}
+
+	if (!c->nr)
+		return 0;
+
+	for (size_t i = 0; i < count; i++) {
+		struct cache_shard *sh = shard_of(c, blocks[i]);
+		struct block_req *req;
+		size_t e;
+
+		pthread_mutex_lock(&sh->lock);
+		if (sh->nr_loading >= sh->stats.capacity / 2) {
+			pthread_mutex_unlock(&sh->lock);
+			continue;
+		}
+		wait_claimable(sh);
+		if (lookup(c, sh, blocks[i]) != NIL) {
+			pthread_mutex_unlock(&sh->lock);
+			continue;
+		}
+		if ((e = claim(c, sh, blocks[i])) == NIL) {
+			pthread_mutex_unlock(&sh->lock);
+			ret = -1;
+			break;
+		}
+		c->entries[e].loading = 1;
+		sh->nr_loading++;
+		sh->stats.prefetched++;
+		pthread_mutex_unlock(&sh->lock);
+
+		req = &c->reqs[e];
+		memset(req, 0, sizeof(*req));
+		req->block = blocks[i];
+		req->count = 1;
+		req->buf = entry_data(c, e);
+		if (disk_submit(c->disk, req, 1)) {
+			pthread_mutex_lock(&sh->lock);
+			c->entries[e].loading = 0;
+			sh->nr_loading--;
+			discard(c, sh, e);
+			pthread_cond_broadcast(&sh->flushed);
+			pthread_mutex_unlock(&sh->lock);
+			ret = -1;
+			break;
+		}
+		__atomic_fetch_add(&c->nr_inflight, 1, __ATOMIC_RELAXED);
+	}
+
+	/* Without io_uring, the reads are done already */
+	pthread_mutex_lock(&c->reap_lock);
+	reap(c, 0);
+	pthread_mutex_unlock(&c->reap_lock);
+
+	return ret;
+}
+
+/* Update the cached copy of @block if there is one */
+static void refresh(struct cache *c, size_t block, const void *buf,
+		    int dirty)
+{
+	struct cache_shard *sh = shard_of(c, block);
+	size_t e;
+
+	pthread_mutex_lock(&sh->lock);
+	if ((e = find(c, sh, block)) != NIL) {
+		/* Our write must land after the one cache_flush() started */
+		wait_writing(sh, &c->entries[e]);
+		if (buf)
+			memcpy(entry_data(c, e), buf, c->block_size);
+		set_dirty(c, e, dirty);
+	}
+	pthread_mutex_unlock(&sh->lock);
+}
+
+int cache_writev(struct cache *c, const size_t *blocks,
+		 const void *const *bufs, size_t count)
+{
+	size_t i;
+
+	if (!c) {
+		cache_error("cache not set up");
+		return -1;
+	}
+
+	if (!c->nr)
+		return disk_writev(c->disk, blocks, bufs, count);
+
+	/* Cached copies must not go stale, they stay dirty until the write */
+	for (i = 0; i < count; i++)
+		refresh(c, blocks[i], bufs[i], 1);
+
+	if (disk_writev(c->disk, blocks, bufs, count))
+		return -1;
+
+	for (i = 0; i < count; i++)
+		refresh(c, blocks[i], NULL, 0);
+
+	return 0;
+}
+
+/* Dirty entry waiting to be written back */
+struct dirty_ent {
+	size_t block;
+	size_t e;
+};
+
+static int cmp_dirty_ent(const void *a, const void *b)
+{
+	size_t ba = ((const struct dirty_ent *)a)->block;
+	size_t bb = ((const struct dirty_ent *)b)->block;
+
+	return (ba > bb) - (ba < bb);
+}
+
+/*
+ * Write back entries @ents[0..@n) of @sh together, in disk order. The lock of
+ * @sh is held on entry and on return, but not while the blocks are written:
+ * copies are written instead, and the entries can be used meanwhile.
+ */
+static int writeback_batch(struct cache *c, struct cache_shard *sh,
+			   struct dirty_ent *ents, size_t n)
+{
+	size_t blocks[CACHE_BATCH];
+	const void *bufs[CACHE_BATCH];
+	int ret = 0;
+
+	qsort(ents, n, sizeof(*ents), cmp_dirty_ent);
+	for (size_t i = 0; i < n; i++) {
+		blocks[i] = ents[i].block;
+		bufs[i] = c->staging + i * c->block_size;
+		memcpy(c->staging + i * c->block_size, entry_data(c, ents[i].e),
+		       c->block_size);
+		/* Entries written again from now on get dirty again */
+		set_dirty(c, ents[i].e, 0);
+		c->entries[ents[i].e].writing = 1;
+	}
+	sh->nr_writing += n;
+	pthread_mutex_unlock(&sh->lock);
+
+	if (disk_writev(c->disk, blocks, bufs, n))
+		ret = -1;
+
+	pthread_mutex_lock(&sh->lock);
+	for (size_t i = 0; i < n; i++) {
+		c->entries[ents[i].e].writing = 0;
+		if (ret)
+			set_dirty(c, ents[i].e, 1);
+	}
+	sh->nr_writing -= n;
+	if (!ret)
+		sh->stats.writebacks += n;
+	pthread_cond_broadcast(&sh->flushed);
+
+	return ret;
+}
+
+/*
+ * Each shard is scanned for dirty entries in batches. The lock of the shard is
+ * dropped while a batch is written, so the scan restarts from the most recently
+ * used entry afterwards: entries written meanwhile are picked up too.
+ */
+int cache_flush(struct cache *c)
+{
+	struct dirty_ent ents[CACHE_BATCH];
+	int ret = 0;
+
+	if (!c) {
+		cache_error("cache not set up");
+		return -1;
+	}
+
+	pthread_mutex_lock(&c->flush_lock);
+	for (size_t s = 0; s < c->nr_shards; s++) {
+		struct cache_shard *sh = &c->shards[s];
+		size_t n;
+
+		pthread_mutex_lock(&sh->lock);
+		do {
+			n = 0;
+			for (size_t e = sh->lru_head; e != NIL && n < CACHE_BATCH;
+			     e = c->entries[e].next) {
+				if (c->entries[e].block == NIL ||
+				    !c->entries[e].dirty)
+					continue;
+
+				ents[n].block = c->entries[e].block;
+				ents[n].e = e;
+				n++;
+			}
+			if (n && writeback_batch(c, sh, ents, n)) {
+				ret = -1;
+				break;
+			}
+		} while (n == CACHE_BATCH);
+		pthread_mutex_unlock(&sh->lock);
+	}
+	pthread_mutex_unlock(&c->flush_lock);
+
+	return ret;
+}
+
+int cache_discard(struct cache *c, size_t block, size_t count)
+{
+	if (!c) {
+		cache_error("cache not set up");
+		return -1;
+	}
+
+	if (!c->nr)
+		return 0;
+
+	for (size_t b = block; b < block + count; b++) {
+		struct cache_shard *sh = shard_of(c, b);
+		size_t e;
+
+		pthread_mutex_lock(&sh->lock);
+		/* A copy on its way to the disk must land before the caller goes on */
+		while ((e = find(c, sh, b)) != NIL && c->entries[e].writing)
+			wait_writing(sh, &c->entries[e]);
+		if (e != NIL)
+			discard(c, sh, e);
+		pthread_mutex_unlock(&sh->lock);
+	}
+
+	return 0;
+}
+
+size_t cache_dirty(struct cache *c)
+{
+	if (!c)
+		return 0;
+
+	return __atomic_load_n(&c->nr_dirty, __ATOMIC_RELAXED);
+}
+
+int cache_get_stats(struct cache *c, struct cache_stats *stats)
+{
+	if (!c || !stats)
+		return -1;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->misses = __atomic_load_n(&c->uncached, __ATOMIC_RELAXED);
+
+	for (size_t s = 0; s < c->nr_shards; s++) {
+		struct cache_shard *sh = &c->shards[s];
+
+		pthread_mutex_lock(&sh->lock);
+		stats->capacity += sh->stats.capacity;
+		stats->hits += sh->stats.hits;
+		stats->misses += sh->stats.misses;
+		stats->evictions += sh->stats.evictions;
+		stats->writebacks += sh->stats.writebacks;
+		stats->prefetched += sh->stats.prefetched;
+		pthread_mutex_unlock(&sh->lock);
+	}
+
+	return 0;
+}
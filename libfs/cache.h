@@ -0,0 +1,179 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h> /* for size_t definition */
+
+struct disk;
+
+/** Block cache instance (opaque) */
+struct cache;
+
+/* Block cache counters */
+struct cache_stats {
+	/* Number of cached blocks */
+	size_t capacity;
+	/* Requests served from the cache */
+	size_t hits;
+	/* Requests that had to go to disk */
+	size_t misses;
+	/* Blocks evicted to make room for another block */
+	size_t evictions;
+	/* Dirty blocks written back to disk */
+	size_t writebacks;
+	/* Blocks read ahead by cache_prefetch() */
+	size_t prefetched;
+};
+
+/**
+ * cache_init - Set up a block cache
+ * @disk: Disk whose blocks are cached
+ * @nr_blocks: Number of blocks the cache can hold
+ *
+ * Allocate a write-back cache of @nr_blocks blocks in front of @disk, whose
+ * block size must not change for the life of the cache. Blocks
+ * are evicted in least-recently-used order. If @nr_blocks is 0, the cache is
+ * disabled and cache_read()/cache_write() go straight to
+ * disk_read()/disk_write().
+ *
+ * Return: NULL if the cache cannot be allocated. Otherwise, the new cache.
+ */
+struct cache *cache_init(struct disk *disk, size_t nr_blocks);
+
+/**
+ * cache_destroy - Tear down a block cache
+ * @c: Cache to tear down, which cannot be used afterwards
+ * @stats: Structure to be filled with the final counters, or NULL
+ *
+ * Write every dirty block back to disk and release the cache.
+ *
+ * Return: -1 if @c is NULL or if a dirty block cannot be written back. 0
+ * otherwise.
+ */
+int cache_destroy(struct cache *c, struct cache_stats *stats);
+
+/**
+ * cache_read - Read a block through the cache
+ * @c: Cache
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Copy the content of block @block into @buf, fetching it from disk first if
+ * it is not cached.
+ *
+ * Return: -1 if @c is NULL or if the block cannot be read. 0
+ * otherwise.
+ */
+int cache_read(struct cache *c, size_t block, void *buf);
+
+/**
+ * cache_write - Write a block through the cache
+ * @c: Cache
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * Copy @buf into the cached copy of block @block and mark it dirty. The block
+ * reaches the disk when it is evicted or when the cache is flushed.
+ *
+ * Return: -1 if @c is NULL or if the write (or the write-back of
+ * an evicted block) fails. 0 otherwise.
+ */
+int cache_write(struct cache *c, size_t block, const void *buf);
+
+/**
+ * cache_readv - Read several blocks through the cache
+ * @c: Cache
+ * @blocks: Indexes of the blocks to read from
+ * @bufs: Data buffers to be filled, one per block
+ * @count: Number of blocks to read
+ *
+ * Same as cache_read() for each block, except that the blocks that are not
+ * cached are fetched together with disk_readv().
+ *
+ * Return: -1 if @c is NULL or if a block cannot be read. 0
+ * otherwise.
+ */
+int cache_readv(struct cache *c, const size_t *blocks, void *const *bufs,
+		size_t count);
+
+/**
+ * cache_prefetch - Start reading blocks into the cache
+ * @c: Cache
+ * @blocks: Indexes of the blocks to read ahead
+ * @count: Number of blocks
+ *
+ * Start reading the blocks of @blocks that are not cached into the cache, and
+ * return without waiting for them where the disk supports it (with the io_uring
+ * engine). Later calls for these blocks wait for their read if it is still in
+ * flight. Blocks can be skipped if too many reads are in flight already. Does
+ * nothing if the cache is disabled.
+ *
+ * The cache collects every request completed on its disk, so disk_submit()
+ * must not be used on the disk by anyone else.
+ *
+ * Return: -1 if @c is NULL, or if a read cannot be started. 0 otherwise.
+ */
+int cache_prefetch(struct cache *c, const size_t *blocks, size_t count);
+
+/**
+ * cache_writev - Write several blocks through the cache
+ * @c: Cache
+ * @blocks: Indexes of the blocks to write to
+ * @bufs: Data buffers to write in the blocks, one per block
+ * @count: Number of blocks to write
+ *
+ * Write the blocks straight to disk with disk_writev() and update the cached
+ * copies of the ones that are cached. Blocks that are not cached are not added
+ * to the cache.
+ *
+ * Return: -1 if @c is NULL or if the writing operation fails. 0
+ * otherwise.
+ */
+int cache_writev(struct cache *c, const size_t *blocks,
+		 const void *const *bufs, size_t count);
+
+/**
+ * cache_flush - Write back dirty blocks
+ * @c: Cache
+ *
+ * Write every dirty block back to disk. Blocks stay cached. The cache can be
+ * used while the blocks are being written: copies of them are written, and
+ * blocks that are written again meanwhile stay dirty.
+ *
+ * Return: -1 if @c is NULL or if a block cannot be written back.
+ * 0 otherwise.
+ */
+int cache_flush(struct cache *c);
+
+/**
+ * cache_discard - Drop blocks from the cache
+ * @c: Cache
+ * @block: Index of the first block
+ * @count: Number of blocks
+ *
+ * Forget the cached copies of the @count blocks starting at @block, dirty or
+ * not, once their content doesn't matter anymore. Once this returns, none of
+ * them is written back to disk by the cache.
+ *
+ * Return: -1 if @c is NULL. 0 otherwise.
+ */
+int cache_discard(struct cache *c, size_t block, size_t count);
+
+/**
+ * cache_dirty - Count dirty blocks
+ * @c: Cache
+ *
+ * Return: the number of cached blocks that are newer than the disk, 0 if @c is
+ * NULL.
+ */
+size_t cache_dirty(struct cache *c);
+
+/**
+ * cache_get_stats - Get cache counters
+ * @c: Cache
+ * @stats: Structure to be filled with the counters
+ *
+ * Return: -1 if @c or @stats is NULL. 0 otherwise.
+ */
+int cache_get_stats(struct cache *c, struct cache_stats *stats);
+
+#endif /* _CACHE_H */
@@ -1,10 +1,30 @@
+/* For fallocate() and FALLOC_FL_PUNCH_HOLE */
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+/* Pulled in through <linux/fs.h>, and unrelated to ours */
+#undef BLOCK_SIZE
+#endif
+#endif
+
 #include "disk.h"
 
 #define block_error(fmt, ...) \
@@ -13,132 +33,1364 @@
 /* Invalid file descriptor */
 #define INVALID_FD -1
 
+/* Maximum number of blocks per preadv()/pwritev() call (Linux's UIO_MAXIOV) */
+#define RUN_MAX_BLOCKS 1024
+
+/* Submission queue size of the io_uring engine */
+#define RING_ENTRIES 64
+
+/*
+ * Largest request block_readv()/block_writev() hand to the io_uring engine, so
+ * that long runs are split over several requests the device serves in parallel
+ */
+#define RING_REQ_MAX_BLOCKS 64
+
+#ifdef HAVE_IO_URING
+/* io_uring instance (fd is INVALID_FD when the engine is not in use) */
+struct ring {
+	int fd;
+	/* Submission queue, shared with the kernel */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	/* Completion queue, shared with the kernel */
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* Mappings of the queues (cq_map is NULL if shared with sq_map) */
+	void *sq_map, *cq_map;
+	size_t sq_map_len, cq_map_len, sqes_len;
+	/* Requests queued but not submitted yet, and submitted but not done */
+	unsigned pending, inflight;
+	/* Registered buffer, NULL if none */
+	char *fixed_base;
+	size_t fixed_len;
+};
+#else
+struct ring {
+	int fd;
+};
+#endif
+
 /* Disk instance description */
 struct disk {
 	/* File descriptor */
 	int fd;
-	/* Block count */
+	/* Block count, and size of a block in bytes */
 	size_t bcount;
+	size_t block_size;
+	/* How blocks are accessed */
+	enum block_backend backend;
+	/* Whole image, with %BLOCK_BACKEND_MMAP */
+	char *map;
+	/* Engine, with %BLOCK_BACKEND_IO_URING */
+	struct ring ring;
+	/* Completed requests not yet returned by block_complete() */
+	struct block_req *done_head, *done_tail;
+	/*
+	 * Serializes the use of the engine and of the list of completed
+	 * requests. Other transfers use positional I/O and need no lock.
+	 */
+	pthread_mutex_t lock;
+	/*
+	 * Set while a thread waits for completions without the lock, see
+	 * ring_wait(), and signaled once it reaped them
+	 */
+	int reaping;
+	pthread_cond_t reaped;
+	/* Updated atomically, without the lock */
+	struct disk_stats stats;
+	/* Trace file, NULL if not traced, and time the trace started at */
+	FILE *trace;
+	uint64_t trace_start;
+	/* Serializes the trace records, and starting and stopping the trace */
+	pthread_mutex_t trace_lock;
 };
 
-/* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+/* Tag of the trace records of the calling thread */
+static __thread uint8_t trace_tag;
 
-int block_disk_open(const char *diskname)
+/* Disk opened with block_disk_open(), used by the block_*() functions */
+static struct disk *default_disk;
+
+static int ring_rwv(struct disk *d, int write, const size_t *blocks,
+		    void *const *bufs, size_t count);
+
+static int rw_run(struct disk *d, int write, size_t first, struct iovec *iov,
+		  int count);
+static int rw_fd(struct disk *d, int write, off_t off, struct iovec *iov,
+		 int count);
+
+static uint64_t now_ns(void)
 {
-	int fd;
-	struct stat st;
+	struct timespec ts;
 
-	if (!diskname) {
-		block_error("invalid file diskname");
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Count a request of @count blocks, and its latency if it started at @start */
+static void account(struct disk *d, int write, size_t count, uint64_t start)
+{
+	struct disk_stats *st = &d->stats;
+	uint64_t ns;
+	int bucket;
+
+	__atomic_fetch_add(write ? &st->writes : &st->reads, 1,
+			   __ATOMIC_RELAXED);
+	__atomic_fetch_add(write ? &st->written_blocks : &st->read_blocks,
+			   count, __ATOMIC_RELAXED);
+	if (!start)
+		return;
+
+	ns = now_ns() - start;
+	bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+	if (bucket >= DISK_LAT_BUCKETS)
+		bucket = DISK_LAT_BUCKETS - 1;
+	__atomic_fetch_add(write ? &st->write_total_ns : &st->read_total_ns, ns,
+			   __ATOMIC_RELAXED);
+	__atomic_fetch_add(write ? &st->write_ns[bucket] : &st->read_ns[bucket],
+			   1, __ATOMIC_RELAXED);
+}
+
+/* Append a record per run of at most UINT16_MAX blocks to the trace of @d */
+static void trace_run(struct disk *d, int op, size_t block, size_t count)
+{
+	struct block_trace_rec rec;
+
+	if (!__atomic_load_n(&d->trace, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&d->trace_lock);
+	if (!d->trace)
+		goto out;
+
+	/* Taken under the lock, so that records are in time order */
+	rec.time_ns = now_ns() - d->trace_start;
+	rec.op = op;
+	rec.tag = trace_tag;
+	do {
+		rec.block = block;
+		rec.count = count > UINT16_MAX ? UINT16_MAX : count;
+		if (fwrite(&rec, sizeof(rec), 1, d->trace) != 1) {
+			perror("fwrite");
+			/* Keep what was recorded so far, drop the rest */
+			fclose(d->trace);
+			__atomic_store_n(&d->trace, NULL, __ATOMIC_RELEASE);
+			goto out;
+		}
+		block += rec.count;
+		count -= rec.count;
+	} while (count);
+out:
+	pthread_mutex_unlock(&d->trace_lock);
+}
+
+/* Same as trace_run() for each run of contiguous blocks of @blocks */
+static void trace_blocks(struct disk *d, int op, const size_t *blocks,
+			 size_t count)
+{
+	size_t i, n;
+
+	if (!__atomic_load_n(&d->trace, __ATOMIC_ACQUIRE))
+		return;
+
+	for (i = 0; i < count; i += n) {
+		n = 1;
+		while (i + n < count && blocks[i + n] == blocks[i] + n)
+			n++;
+		trace_run(d, op, blocks[i], n);
+	}
+}
+
+/* Record the outcome of @req, and queue it for block_complete() if needed */
+static void req_done(struct disk *d, struct block_req *req, int result)
+{
+	req->result = result;
+	req->done = 1;
+	if (req->internal)
+		return;
+
+	req->next = NULL;
+	if (d->done_tail)
+		d->done_tail->next = req;
+	else
+		d->done_head = req;
+	d->done_tail = req;
+}
+
+#ifdef HAVE_IO_URING
+static int ring_setup(struct disk *d, int fd)
+{
+	struct ring *r = &d->ring;
+	struct io_uring_params p;
+	char *sq, *cq;
+	int rfd;
+
+	memset(&p, 0, sizeof(p));
+	rfd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+	if (rfd < 0)
 		return -1;
+
+	r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_map_len = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_map_len > r->sq_map_len)
+			r->sq_map_len = r->cq_map_len;
+		r->cq_map_len = 0;
 	}
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
 
-	if (disk.fd != INVALID_FD) {
-		block_error("disk already open");
+	sq = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto err_close;
+
+	cq = sq;
+	if (r->cq_map_len) {
+		cq = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto err_sq;
+	}
+
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto err_cq;
+
+	/* Requests refer to the disk as fixed file 0 */
+	if (syscall(__NR_io_uring_register, rfd, IORING_REGISTER_FILES,
+		    &fd, 1) < 0) {
+		munmap(r->sqes, r->sqes_len);
+		goto err_cq;
+	}
+
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r->sq_map = sq;
+	r->cq_map = r->cq_map_len ? cq : NULL;
+	r->pending = r->inflight = 0;
+	r->fixed_base = NULL;
+	r->fixed_len = 0;
+	r->fd = rfd;
+
+	return 0;
+
+err_cq:
+	if (cq != sq)
+		munmap(cq, r->cq_map_len);
+err_sq:
+	munmap(sq, r->sq_map_len);
+err_close:
+	close(rfd);
+	return -1;
+}
+
+static void ring_teardown(struct disk *d)
+{
+	struct ring *r = &d->ring;
+
+	if (r->fd == INVALID_FD)
+		return;
+
+	munmap(r->sqes, r->sqes_len);
+	if (r->cq_map)
+		munmap(r->cq_map, r->cq_map_len);
+	munmap(r->sq_map, r->sq_map_len);
+	close(r->fd);
+	r->fd = INVALID_FD;
+}
+
+static int ring_active(struct disk *d)
+{
+	return d->ring.fd != INVALID_FD;
+}
+
+/* Number of requests the engine is currently responsible for */
+static unsigned ring_busy(struct disk *d)
+{
+	return d->ring.pending + d->ring.inflight;
+}
+
+/* Add @req to the submission queue, which must have room for it */
+static void ring_queue(struct disk *d, struct block_req *req)
+{
+	struct ring *r = &d->ring;
+	unsigned tail = *r->sq_tail;
+	unsigned idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+	size_t len = req->count * d->block_size;
+	char *buf = req->buf;
+
+	memset(sqe, 0, sizeof(*sqe));
+	if (r->fixed_base && buf >= r->fixed_base &&
+	    buf + len <= r->fixed_base + r->fixed_len) {
+		sqe->opcode = req->write ? IORING_OP_WRITE_FIXED
+					 : IORING_OP_READ_FIXED;
+		sqe->buf_index = 0;
+	} else {
+		sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+	}
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = 0;
+	sqe->off = req->block * d->block_size;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->user_data = (uintptr_t)req;
+
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->pending++;
+}
+
+/*
+ * Submit the pending requests, and wait for at least @min_complete requests to
+ * complete. If the kernel refuses the submission, the pending requests are
+ * taken back and fail.
+ */
+static int ring_enter(struct disk *d, unsigned min_complete)
+{
+	struct ring *r = &d->ring;
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, r->fd, r->pending,
+			      min_complete,
+			      min_complete ? IORING_ENTER_GETEVENTS : 0,
+			      NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		perror("io_uring_enter");
+		if (r->pending) {
+			unsigned tail = *r->sq_tail - r->pending;
+
+			__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+			for (; r->pending; r->pending--, tail++) {
+				struct io_uring_sqe *sqe =
+					&r->sqes[tail & *r->sq_mask];
+
+				req_done(d, (void *)(uintptr_t)sqe->user_data,
+					 -1);
+			}
+		}
 		return -1;
 	}
 
+	r->pending -= ret;
+	r->inflight += ret;
+
+	return 0;
+}
+
+/* Process the completion queue */
+static void ring_reap(struct disk *d)
+{
+	struct ring *r = &d->ring;
+	unsigned head = *r->cq_head;
+	unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+		struct block_req *req = (void *)(uintptr_t)cqe->user_data;
+		size_t len = req->count * d->block_size;
+		int res = cqe->res;
+
+		r->inflight--;
+		if (res < 0) {
+			errno = -res;
+			perror(req->write ? "io_uring write" : "io_uring read");
+			req_done(d, req, -1);
+		} else if ((size_t)res < len) {
+			/* Finish a transfer the kernel cut short by hand */
+			struct iovec iov = {
+				.iov_base = (char *)req->buf + res,
+				.iov_len = len - res,
+			};
+
+			req_done(d, req, rw_fd(d, req->write,
+					    req->block * d->block_size + res,
+					    &iov, 1));
+		} else {
+			req_done(d, req, 0);
+		}
+	}
+
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Submit the pending requests, and wait for at least one request to complete.
+ * Called with d->lock held, which is dropped while waiting so that other
+ * threads can queue and submit requests meanwhile. A single thread waits in
+ * the kernel and reaps, the others wait for it on d->reaped.
+ */
+static void ring_wait(struct disk *d)
+{
+	struct ring *r = &d->ring;
+	int ret;
+
+	if (r->pending && ring_enter(d, 0))
+		return;
+
+	if (d->reaping) {
+		pthread_cond_wait(&d->reaped, &d->lock);
+		return;
+	}
+
+	/* Requests left unsubmitted are retried by the caller's next call */
+	if (!r->inflight)
+		return;
+
+	/* Completions already posted need no system call */
+	if (__atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) != *r->cq_head) {
+		ring_reap(d);
+		pthread_cond_broadcast(&d->reaped);
+		return;
+	}
+
+	d->reaping = 1;
+	pthread_mutex_unlock(&d->lock);
+	do {
+		ret = syscall(__NR_io_uring_enter, r->fd, 0, 1,
+			      IORING_ENTER_GETEVENTS, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	pthread_mutex_lock(&d->lock);
+	d->reaping = 0;
+
+	if (ret < 0)
+		perror("io_uring_enter");
+	ring_reap(d);
+	pthread_cond_broadcast(&d->reaped);
+}
+
+static int ring_register(struct disk *d, void *base, size_t len)
+{
+	struct ring *r = &d->ring;
+	struct iovec iov = { .iov_base = base, .iov_len = len };
+
+	if (r->fixed_base) {
+		syscall(__NR_io_uring_register, r->fd,
+			IORING_UNREGISTER_BUFFERS, NULL, 0);
+		r->fixed_base = NULL;
+		r->fixed_len = 0;
+	}
+
+	if (!base)
+		return 0;
+
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS,
+		    &iov, 1) < 0)
+		return -1;
+
+	r->fixed_base = base;
+	r->fixed_len = len;
+
+	return 0;
+}
+#else
+static int ring_setup(struct disk *d, int fd)
+{
+	(void)fd;
+	return -1;
+}
+
+static void ring_teardown(struct disk *d) {}
+static int ring_active(struct disk *d) { return 0; }
+static unsigned ring_busy(struct disk *d) { return 0; }
+static void ring_queue(struct disk *d, struct block_req *req) {}
+static int ring_enter(struct disk *d, unsigned min_complete)
+{
+	(void)min_complete;
+	return -1;
+}
+static void ring_reap(struct disk *d) {}
+static void ring_wait(struct disk *d) {}
+static int ring_register(struct disk *d, void *base, size_t len)
+{
+	(void)base;
+	(void)len;
+	return -1;
+}
+#endif
+
+/*
+ * Start @req. With the io_uring engine, room is made in the submission queue by
+ * waiting for earlier requests if needed. Otherwise the request is carried out
+ * right away.
+ */
+static void req_queue(struct disk *d, struct block_req *req)
+{
+	struct iovec iov[BLOCK_REQ_MAX_BLOCKS];
+
+	req->done = 0;
+
+	if (ring_active(d)) {
+		while (ring_busy(d) >= RING_ENTRIES)
+			ring_wait(d);
+		ring_queue(d, req);
+		return;
+	}
+
+	for (size_t i = 0; i < req->count; i++) {
+		iov[i].iov_base = (char *)req->buf + i * d->block_size;
+		iov[i].iov_len = d->block_size;
+	}
+	req_done(d, req, rw_run(d, req->write, req->block, iov, req->count));
+}
+
+struct disk *disk_open(const char *diskname, enum block_backend backend)
+{
+	struct disk *d;
+	int fd;
+	struct stat st;
+	char *map = NULL;
+
+	if (!diskname) {
+		block_error("invalid file diskname");
+		return NULL;
+	}
+
 	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
 		perror("open");
-		return -1;
+		return NULL;
 	}
 
 	if (fstat(fd, &st)) {
 		perror("fstat");
-		return -1;
+		close(fd);
+		return NULL;
 	}
 
 	/* The disk image's size should be a multiple of the block size */
-	if (st.st_size % BLOCK_SIZE != 0) {
+	if (st.st_size % BLOCK_SIZE_MIN != 0) {
 		block_error("size '%zu' is not multiple of '%d'",
-			    st.st_size, BLOCK_SIZE);
+			    st.st_size, BLOCK_SIZE_MIN);
+		close(fd);
+		return NULL;
+	}
+
+	if (backend == BLOCK_BACKEND_MMAP && st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			   fd, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap");
+			close(fd);
+			return NULL;
+		}
+		/* Blocks are mostly accessed in runs, let the kernel read ahead */
+		if (madvise(map, st.st_size, MADV_SEQUENTIAL))
+			perror("madvise");
+	}
+
+	if (!(d = calloc(1, sizeof(*d)))) {
+		perror("calloc");
+		if (map)
+			munmap(map, st.st_size);
+		close(fd);
+		return NULL;
+	}
+
+	d->fd = fd;
+	d->bcount = st.st_size / BLOCK_SIZE_MIN;
+	d->block_size = BLOCK_SIZE_MIN;
+	d->backend = backend;
+	d->map = map;
+	d->ring.fd = INVALID_FD;
+	d->done_head = d->done_tail = NULL;
+	pthread_mutex_init(&d->lock, NULL);
+	pthread_cond_init(&d->reaped, NULL);
+	pthread_mutex_init(&d->trace_lock, NULL);
+
+	/* Without io_uring, the engine quietly falls back to system calls */
+	if (backend == BLOCK_BACKEND_IO_URING)
+		ring_setup(d, fd);
+
+	/* Images of small blocks may not be made of whole default blocks */
+	if (st.st_size % BLOCK_SIZE == 0)
+		disk_set_block_size(d, BLOCK_SIZE);
+
+	return d;
+}
+
+int disk_set_block_size(struct disk *d, size_t block_size)
+{
+	size_t size;
+
+	if (!d) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block_size < BLOCK_SIZE_MIN || block_size > BLOCK_SIZE_MAX ||
+	    (block_size & (block_size - 1))) {
+		block_error("invalid block size '%zu'", block_size);
 		return -1;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	size = d->bcount * d->block_size;
+	if (size % block_size != 0) {
+		block_error("size '%zu' is not multiple of '%zu'", size,
+			    block_size);
+		return -1;
+	}
+
+	d->bcount = size / block_size;
+	d->block_size = block_size;
 
 	return 0;
 }
 
-int block_disk_close(void)
+int disk_block_size(struct disk *d)
+{
+	if (!d) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	return d->block_size;
+}
+
+int disk_close(struct disk *d)
 {
-	if (disk.fd == INVALID_FD) {
+	int ret;
+
+	if (!d) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	close(disk.fd);
+	ret = disk_sync(d);
+
+	/* Wait for whatever the engine still has in flight */
+	pthread_mutex_lock(&d->lock);
+	while (ring_active(d) && ring_busy(d))
+		ring_wait(d);
+	ring_teardown(d);
+	pthread_mutex_unlock(&d->lock);
 
-	disk.fd = INVALID_FD;
+	if (d->map) {
+		munmap(d->map, d->bcount * d->block_size);
+		d->map = NULL;
+	}
+
+	if (disk_trace_stop(d))
+		ret = -1;
+
+	close(d->fd);
+	pthread_mutex_destroy(&d->lock);
+	pthread_cond_destroy(&d->reaped);
+	pthread_mutex_destroy(&d->trace_lock);
+	free(d);
+
+	return ret;
+}
+
+int disk_sync(struct disk *d)
+{
+	if (!d) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	/* Writes through the file descriptor are already in the page cache */
+	if (!d->map)
+		return 0;
+
+	if (msync(d->map, d->bcount * d->block_size, MS_SYNC)) {
+		perror("msync");
+		return -1;
+	}
 
 	return 0;
 }
 
-int block_disk_count(void)
+int disk_flush(struct disk *d)
 {
-	if (disk.fd == INVALID_FD) {
+	if (disk_sync(d))
+		return -1;
+
+	__atomic_fetch_add(&d->stats.flushes, 1, __ATOMIC_RELAXED);
+	trace_run(d, BLOCK_TRACE_FLUSH, 0, 0);
+	if (fdatasync(d->fd)) {
+		perror("fdatasync");
+		return -1;
+	}
+
+	return 0;
+}
+
+int disk_discard(struct disk *d, size_t block, size_t count)
+{
+	if (!d) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	return disk.bcount;
+	if (block >= d->bcount || count > d->bcount - block) {
+		block_error("block index out of bounds (%zu+%zu/%zu)", block,
+			    count, d->bcount);
+		return -1;
+	}
+
+	trace_run(d, BLOCK_TRACE_DISCARD, block, count);
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+	/* A mapping of the range reads zeros afterwards, like the file */
+	if (count && fallocate(d->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			       (off_t)block * d->block_size,
+			       (off_t)count * d->block_size)) {
+		perror("fallocate");
+		return -1;
+	}
+	__atomic_fetch_add(&d->stats.discarded_blocks, count, __ATOMIC_RELAXED);
+
+	return 0;
+#else
+	block_error("punching holes is not supported");
+	return -1;
+#endif
 }
 
-int block_write(size_t block, const void *buf)
+void *disk_map(struct disk *d, size_t block, size_t count)
 {
-	if (disk.fd == INVALID_FD) {
+	long page = sysconf(_SC_PAGESIZE);
+	off_t off, skew;
+	char *p;
+
+	if (!d) {
 		block_error("no disk currently open");
+		return NULL;
+	}
+
+	if (!count || block >= d->bcount || count > d->bcount - block) {
+		block_error("block index out of bounds (%zu+%zu/%zu)", block,
+			    count, d->bcount);
+		return NULL;
+	}
+
+	/* Pages larger than blocks may start before the first block */
+	off = (off_t)block * d->block_size;
+	skew = off % page;
+	p = mmap(NULL, count * d->block_size + skew, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE, d->fd, off - skew);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	return p + skew;
+}
+
+int disk_unmap(void *addr, size_t len)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	size_t skew = (uintptr_t)addr % page;
+
+	if (!addr)
+		return 0;
+
+	if (munmap((char *)addr - skew, len + skew)) {
+		perror("munmap");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
+	return 0;
+}
+
+int disk_count(struct disk *d)
+{
+	if (!d) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	return d->bcount;
+}
+
+int disk_write(struct disk *d, size_t block, const void *buf)
+{
+	struct iovec iov;
+	uint64_t start;
+	int ret = 0;
+
+	if (!d) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block >= d->bcount) {
 		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+			    block, d->bcount);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	trace_run(d, BLOCK_TRACE_WRITE, block, 1);
+	start = now_ns();
+	if (d->map) {
+		memcpy(d->map + block * d->block_size, buf, d->block_size);
+	} else if (ring_active(d)) {
+		ret = ring_rwv(d, 1, &block, (void *const *)&buf, 1);
+	} else {
+		iov.iov_base = (void *)buf;
+		iov.iov_len = d->block_size;
+		ret = rw_fd(d, 1, block * d->block_size, &iov, 1);
+	}
+	account(d, 1, 1, start);
+
+	return ret;
+}
+
+int disk_read(struct disk *d, size_t block, void *buf)
+{
+	struct iovec iov;
+	uint64_t start;
+	int ret = 0;
+
+	if (!d) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	if (block >= d->bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block, d->bcount);
 		return -1;
 	}
 
+	trace_run(d, BLOCK_TRACE_READ, block, 1);
+	start = now_ns();
+	if (d->map) {
+		memcpy(buf, d->map + block * d->block_size, d->block_size);
+	} else if (ring_active(d)) {
+		ret = ring_rwv(d, 0, &block, &buf, 1);
+	} else {
+		iov.iov_base = buf;
+		iov.iov_len = d->block_size;
+		ret = rw_fd(d, 0, block * d->block_size, &iov, 1);
+	}
+	account(d, 0, 1, start);
+
+	return ret;
+}
+
+
+/*
+ * Transfer a run of @count physically contiguous blocks starting at @first,
+ * described by @iov, with as few preadv()/pwritev() calls as the kernel allows.
+ * @iov is modified.
+ */
+static int rw_run(struct disk *d, int write, size_t first, struct iovec *iov,
+		  int count)
+{
+	size_t bs = d->block_size;
+	off_t off = first * bs;
+
+	if (d->map) {
+		char *run = d->map + off;
+
+		/* Fault the whole run in at once rather than page by page */
+		if (!write && count > 1)
+			madvise(run - (off % getpagesize()),
+				count * bs + (off % getpagesize()),
+				MADV_WILLNEED);
+
+		for (int i = 0; i < count; i++, run += bs) {
+			if (write)
+				memcpy(run, iov[i].iov_base, bs);
+			else
+				memcpy(iov[i].iov_base, run, bs);
+		}
+		return 0;
+	}
+
+	return rw_fd(d, write, off, iov, count);
+}
+
+/* Transfer @iov at offset @off of the disk file, resuming short transfers */
+static int rw_fd(struct disk *d, int write, off_t off, struct iovec *iov,
+		 int count)
+{
+	while (count > 0) {
+		ssize_t ret;
+
+		if (write)
+			ret = pwritev(d->fd, iov, count, off);
+		else
+			ret = preadv(d->fd, iov, count, off);
+		if (ret < 0) {
+			perror(write ? "pwritev" : "preadv");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("unexpected end of disk");
+			return -1;
+		}
+
+		/* Skip what was transferred, and retry with the rest */
+		off += ret;
+		while (count > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
 	return 0;
 }
 
-int block_read(size_t block, void *buf)
+/*
+ * Transfer blocks with the io_uring engine. Each run of contiguous blocks whose
+ * buffers are contiguous as well becomes one request, and up to %RING_ENTRIES
+ * requests are in flight at once. The lock is only held to queue the requests
+ * and to reap completions, so that the transfers of several threads overlap.
+ */
+static int ring_rwv(struct disk *d, int write, const size_t *blocks,
+		    void *const *bufs, size_t count)
+{
+	struct block_req reqs[RING_ENTRIES];
+	size_t i = 0, n, nreq;
+	int ret = 0;
+
+	pthread_mutex_lock(&d->lock);
+	while (i < count && !ret) {
+		for (nreq = 0; i < count && nreq < RING_ENTRIES; nreq++) {
+			char *buf = bufs[i];
+
+			n = 1;
+			while (i + n < count && n < RING_REQ_MAX_BLOCKS &&
+			       blocks[i + n] == blocks[i] + n &&
+			       bufs[i + n] == buf + n * d->block_size)
+				n++;
+
+			reqs[nreq] = (struct block_req) {
+				.write = write,
+				.block = blocks[i],
+				.count = n,
+				.buf = buf,
+				.internal = 1,
+			};
+			req_queue(d, &reqs[nreq]);
+			i += n;
+		}
+
+		/* Wait for the whole batch, the buffers live on this stack */
+		for (size_t j = 0; j < nreq; j++) {
+			while (!reqs[j].done)
+				ring_wait(d);
+			if (reqs[j].result)
+				ret = -1;
+		}
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	return ret;
+}
+
+static int disk_rwv(struct disk *d, int write, const size_t *blocks,
+		    void *const *bufs, size_t count)
 {
-	if (disk.fd == INVALID_FD) {
+	struct iovec iov[RUN_MAX_BLOCKS];
+	uint64_t start;
+	size_t i, n;
+	int ret = 0;
+
+	if (!d) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	for (i = 0; i < count; i++) {
+		if (blocks[i] >= d->bcount) {
+			block_error("block index out of bounds (%zu/%zu)",
+				    blocks[i], d->bcount);
+			return -1;
+		}
+	}
+
+	trace_blocks(d, write ? BLOCK_TRACE_WRITE : BLOCK_TRACE_READ, blocks,
+		     count);
+	start = now_ns();
+	if (ring_active(d)) {
+		ret = ring_rwv(d, write, blocks, bufs, count);
+		account(d, write, count, start);
+		return ret;
+	}
+
+	for (i = 0; i < count; i += n) {
+		/* Gather the run of contiguous blocks starting at blocks[i] */
+		n = 0;
+		do {
+			iov[n].iov_base = bufs[i + n];
+			iov[n].iov_len = d->block_size;
+			n++;
+		} while (i + n < count && n < RUN_MAX_BLOCKS &&
+			 blocks[i + n] == blocks[i] + n);
+
+		if (rw_run(d, write, blocks[i], iov, n)) {
+			ret = -1;
+			break;
+		}
+	}
+	account(d, write, count, start);
+
+	return ret;
+}
+
+int disk_readv(struct disk *d, const size_t *blocks, void *const *bufs,
+	       size_t count)
+{
+	return disk_rwv(d, 0, blocks, bufs, count);
+}
+
+int disk_writev(struct disk *d, const size_t *blocks, const void *const *bufs,
+		size_t count)
+{
+	return disk_rwv(d, 1, blocks, (void *const *)bufs, count);
+}
+
+int disk_submit(struct disk *d, struct block_req *reqs, size_t count)
+{
+	size_t i;
+
+	if (!d) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!reqs[i].buf || !reqs[i].count ||
+		    reqs[i].count > BLOCK_REQ_MAX_BLOCKS) {
+			block_error("invalid request");
+			return -1;
+		}
+		if (reqs[i].block >= d->bcount ||
+		    reqs[i].count > d->bcount - reqs[i].block) {
+			block_error("block index out of bounds (%zu+%zu/%zu)",
+				    reqs[i].block, reqs[i].count, d->bcount);
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&d->lock);
+	for (i = 0; i < count; i++) {
+		reqs[i].internal = 0;
+		req_queue(d, &reqs[i]);
+		/* Completion is collected later, only count the request */
+		account(d, reqs[i].write, reqs[i].count, 0);
+		trace_run(d, reqs[i].write ? BLOCK_TRACE_WRITE :
+			  BLOCK_TRACE_READ, reqs[i].block, reqs[i].count);
+	}
+
+	/*
+	 * Get the requests going without waiting for any of them. A failed
+	 * submission shows in the results of the requests.
+	 */
+	if (ring_active(d))
+		ring_enter(d, 0);
+	pthread_mutex_unlock(&d->lock);
+
+	return 0;
+}
+
+int disk_complete(struct disk *d, struct block_req **done, size_t max,
+		  size_t min)
+{
+	size_t n = 0;
+
+	if (!d) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	pthread_mutex_lock(&d->lock);
+	while (n < max) {
+		if (d->done_head) {
+			done[n++] = d->done_head;
+			d->done_head = d->done_head->next;
+			if (!d->done_head)
+				d->done_tail = NULL;
+			continue;
+		}
+
+		/* Nothing more can complete without the engine */
+		if (n >= min || !ring_active(d) || !ring_busy(d))
+			break;
+
+		ring_wait(d);
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	return n;
+}
+
+int disk_register_buffer(struct disk *d, void *base, size_t len)
+{
+	int ret;
+
+	if (!d) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	/* Only the io_uring engine makes use of registered buffers */
+	if (!ring_active(d))
+		return 0;
+
+	pthread_mutex_lock(&d->lock);
+	ret = ring_register(d, base, len);
+	pthread_mutex_unlock(&d->lock);
+
+	return ret;
+}
+
+int disk_get_stats(struct disk *d, struct disk_stats *stats)
+{
+	const size_t *src;
+	size_t *dst;
+
+	if (!d || !stats)
+		return -1;
+
+	/* Every field is a counter of the same type */
+	src = (const size_t *)&d->stats;
+	dst = (size_t *)stats;
+	for (size_t i = 0; i < sizeof(*stats) / sizeof(size_t); i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+int disk_trace_start(struct disk *d, const char *path)
+{
+	struct block_trace_header hdr;
+	FILE *f;
+
+	if (!d) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (!path) {
+		block_error("invalid trace file name");
+		return -1;
+	}
+
+	if (!(f = fopen(path, "wb"))) {
+		perror("fopen");
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	/* Records are small, write them out in large chunks */
+	setvbuf(f, NULL, _IOFBF, 1 << 20);
+	hdr.magic = BLOCK_TRACE_MAGIC;
+	hdr.version = BLOCK_TRACE_VERSION;
+	hdr.block_size = d->block_size;
+	hdr.nr_blocks = d->bcount;
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1) {
+		perror("fwrite");
+		fclose(f);
 		return -1;
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	pthread_mutex_lock(&d->trace_lock);
+	if (d->trace) {
+		pthread_mutex_unlock(&d->trace_lock);
+		block_error("disk already traced");
+		fclose(f);
 		return -1;
 	}
+	d->trace_start = now_ns();
+	__atomic_store_n(&d->trace, f, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&d->trace_lock);
 
 	return 0;
 }
 
+int disk_trace_stop(struct disk *d)
+{
+	FILE *f;
+
+	if (!d) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	pthread_mutex_lock(&d->trace_lock);
+	f = d->trace;
+	__atomic_store_n(&d->trace, NULL, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&d->trace_lock);
+
+	if (f && fclose(f)) {
+		perror("fclose");
+		return -1;
+	}
+
+	return 0;
+}
+
+void block_trace_tag(uint8_t tag)
+{
+	trace_tag = tag;
+}
+
+int block_disk_open(const char *diskname)
+{
+	return block_disk_open_backend(diskname, BLOCK_BACKEND_FD);
+}
+
+int block_disk_open_backend(const char *diskname, enum block_backend backend)
+{
+	if (default_disk) {
+		block_error("disk already open");
+		return -1;
+	}
+
+	default_disk = disk_open(diskname, backend);
+
+	return default_disk ? 0 : -1;
+}
+
+int block_disk_close(void)
+{
+	int ret;
+
+	if (!default_disk) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	ret = disk_close(default_disk);
+	default_disk = NULL;
+
+	return ret;
+}
+
+int block_disk_sync(void)
+{
+	return disk_sync(default_disk);
+}
+
+int block_disk_flush(void)
+{
+	return disk_flush(default_disk);
+}
+
+int block_disk_create(const char *diskname, size_t nr_blocks)
+{
+	return block_disk_create_size(diskname, nr_blocks, BLOCK_SIZE);
+}
+
+int block_disk_create_size(const char *diskname, size_t nr_blocks,
+			   size_t block_size)
+{
+	int fd;
+
+	if (!diskname || !nr_blocks || block_size < BLOCK_SIZE_MIN ||
+	    block_size > BLOCK_SIZE_MAX || (block_size & (block_size - 1))) {
+		block_error("invalid disk parameters");
+		return -1;
+	}
+
+	if ((fd = open(diskname, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	/* Blocks that are never written take no room on the host */
+	if (ftruncate(fd, (off_t)nr_blocks * block_size)) {
+		perror("ftruncate");
+		close(fd);
+		unlink(diskname);
+		return -1;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+void *block_map(size_t block, size_t count)
+{
+	return disk_map(default_disk, block, count);
+}
+
+int block_discard(size_t block, size_t count)
+{
+	return disk_discard(default_disk, block, count);
+}
+
+int block_disk_count(void)
+{
+	return disk_count(default_disk);
+}
+
+int block_set_block_size(size_t block_size)
+{
+	return disk_set_block_size(default_disk, block_size);
+}
+
+int block_block_size(void)
+{
+	return disk_block_size(default_disk);
+}
+
+int block_write(size_t block, const void *buf)
+{
+	return disk_write(default_disk, block, buf);
+}
+
+int block_read(size_t block, void *buf)
+{
+	return disk_read(default_disk, block, buf);
+}
+
+int block_readv(const size_t *blocks, void *const *bufs, size_t count)
+{
+	return disk_readv(default_disk, blocks, bufs, count);
+}
+
+int block_writev(const size_t *blocks, const void *const *bufs, size_t count)
+{
+	return disk_writev(default_disk, blocks, bufs, count);
+}
+
+int block_submit(struct block_req *reqs, size_t count)
+{
+	return disk_submit(default_disk, reqs, count);
+}
+
+int block_complete(struct block_req **done, size_t max, size_t min)
+{
+	return disk_complete(default_disk, done, max, min);
+}
+
+int block_register_buffer(void *base, size_t len)
+{
+	return disk_register_buffer(default_disk, base, len);
+}
+
+int block_get_stats(struct disk_stats *stats)
+{
+	return disk_get_stats(default_disk, stats);
+}
+
+int block_trace_start(const char *path)
+{
+	return disk_trace_start(default_disk, path);
+}
+
+int block_trace_stop(void)
+{
+	return disk_trace_stop(default_disk);
+}
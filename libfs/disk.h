@@ -2,10 +2,132 @@
 #define _DISK_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h> /* for fixed-size types of trace records */
 
-/** Size of a disk block in bytes */
+/** Default size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/** Range of block sizes, which are powers of 2 */
+#define BLOCK_SIZE_MIN 512
+#define BLOCK_SIZE_MAX 65536
+
+/** How the blocks of a virtual disk file are accessed */
+enum block_backend {
+	/** System calls on the file */
+	BLOCK_BACKEND_FD,
+	/** Memory mapping of the whole file */
+	BLOCK_BACKEND_MMAP,
+	/** io_uring queues, falling back to %BLOCK_BACKEND_FD if unavailable */
+	BLOCK_BACKEND_IO_URING,
+};
+
+/** Largest number of blocks a single &struct block_req can cover */
+#define BLOCK_REQ_MAX_BLOCKS 1024
+
+/**
+ * struct block_req - Asynchronous block request
+ * @write: 1 to write the blocks, 0 to read them
+ * @block: Index of the first block
+ * @count: Number of contiguous blocks (at most %BLOCK_REQ_MAX_BLOCKS)
+ * @buf: Data buffer (@count blocks), which must stay valid until
+ * the request completes
+ * @result: Set on completion, 0 on success and -1 on failure
+ * @done: Set on completion
+ * @internal: Private
+ * @next: Private
+ */
+struct block_req {
+	int write;
+	size_t block;
+	size_t count;
+	void *buf;
+	int result;
+	int done;
+	int internal;
+	struct block_req *next;
+};
+
+/** Number of buckets of the latency histograms of &struct disk_stats */
+#define DISK_LAT_BUCKETS 32
+
+/**
+ * struct disk_stats - Disk counters
+ * @reads: Read requests, one per call of the synchronous functions and one per
+ * asynchronous request
+ * @read_blocks: Blocks read by these requests
+ * @writes: Write requests
+ * @written_blocks: Blocks written by these requests
+ * @flushes: Calls of block_disk_flush()
+ * @discarded_blocks: Blocks discarded by block_discard()
+ * @read_total_ns: Time spent in synchronous read requests, in nanoseconds
+ * @write_total_ns: Time spent in synchronous write requests, in nanoseconds
+ * @read_ns: Latency histogram of the synchronous read requests. Bucket i counts
+ * the requests that took at least 2^i and less than 2^(i+1) nanoseconds (bucket
+ * 0 those under 2ns, the last bucket every longer one)
+ * @write_ns: Same as @read_ns, for the synchronous write requests
+ */
+struct disk_stats {
+	size_t reads;
+	size_t read_blocks;
+	size_t writes;
+	size_t written_blocks;
+	size_t flushes;
+	size_t discarded_blocks;
+	size_t read_total_ns;
+	size_t write_total_ns;
+	size_t read_ns[DISK_LAT_BUCKETS];
+	size_t write_ns[DISK_LAT_BUCKETS];
+};
+
+/** First bytes of a trace file, "BTRC" */
+#define BLOCK_TRACE_MAGIC 0x43525442
+
+/** Version of the trace format */
+#define BLOCK_TRACE_VERSION 1
+
+/** Requests recorded in a trace */
+enum block_trace_op {
+	BLOCK_TRACE_READ,
+	BLOCK_TRACE_WRITE,
+	BLOCK_TRACE_FLUSH,
+	BLOCK_TRACE_DISCARD,
+};
+
+/**
+ * struct block_trace_header - Header of a trace file
+ * @magic: %BLOCK_TRACE_MAGIC
+ * @version: %BLOCK_TRACE_VERSION
+ * @block_size: Block size of the traced disk, in bytes
+ * @nr_blocks: Block count of the traced disk
+ *
+ * A trace file is this header followed by &struct block_trace_rec records, in
+ * the byte order of the host that recorded it.
+ */
+struct block_trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t block_size;
+	uint32_t nr_blocks;
+};
+
+/**
+ * struct block_trace_rec - Trace record
+ * @time_ns: When the request was issued, in nanoseconds since the trace
+ * started. Records are in time order
+ * @block: Index of the first block
+ * @count: Number of contiguous blocks, 0 for flushes. Requests on longer runs
+ * are recorded as several records
+ * @op: &enum block_trace_op
+ * @tag: Tag of the thread that issued the request, see block_trace_tag()
+ */
+struct block_trace_rec {
+	uint64_t time_ns;
+	uint32_t block;
+	uint16_t count;
+	uint8_t op;
+	uint8_t tag;
+};
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -14,18 +136,92 @@
  * blocks can be read from it with block_read() or written to it with
  * block_write().
  *
+ * Once the disk is open, the other block functions can be called from several
+ * threads at once. Opening and closing the disk must not race with them.
+ *
  * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
  * or is already open. 0 otherwise.
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_backend - Open virtual disk file with a given backend
+ * @diskname: Name of the virtual disk file
+ * @backend: How to access the blocks
+ *
+ * Same as block_disk_open() (which uses %BLOCK_BACKEND_FD), but lets the caller
+ * choose the backend. With %BLOCK_BACKEND_MMAP, the whole file is mapped in
+ * memory, blocks are copied in and out of the mapping, and modified pages reach
+ * the file on block_disk_sync() or block_disk_close(). With
+ * %BLOCK_BACKEND_IO_URING, the file is registered with an io_uring instance and
+ * block_readv(), block_writev() and block_submit() keep several requests in
+ * flight; if io_uring is not available, this is the same as %BLOCK_BACKEND_FD.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or mapped, or is already open. 0 otherwise.
+ */
+int block_disk_open_backend(const char *diskname, enum block_backend backend);
+
+/**
+ * block_disk_create - Create a virtual disk file
+ * @diskname: Name of the virtual disk file
+ * @nr_blocks: Number of blocks of the disk
+ *
+ * Create virtual disk file @diskname, large enough for @nr_blocks blocks that
+ * all read as zeros. The file is sparse: it takes up room on the host as its
+ * blocks get written.
+ *
+ * Return: -1 if @diskname is invalid or already exists, if @nr_blocks is 0, or
+ * if the file cannot be created. 0 otherwise.
+ */
+int block_disk_create(const char *diskname, size_t nr_blocks);
+
+/**
+ * block_disk_create_size - Create a virtual disk file of non-default blocks
+ * @diskname: Name of the virtual disk file
+ * @nr_blocks: Number of blocks of the disk
+ * @block_size: Size of a block in bytes
+ *
+ * Same as block_disk_create(), with blocks of @block_size bytes instead of
+ * %BLOCK_SIZE.
+ *
+ * Return: -1 if @diskname is invalid or already exists, if @nr_blocks is 0,
+ * if @block_size is not a power of 2 between %BLOCK_SIZE_MIN and
+ * %BLOCK_SIZE_MAX, or if the file cannot be created. 0 otherwise.
+ */
+int block_disk_create_size(const char *diskname, size_t nr_blocks,
+			   size_t block_size);
+
 /**
  * block_disk_close - Close virtual disk file
  *
- * Return: -1 if there was no virtual disk file opened. 0 otherwise.
+ * Return: -1 if there was no virtual disk file opened, or if the content of a
+ * mapped virtual disk file cannot be flushed. 0 otherwise.
  */
 int block_disk_close(void);
 
+/**
+ * block_disk_sync - Flush virtual disk file
+ *
+ * Make sure every block written so far reaches the virtual disk file. Only
+ * needed with %BLOCK_BACKEND_MMAP.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if the flush fails. 0
+ * otherwise.
+ */
+int block_disk_sync(void);
+
+/**
+ * block_disk_flush - Flush virtual disk file to stable storage
+ *
+ * Same as block_disk_sync(), and also make sure that the blocks written so far
+ * survive a system crash, which block_disk_sync() doesn't. Much slower.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if the flush fails. 0
+ * otherwise.
+ */
+int block_disk_flush(void);
+
 /**
  * block_disk_count - Get disk's block count
  *
@@ -34,12 +230,36 @@ int block_disk_close(void);
  */
 int block_disk_count(void);
 
+/**
+ * block_set_block_size - Change the disk's block size
+ * @block_size: Size of a block in bytes
+ *
+ * Disks are opened with blocks of %BLOCK_SIZE bytes, or of %BLOCK_SIZE_MIN
+ * bytes if the size of the virtual disk file is not a multiple of
+ * %BLOCK_SIZE. Block indexes and counts of later calls are in blocks of
+ * @block_size bytes instead, and so is the size of their buffers. Only meant to be called right after the disk is
+ * opened, once its block size is known, e.g. from a superblock read with
+ * %BLOCK_SIZE_MIN-byte blocks.
+ *
+ * Return: -1 if no disk is open, if @block_size is not a power of 2 between
+ * %BLOCK_SIZE_MIN and %BLOCK_SIZE_MAX, or if the size of the virtual disk file
+ * is not a multiple of it. 0 otherwise.
+ */
+int block_set_block_size(size_t block_size);
+
+/**
+ * block_block_size - Get the disk's block size
+ *
+ * Return: -1 if no disk is open, otherwise the size of its blocks in bytes.
+ */
+int block_block_size(void);
+
 /**
  * block_write - Write a block to disk
  * @block: Index of the block to write to
  * @buf: Data buffer to write in the block
  *
- * Write the content of buffer @buf (%BLOCK_SIZE bytes) in the virtual disk's
+ * Write the content of buffer @buf (one block) in the virtual disk's
  * block @block.
  *
  * Return: -1 if @block is out of bounds or inaccessible or if the writing
@@ -52,7 +272,7 @@ int block_write(size_t block, const void *buf);
  * @block: Index of the block to read from
  * @buf: Data buffer to be filled with content of block
  *
- * Read the content of virtual disk's block @block (%BLOCK_SIZE bytes) into
+ * Read the content of virtual disk's block @block (one block) into
  * buffer @buf.
  *
  * Return: -1 if @block is out of bounds or inaccessible, or if the reading
@@ -60,5 +280,217 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_readv - Read several blocks from disk
+ * @blocks: Indexes of the blocks to read from
+ * @bufs: Data buffers to be filled, one per block
+ * @count: Number of blocks to read
+ *
+ * Read the content of virtual disk's blocks @blocks[i] (one block each)
+ * into buffers @bufs[i]. Runs of physically contiguous blocks are read with a
+ * single system call.
+ *
+ * Return: -1 if any block is out of bounds or inaccessible, or if a reading
+ * operation fails. 0 otherwise.
+ */
+int block_readv(const size_t *blocks, void *const *bufs, size_t count);
+
+/**
+ * block_writev - Write several blocks to disk
+ * @blocks: Indexes of the blocks to write to
+ * @bufs: Data buffers to write in the blocks, one per block
+ * @count: Number of blocks to write
+ *
+ * Write the content of buffers @bufs[i] (one block each) in the virtual
+ * disk's blocks @blocks[i]. Runs of physically contiguous blocks are written
+ * with a single system call.
+ *
+ * Return: -1 if any block is out of bounds or inaccessible, or if a writing
+ * operation fails. 0 otherwise.
+ */
+int block_writev(const size_t *blocks, const void *const *bufs, size_t count);
+
+/**
+ * block_map - Map blocks in memory
+ * @block: Index of the first block
+ * @count: Number of blocks
+ *
+ * Map the @count blocks starting at @block in memory, copy-on-write: each page
+ * of the mapping is read from the virtual disk file the first time it is
+ * accessed, and changes to the mapping stay in memory, they never reach the
+ * file. Pages that were not changed may reflect later writes to the blocks.
+ * The mapping stays valid once the disk is closed, until it is released with
+ * disk_unmap().
+ *
+ * Return: NULL if the blocks are out of bounds or cannot be mapped. Otherwise,
+ * the address of the first block.
+ */
+void *block_map(size_t block, size_t count);
+
+/**
+ * disk_unmap - Release mapped blocks
+ * @addr: Address returned by block_map() or disk_map(), or NULL
+ * @len: Size of the mapped blocks in bytes
+ *
+ * Return: -1 if the mapping cannot be released. 0 otherwise.
+ */
+int disk_unmap(void *addr, size_t len);
+
+/**
+ * block_discard - Discard blocks
+ * @block: Index of the first block
+ * @count: Number of blocks
+ *
+ * Punch a hole in the virtual disk file over the @count blocks starting at
+ * @block, so that the host can reclaim the room they take. The blocks read as
+ * zeros afterwards.
+ *
+ * Return: -1 if the blocks are out of bounds, or if the file system of the host
+ * cannot punch holes. 0 otherwise.
+ */
+int block_discard(size_t block, size_t count);
+
+/**
+ * block_submit - Start asynchronous block requests
+ * @reqs: Requests to start
+ * @count: Number of requests
+ *
+ * Start the @count requests of @reqs without waiting for them to complete.
+ * Completed requests are collected with block_complete(). Without the io_uring
+ * engine, the requests are carried out before block_submit() returns, but
+ * still have to be collected.
+ *
+ * Return: -1 if no disk is open, or if a request is invalid or out of bounds,
+ * in which case no request is started. 0 otherwise.
+ */
+int block_submit(struct block_req *reqs, size_t count);
+
+/**
+ * block_complete - Collect completed block requests
+ * @done: Array to be filled with the completed requests
+ * @max: Size of @done
+ * @min: Number of completed requests to wait for
+ *
+ * Return up to @max requests started with block_submit() that have completed,
+ * in @done, waiting until at least @min of them have. Fewer than @min requests
+ * are returned if no more requests are in flight.
+ *
+ * Return: -1 if no disk is open. Otherwise the number of requests stored in
+ * @done.
+ */
+int block_complete(struct block_req **done, size_t max, size_t min);
+
+/**
+ * block_register_buffer - Register a long-lived I/O buffer
+ * @base: Start of the buffer, or NULL to drop the registered buffer
+ * @len: Size of the buffer in bytes
+ *
+ * Let the io_uring engine pin @base once, so that transfers to and from blocks
+ * within it avoid mapping the pages on each request. Only one buffer can be
+ * registered at a time, and it must be dropped before being freed. Does
+ * nothing with other backends.
+ *
+ * Return: -1 if no disk is open or if the buffer cannot be registered. 0
+ * otherwise.
+ */
+int block_register_buffer(void *base, size_t len);
+
+/**
+ * block_get_stats - Get disk counters
+ * @stats: Structure to be filled with the counters
+ *
+ * Counters start at 0 when the disk is opened. They are updated with atomic
+ * operations and a clock read per synchronous request, so they are always on.
+ *
+ * Return: -1 if no disk is open or if @stats is NULL. 0 otherwise.
+ */
+int block_get_stats(struct disk_stats *stats);
+
+/**
+ * block_trace_start - Record block requests
+ * @path: Name of the trace file, created or truncated
+ *
+ * Record every request on the disk from now on, one &struct block_trace_rec
+ * per run of contiguous blocks read or written, per flush and per discard,
+ * until block_trace_stop() or block_disk_close(). Asynchronous requests are
+ * recorded when they are submitted. Records are buffered, then written to
+ * @path in the background of the requests.
+ *
+ * Return: -1 if no disk is open, if it is already traced, or if @path cannot
+ * be created. 0 otherwise.
+ */
+int block_trace_start(const char *path);
+
+/**
+ * block_trace_stop - Stop recording block requests
+ *
+ * Write the records still buffered and close the trace file.
+ *
+ * Return: -1 if no disk is open or if the trace cannot be written. 0
+ * otherwise, also if the disk was not traced.
+ */
+int block_trace_stop(void);
+
+/**
+ * block_trace_tag - Tag the requests of the calling thread
+ * @tag: Tag of the trace records of the following requests, usually what the
+ * thread is doing (0 by default)
+ *
+ * The tag is per thread and applies to every disk.
+ */
+void block_trace_tag(uint8_t tag);
+
+/*
+ * The block_*() functions above work on a single virtual disk per process. The
+ * functions below do the same on any number of disks, each one designated by
+ * the handle returned by disk_open().
+ */
+
+/** Open virtual disk (opaque) */
+struct disk;
+
+/**
+ * disk_open - Open a virtual disk file as a new disk instance
+ * @diskname: Name of the virtual disk file
+ * @backend: How to access the blocks
+ *
+ * Same as block_disk_open_backend(), except that any number of disks can be
+ * open at once, each one with its own backend.
+ *
+ * Return: NULL if @diskname is invalid, or if the virtual disk file cannot be
+ * opened or mapped. Otherwise, the new disk.
+ */
+struct disk *disk_open(const char *diskname, enum block_backend backend);
+
+/**
+ * disk_close - Close a disk instance
+ * @d: Disk to close, which cannot be used afterwards
+ *
+ * Return: Same as block_disk_close().
+ */
+int disk_close(struct disk *d);
+
+/* Same as the block_*() functions of the same name, on disk @d */
+int disk_sync(struct disk *d);
+int disk_flush(struct disk *d);
+int disk_count(struct disk *d);
+int disk_set_block_size(struct disk *d, size_t block_size);
+int disk_block_size(struct disk *d);
+int disk_write(struct disk *d, size_t block, const void *buf);
+int disk_read(struct disk *d, size_t block, void *buf);
+int disk_readv(struct disk *d, const size_t *blocks, void *const *bufs,
+	       size_t count);
+int disk_writev(struct disk *d, const size_t *blocks, const void *const *bufs,
+		size_t count);
+int disk_discard(struct disk *d, size_t block, size_t count);
+void *disk_map(struct disk *d, size_t block, size_t count);
+int disk_submit(struct disk *d, struct block_req *reqs, size_t count);
+int disk_complete(struct disk *d, struct block_req **done, size_t max,
+		  size_t min);
+int disk_register_buffer(struct disk *d, void *base, size_t len);
+int disk_get_stats(struct disk *d, struct disk_stats *stats);
+int disk_trace_start(struct disk *d, const char *path);
+int disk_trace_stop(struct disk *d);
+
 #endif /* _DISK_H */
 
@@ -1,11 +1,17 @@
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "cache.h"
 #include "disk.h"
 #include "fs.h"
+#include "journal.h"
 
 //*************************************
 // * MACRO DEFINITIONS
@@ -21,16 +27,67 @@
 			fprintf(stderr, "%s: " fmt "", __func__, ##__VA_ARGS__); \
 	} while (0)
 
-#define FAT_EOC 0xFFFF
+// end of a FAT chain, as returned by `fat_get()`. On disk, it is all ones in
+// the width of the FAT entries of the version
+#define FAT_EOC 0x7FFFFFFF
+#define FAT16_EOC 0xFFFF
+#define FAT32_EOC 0xFFFFFFFF
+// set in the version field of the superblock of version 2 images
+#define SB_VERSION_2 2
+// "JRNL", set in the superblock of images that have a journal
+#define SB_JOURNAL_MAGIC 0x4c4e524a
+// journal record of the FAT, the root directory and `dir` subdirectory
+// blocks. The largest one, with `dir_budget` blocks, must always fit
+#define JOURNAL_RECORD(fs, dir)                                        \
+	journal_record_blocks((fs)->block_size,                            \
+						  (fs)->superblock.num_block_fat + (fs)->rdir_blocks + \
+							  (dir))
+#define JOURNAL_RESERVE(fs) JOURNAL_RECORD(fs, (fs)->dir_budget)
+// records of `dir` subdirectory blocks a journal must hold between two
+// checkpoints, on top of the two `sync_fs()` keeps room for, and the smallest
+// journal that does, header included
+#define JOURNAL_MIN_RECORDS 4
+#define JOURNAL_MIN_BLOCKS(fs, dir) \
+	(JOURNAL_RECORD(fs, dir) * (JOURNAL_MIN_RECORDS + 2) + 1)
+// blocks taken by the root directory, whose entries take 32 bytes each
+#define RDIR_BLOCKS(block_size) \
+	((FS_FILE_MAX_COUNT * 32 + (block_size) - 1) / (block_size))
+// flags of the dirty metadata blocks: changed since the last journal commit,
+// and since the last write in place
+#define DIRTY_JOURNAL 1
+#define DIRTY_HOME 2
+#define DIRTY_ALL (DIRTY_JOURNAL | DIRTY_HOME)
 #define MALLOC_FAIL NULL
+// max number of full blocks handed to the cache in a single vectored call
+#define IO_BATCH 256
+// readahead window of a file descriptor that starts reading sequentially
+#define RA_MIN_BLOCKS 4
+// type of a directory entry, only recorded by version 2
+#define DIRENT_FILE 0
+#define DIRENT_DIR 1
+// largest hash table of a subdirectory, in blocks
+#define DIR_MAX_BUCKETS 65536
+// subdirectories remembered by the path cache, and its hash buckets
+#define PATH_CACHE_SIZE 64
+#define PATH_CACHE_BUCKETS 128
+// entries of the root directory, then those of files open in subdirectories
+#define NODE_COUNT (FS_FILE_MAX_COUNT + FS_OPEN_MAX_COUNT)
+// most subdirectory blocks a journal record holds on top of the FAT and the
+// root directory, and the most a single operation changes
+#define DIR_JOURNAL_BLOCKS 64
+#define DIR_OP_BLOCKS 2
+// hash buckets of the subdirectory blocks waiting for a journal commit
+#define DIR_BLOCK_BUCKETS 256
 
 //*************************************
 // * GLOBAL ARRAYS AND STRUCTURES
 //*************************************
 /**
- * @brief The Superblock data structure definition
+ * @brief  The version 1 superblock, as found on disk.
+ * @note   The rest of the block is all zeros, which tells it from a version 2
+ * 			one. Version 1 images always have blocks of BLOCK_SIZE bytes.
  */
-typedef struct __attribute__((__packed__)) Superblock
+typedef struct __attribute__((__packed__)) SuperblockV1
 {
 	uint8_t sig[8];
 	uint16_t total_num_blocks;
@@ -38,60 +95,421 @@ typedef struct __attribute__((__packed__)) Superblock
 	uint16_t data_block_start_index;
 	uint16_t total_num_data_blocks;
 	uint8_t num_block_fat;
-	uint8_t padding[4079];
+	uint32_t journal_magic;	 // SB_JOURNAL_MAGIC if there is a journal
+	uint16_t journal_start;	 // first data block of the journal
+	uint16_t journal_blocks; // size of the journal
+} SuperblockV1;
+/**
+ * @brief  The version 2 superblock, as found on disk.
+ * @note   The fields of version 1 are all zeros, so that a driver that only
+ * 			knows version 1 refuses the image: its block count doesn't match
+ * 			the disk. `version` overlaps the zeros that follow a version 1
+ * 			superblock. Images written before `block_size` was added have
+ * 			it 0, for BLOCK_SIZE. The superblock fits in the smallest
+ * 			block, BLOCK_SIZE_MIN, so that it can be read before the block
+ * 			size is known.
+ */
+typedef struct __attribute__((__packed__)) SuperblockV2
+{
+	uint8_t sig[8];
+	uint8_t v1_fields[17];
+	uint32_t version; // SB_VERSION_2
+	uint32_t total_num_blocks;
+	uint32_t root_dir_block_index;
+	uint32_t data_block_start_index;
+	uint32_t total_num_data_blocks;
+	uint32_t num_block_fat;
+	uint32_t journal_magic;
+	uint32_t journal_start;
+	uint32_t journal_blocks;
+	uint32_t block_size;
+} SuperblockV2;
+/**
+ * @brief  The Superblock data structure definition, decoded from either
+ * 			version by `load_superblock()`.
+ */
+typedef struct Superblock
+{
+	uint8_t sig[8];
+	int version; // FS_VERSION_1 or FS_VERSION_2
+	size_t total_num_blocks;
+	size_t root_dir_block_index;
+	size_t data_block_start_index;
+	size_t total_num_data_blocks;
+	size_t num_block_fat;
+	uint32_t journal_magic; // SB_JOURNAL_MAGIC if there is a journal
+	size_t journal_start;	// first data block of the journal
+	size_t journal_blocks;	// size of the journal
+	size_t block_size;		// size of a block in bytes
 } Superblock;
 /**
- * @brief  The root directory table NODE data structure definition
- * @note   An empty entry is defined by the first character of the entry’s 
- * 			filename being equal to the NULL character.
+ * @brief  The root directory entries of version 1 and 2, as found on disk.
+ * 			Both take 32 bytes, so the root directory takes 4 KiB either
+ * 			way: a single block of BLOCK_SIZE bytes, several smaller ones.
+ * 			Version 2 records the type of the entry, DIRENT_FILE or
+ * 			DIRENT_DIR, and its subdirectories hold entries of the same
+ * 			layout.
  */
-typedef struct __attribute__((__packed__)) DirectoryTableNode
+typedef struct __attribute__((__packed__)) DirectoryEntryV1
 {
 	uint8_t filename[16];
 	uint32_t file_size;
 	uint16_t first_data_block_index;
 	uint8_t padding[10];
+} DirectoryEntryV1;
+typedef struct __attribute__((__packed__)) DirectoryEntryV2
+{
+	uint8_t filename[16];
+	uint64_t file_size;
+	uint32_t first_data_block_index;
+	uint8_t type;
+	uint8_t padding[3];
+} DirectoryEntryV2;
+/**
+ * @brief  The root directory table NODE data structure definition
+ * @note   An empty entry is defined by the first character of the entry’s 
+ * 			filename being equal to the NULL character. Entries are decoded
+ * 			from either version, the first data block of an empty file
+ * 			being FAT_EOC.
+ */
+typedef struct DirectoryTableNode
+{
+	uint8_t filename[16];
+	size_t file_size;
+	uint32_t first_data_block_index;
+	uint8_t type; // DIRENT_FILE or DIRENT_DIR
 } DirectoryTableNode;
 /**
  * @brief  Structure to hold data of the opened file.
- * @note   if `offset` = -1, then the node is uninitialized
+ * @note   if `metadata` = NULL, then the node is uninitialized. `blk_map`
+ * 			caches the file's FAT chain: `blk_map[i]` is the data block
+ * 			holding the i-th block of the file. It is resolved lazily, so
+ * 			only the first `blk_map_len` entries are valid. `resv_len`
+ * 			blocks starting at `resv_start` are reserved for the next blocks
+ * 			of the file: marked used in the free-space bitmap but not yet in
+ * 			the FAT. `blk_map_gen` is the value of the file's `chain_gen`
+ * 			the block map was resolved with. `ra_next` is the block of the
+ * 			file a sequential read would start at, `ra_window` the number
+ * 			of blocks read ahead of it, and blocks up to `ra_end` were read
+ * 			ahead already.
+ * 			`block_buf` holds the partial blocks of the reads and writes on
+ * 			the file descriptor, as a block can be too large for the stack.
  */
 typedef struct OpenedFileNode
 {
 	DirectoryTableNode *metadata;
-	unsigned int offset;
-	unsigned int blks_traversed;
-	unsigned int seeked_block;
+	size_t offset;
+	uint32_t *blk_map;
+	size_t blk_map_len;
+	size_t blk_map_cap;
+	unsigned int blk_map_gen;
+	uint32_t resv_start;
+	uint32_t resv_len;
+	size_t ra_next;
+	size_t ra_window;
+	size_t ra_end;
+	char *block_buf;
 } OpenedFileNode;
 
 /**
- * @brief  File Allocation Table (FAT), initialized during `fs_mount()`.
- * @note   First element in the array is always FAT_EOC. Size of FAT is
- * 			is 2 x # of data blocks = # of FAT blocks. 
+ * @brief  A run of consecutive data blocks.
+ */
+typedef struct BlockRun
+{
+	size_t start;
+	size_t len;
+} BlockRun;
+/**
+ * @brief  Runs of data blocks freed from the FAT but still marked used in the
+ * 			free-space bitmap, so that nobody gets them before their hole is
+ * 			punched by `discard_runs()`.
+ */
+typedef struct FreedRuns
+{
+	BlockRun *runs;
+	size_t len;
+	size_t cap;
+	int hold; // * keep the runs even without discard, see `held_runs`
+} FreedRuns;
+
+/**
+ * @brief  A subdirectory remembered by the path cache.
+ * @note   A subdirectory is a hash table of `nr_buckets` blocks, a power of
+ * 			2: the entry named `name` is in any slot of bucket
+ * 			`name_hash32(name) & (nr_buckets - 1)`. `blk_map[i]` is the data
+ * 			block of bucket `i`. `path` is the path of the subdirectory
+ * 			from the root directory, without leading slash, empty if the
+ * 			node is unused. `next` links the nodes of a same hash chain of
+ * 			the cache (-1 ends a chain), and `last_used` orders them for
+ * 			eviction.
+ */
+typedef struct PathCacheNode
+{
+	char path[FS_PATH_LEN];
+	uint32_t *blk_map;
+	size_t nr_buckets;
+	int16_t next;
+	unsigned long last_used;
+} PathCacheNode;
+/**
+ * @brief  Where the entry of a file open in a subdirectory lives on disk:
+ * 			slot `slot` of data block `block`. `dirty` is set when the
+ * 			entry changed in memory since it was last written back.
  */
-static uint16_t *FAT;
+typedef struct SubdirEntryLoc
+{
+	uint32_t block;
+	uint32_t slot;
+	uint8_t dirty;
+} SubdirEntryLoc;
 /**
- * @brief Root directory table consisting of FS_FILE_MAX_COUNT entries.
+ * @brief  A subdirectory block changed in memory and not yet handed to the
+ * 			cache, with a journal: data block `block` holds `data`. `dirty`
+ * 			is set when it changed since the last commit. `next` links the
+ * 			blocks of a same hash chain, or the unused entries (-1 ends a
+ * 			chain). `data` is kept when the entry is unused.
  */
-static DirectoryTableNode RootDirectory[FS_FILE_MAX_COUNT];
+typedef struct DirBlock
+{
+	uint32_t block;
+	int32_t next;
+	uint8_t dirty;
+	char *data;
+} DirBlock;
+
+#define DIR_HASH_BUCKETS (2 * FS_FILE_MAX_COUNT)
+
 /**
- * @brief  Opened File Table (OFT), contains pointers to all opened files, and
- * 			the files' offset information.
- * @note   The index of the array is the file descriptor number
+ * @brief  A mounted file system, returned by `fs_mount_ex()`. Everything the
+ * 			file system needs lives here, so that any number of them can be
+ * 			mounted at once.
  */
-static OpenedFileNode OFT[FS_OPEN_MAX_COUNT];
+struct fs
+{
+	struct disk *disk;	 // * virtual disk holding the file system
+	struct cache *cache; // * block cache of the data blocks of `disk`
+	Superblock superblock; // * Superblock instance
+	size_t block_size;	   // * size of a block in bytes
+	size_t rdir_blocks;	   // * blocks taken by the root directory
+	size_t fat_size;		 // * size of FAT, in bytes
+	uint8_t total_files_open; // * count of currently opened files
+	/**
+	 * @brief  File Allocation Table (FAT), initialized during mount.
+	 * @note   First element in the array is always FAT_EOC. The FAT blocks
+	 * 			are kept as they are on disk, with 16-bit entries in version
+	 * 			1 and 32-bit ones in version 2 (`fat32`), so they are only
+	 * 			accessed through `fat_get()` and `write_fat()`. With
+	 * 			`fat_mapped` set, it is a private mapping of the FAT blocks
+	 * 			of the disk, read in as its pages are first touched.
+	 */
+	uint8_t *FAT;
+	int fat_mapped;
+	int fat32;
+	size_t fat_per_block; // * FAT entries per FAT block
+	/**
+	 * @brief  Blocks of metadata changed since the last sync.
+	 * @note   `fat_dirty[i]` holds the DIRTY_* flags of FAT block `i`,
+	 * 			under `alloc_lock`. `rdir_dirty` holds the ones of the root
+	 * 			directory. The superblock only changes when a journal is
+	 * 			created.
+	 */
+	uint8_t *fat_dirty;
+	uint8_t rdir_dirty;
+	struct journal *journal; // * metadata journal, NULL if none
+	/**
+	 * @brief Root directory table consisting of FS_FILE_MAX_COUNT entries,
+	 * 			followed by the entries of the files open in subdirectories.
+	 * @note   Entry FS_FILE_MAX_COUNT + i is used when its `open_count` is
+	 * 			not 0, and `sub_locs[i]` tells where it lives on disk. It is
+	 * 			written back to its directory block by `sync_fs()`, and when
+	 * 			its last file descriptor is closed.
+	 */
+	DirectoryTableNode RootDirectory[NODE_COUNT];
+	SubdirEntryLoc sub_locs[FS_OPEN_MAX_COUNT];
+	/**
+	 * @brief  Opened File Table (OFT), contains pointers to all opened files,
+	 * 			and the files' offset information.
+	 * @note   The index of the array is the file descriptor number
+	 */
+	OpenedFileNode OFT[FS_OPEN_MAX_COUNT];
+
+	/**
+	 * @brief  In-memory index of the root directory, built during mount.
+	 * @note   `dir_buckets` holds the first entry of each hash chain and
+	 * 			`dir_next` links entries of the same chain (-1 ends a chain).
+	 * 			`free_slots` is a stack of the empty entries. `open_count`
+	 * 			counts the file descriptors open on each entry.
+	 */
+	int16_t dir_buckets[DIR_HASH_BUCKETS];
+	int16_t dir_next[FS_FILE_MAX_COUNT];
+	int16_t free_slots[FS_FILE_MAX_COUNT];
+	int free_slot_count;
+	uint8_t open_count[NODE_COUNT];
+
+	/**
+	 * @brief  Path cache of the subdirectories, filled as paths are resolved.
+	 * @note   `path_buckets` holds the first node of each hash chain of
+	 * 			`path_cache`, and the least recently used node is evicted
+	 * 			when the cache is full. `dir_buf` is scratch space of two
+	 * 			blocks for the subdirectory blocks.
+	 */
+	PathCacheNode path_cache[PATH_CACHE_SIZE];
+	int16_t path_buckets[PATH_CACHE_BUCKETS];
+	unsigned long path_clock;
+	char *dir_buf;
+
+	/**
+	 * @brief  Subdirectory blocks changed since the last sync, with a
+	 * 			journal.
+	 * @note   Changes to the blocks of subdirectories are committed in the
+	 * 			same record as the FAT and the root directory, and only
+	 * 			handed to the cache afterwards. `dir_blocks` has room for
+	 * 			`dir_budget` of them, see `init_dir_blocks()`; 0 if the
+	 * 			journal is too small for directories. `dir_block_buckets`
+	 * 			holds the first entry of each hash chain and `dir_free` the
+	 * 			first unused one. `held_runs` are the blocks of deleted
+	 * 			subdirectories, under `alloc_lock`: replaying a record that
+	 * 			holds one of them would overwrite whoever got it next, so
+	 * 			they stay used until a checkpoint empties the journal.
+	 * 			`pending_runs` are the blocks of deleted or truncated files
+	 * 			waiting for their hole, also under `alloc_lock`: a crash
+	 * 			before the record that frees them is committed would bring
+	 * 			back a FAT that still owns them, so they are punched once a
+	 * 			commit holds that record.
+	 */
+	DirBlock *dir_blocks;
+	size_t dir_budget;
+	size_t nr_dir_blocks;
+	int32_t dir_block_buckets[DIR_BLOCK_BUCKETS];
+	int32_t dir_free;
+	FreedRuns held_runs;
+	FreedRuns pending_runs;
+
+	/**
+	 * @brief  Free-space bitmap of the data blocks, built during mount, or
+	 * 			by the first allocation with a mapped FAT.
+	 * @note   A set bit in `free_map` means the data block is free. Bit `i`
+	 * 			of `free_summary` is set when word `i` of `free_map` has a
+	 * 			free block, so a free block is found in a couple of word
+	 * 			lookups.
+	 */
+	uint64_t *free_map;
+	uint64_t *free_summary;
+	size_t free_blocks;		// * count of free data blocks
+	size_t reserved_blocks; // * count of blocks reserved by open files
+	size_t prealloc_blocks; // * size of the run reserved for a new extent
+	size_t readahead_max;	// * largest readahead window, 0 if disabled
+	int discard;			// * punch holes where blocks are freed
+
+	/**
+	 * @brief  Counters of `fs_stats()`, reset at mount time.
+	 * @note   `op_stats` and `fat_steps` are updated atomically,
+	 * 			`allocated_blocks` and `freed_blocks` under `alloc_lock`.
+	 */
+	struct fs_op_stats op_stats[FS_OP_COUNT];
+	size_t fat_steps;
+	size_t allocated_blocks;
+	size_t freed_blocks;
+
+	/**
+	 * @brief  Locks that let several threads use the file system at once.
+	 * @note   `fd_locks[fd]` serializes the calls on file descriptor `fd`
+	 * 			(its offset and block map). `file_locks[i]` guards the file
+	 * 			of entry `i` of `RootDirectory` (its size, FAT chain and
+	 * 			data): readers share it, writers hold it alone. `dir_lock`
+	 * 			guards the names in the root directory, its index, the
+	 * 			subdirectory blocks and `dir_blocks`, the path cache, the
+	 * 			open counts, the OFT slots and `sub_locs`. `alloc_lock`
+	 * 			guards the FAT, the free-space bitmap and the reservations.
+	 * 			When several are needed, they are taken in this order: fd,
+	 * 			dir, file, alloc.
+	 */
+	pthread_mutex_t fd_locks[FS_OPEN_MAX_COUNT];
+	pthread_rwlock_t file_locks[NODE_COUNT];
+	// * bumped under the file lock when a file loses blocks, so that the
+	// * block maps of its other file descriptors get resolved again
+	unsigned int chain_gen[NODE_COUNT];
+	pthread_mutex_t dir_lock;
+	pthread_mutex_t alloc_lock;
+	pthread_mutex_t sync_lock; // * serializes `sync_fs()`
+
+	/**
+	 * @brief  Background flusher thread, running if `flusher_running` is
+	 * 			set. `flush_lock` guards the flags below. `flush_wake` wakes
+	 * 			the flusher up and `flush_done` is signaled after each of its
+	 * 			passes, which are counted by `flush_passes`.
+	 */
+	pthread_t flusher;
+	int flusher_running;
+	pthread_mutex_t flush_lock;
+	pthread_cond_t flush_wake;
+	pthread_cond_t flush_done;
+	int flush_requested;
+	int flush_stop;
+	unsigned long flush_passes;
+	unsigned int flush_interval_ms;
+	size_t dirty_background; // * dirty blocks that wake the flusher up
+	size_t dirty_limit;		 // * dirty blocks that make writers wait
+
+	/**
+	 * @brief  Group commit of the durable metadata operations, enabled by
+	 * 			`durable_metadata`. `commit_lock` guards the fields below.
+	 * 			Commits are numbered from 1: `commit_next` is the number of
+	 * 			the next one to start and `commit_done` the number of the last
+	 * 			one that completed, with `commit_result`. `committing` is set
+	 * 			while one runs, and `commit_cond` signaled when it completes.
+	 */
+	int durable_metadata;
+	pthread_mutex_t commit_lock;
+	pthread_cond_t commit_cond;
+	unsigned long commit_next;
+	unsigned long commit_done;
+	int committing;
+	int commit_result;
+};
 
 //*************************************
 // * GLOBAL VARIABLES
 //*************************************
-static Superblock superblock;	// * Superblock instance
-static uint16_t fat_size;		 // * size of FAT
-static uint8_t total_files_open; // * count of currently opened files
+/**
+ * @brief  File system used by the functions that don't take one, mounted with
+ * 			`fs_mount()`. `default_lock` serializes its mount and unmount,
+ * 			and `last_stats` keeps the cache counters of the last file system
+ * 			unmounted with `fs_umount()`.
+ */
+static struct fs *default_fs;
+static pthread_mutex_t default_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fs_cache_stats last_stats;
+/**
+ * @brief  Names of the calls, used by `fs_op_name()` and `fs_stats_dump()`.
+ */
+static const char *const op_names[FS_OP_COUNT] = {
+	[FS_OP_MOUNT] = "mount",
+	[FS_OP_SYNC] = "sync",
+	[FS_OP_SYNC_ASYNC] = "sync_async",
+	[FS_OP_INFO] = "info",
+	[FS_OP_CREATE] = "create",
+	[FS_OP_DELETE] = "delete",
+	[FS_OP_LS] = "ls",
+	[FS_OP_OPEN] = "open",
+	[FS_OP_CLOSE] = "close",
+	[FS_OP_STAT] = "stat",
+	[FS_OP_LSEEK] = "lseek",
+	[FS_OP_WRITE] = "write",
+	[FS_OP_RESERVE] = "reserve",
+	[FS_OP_TRUNCATE] = "truncate",
+	[FS_OP_FALLOCATE] = "fallocate",
+	[FS_OP_READ] = "read",
+	[FS_OP_MKDIR] = "mkdir",
+	[FS_OP_RMDIR] = "rmdir",
+	[FS_OP_READDIR] = "readdir",
+};
 
 //*************************************
 // ! DEBUG FUNCTIONS
 // ! will be DISABLED on final release
 //*************************************
+static uint32_t fat_get(struct fs *fs, size_t idx);
 /**
  * @brief  prints some of the contents of disk
  * @note   pcd() - PrintContentsOfDisk()
@@ -99,34 +517,35 @@ static uint8_t total_files_open; // * count of currently opened files
  * @param  root_dir_amt: amount of file data to print
  * @retval None
  */
-void pcd(int fat_print_amt, int root_dir_amt)
+void pcd(struct fs *fs, int fat_print_amt, int root_dir_amt)
 {
 	print_out("-----DISK DATA BEGIN-----\n");
 	print_out("\n");
 	print_out("---SUPER BLOCK---\n");
-	print_out("Signature: %s\n", (char *)superblock.sig);
-	print_out("Total amount of blocks of virtual disk: %d\n",
-			  superblock.total_num_blocks);
-	print_out("Root directory block index: %d\n",
-			  superblock.root_dir_block_index);
-	print_out("Data block start index: %d\n",
-			  superblock.data_block_start_index);
-	print_out("Amount of data blocks: %d\n", superblock.total_num_data_blocks);
-	print_out("Number of blocks for FAT: %d\n", superblock.num_block_fat);
+	print_out("Signature: %s\n", (char *)fs->superblock.sig);
+	print_out("Version: %d\n", fs->superblock.version);
+	print_out("Total amount of blocks of virtual disk: %zu\n",
+			  fs->superblock.total_num_blocks);
+	print_out("Root directory block index: %zu\n",
+			  fs->superblock.root_dir_block_index);
+	print_out("Data block start index: %zu\n",
+			  fs->superblock.data_block_start_index);
+	print_out("Amount of data blocks: %zu\n", fs->superblock.total_num_data_blocks);
+	print_out("Number of blocks for FAT: %zu\n", fs->superblock.num_block_fat);
 	print_out("\n");
 	print_out("---FAT TABLE: first %d items---\n", fat_print_amt);
 	for (size_t i = 0; i < fat_print_amt; i++)
 	{
-		print_out("Index %ld: %d\n", i, *(FAT + i));
+		print_out("Index %ld: %u\n", i, fat_get(fs, i));
 	}
 	print_out("\n");
 	print_out("---ROOT DIR: first %d items---\n", root_dir_amt);
 	for (size_t i = 0; i < root_dir_amt; i++)
 	{
-		print_out("Filename [%ld]: %s\n", i, (char *)RootDirectory[i].filename);
-		print_out("Filesize [%ld]: %d\n", i, RootDirectory[i].file_size);
-		print_out("Index of first data block [%ld]: %d\n", i,
-				  RootDirectory[i].first_data_block_index);
+		print_out("Filename [%ld]: %s\n", i, (char *)fs->RootDirectory[i].filename);
+		print_out("Filesize [%ld]: %zu\n", i, fs->RootDirectory[i].file_size);
+		print_out("Index of first data block [%ld]: %u\n", i,
+				  fs->RootDirectory[i].first_data_block_index);
 		print_out("\n");
 	}
 	print_out("-----DISK DATA END-----\n");
@@ -136,434 +555,4191 @@ void pcd(int fat_print_amt, int root_dir_amt)
 // * HELPER FUNCTIONS
 //*************************************
 /**
- * @brief  iterate through the root directory array and increment the counter
- * 			`count` if array element is not NULL.
- * @note   
- * @retval returns the total number of elements in the root directory array
+ * @brief  load_superblock decodes the superblock of either version.
+ * @note   a version 2 superblock has its version set and the version 1 block
+ * 			count cleared, anything else is read as version 1.
+ * @param  sb: filled with the decoded superblock
+ * @param  block: content of the first block of the disk
+ * @retval None
  */
-int count_root_dir_nodes(void)
+static void load_superblock(Superblock *sb, const void *block)
 {
-	int count = 0;
-	for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++)
+	const SuperblockV1 *v1 = (const SuperblockV1 *)block;
+	const SuperblockV2 *v2 = (const SuperblockV2 *)block;
+	memcpy(sb->sig, v1->sig, sizeof(sb->sig));
+	if (v2->version == SB_VERSION_2 && v1->total_num_blocks == 0)
 	{
-		if (RootDirectory[i].filename[0] != '\0')
-		{
-			count++;
-		}
+		sb->version = FS_VERSION_2;
+		sb->total_num_blocks = v2->total_num_blocks;
+		sb->root_dir_block_index = v2->root_dir_block_index;
+		sb->data_block_start_index = v2->data_block_start_index;
+		sb->total_num_data_blocks = v2->total_num_data_blocks;
+		sb->num_block_fat = v2->num_block_fat;
+		sb->journal_magic = v2->journal_magic;
+		sb->journal_start = v2->journal_start;
+		sb->journal_blocks = v2->journal_blocks;
+		sb->block_size = v2->block_size ? v2->block_size : BLOCK_SIZE;
 	}
-	return count;
-}
-/**
- * @brief  iterate through all fat table entries and increment the counter
- * 			`count` if array element is not 0.
- * @note   
- * @retval returns the total number of non-zero elements in the FAT.
- */
-int count_fat_entries(void)
-{
-	uint16_t entries = superblock.total_num_data_blocks;
-	int count = 0;
-	for (size_t i = 0; i < entries; i++)
+	else
 	{
-		if (FAT[i] != 0)
-		{
-			count++;
-		}
+		sb->version = FS_VERSION_1;
+		sb->total_num_blocks = v1->total_num_blocks;
+		sb->root_dir_block_index = v1->root_dir_block_index;
+		sb->data_block_start_index = v1->data_block_start_index;
+		sb->total_num_data_blocks = v1->total_num_data_blocks;
+		sb->num_block_fat = v1->num_block_fat;
+		sb->journal_magic = v1->journal_magic;
+		sb->journal_start = v1->journal_start;
+		sb->journal_blocks = v1->journal_blocks;
+		sb->block_size = BLOCK_SIZE;
 	}
-	return count;
 }
 /**
- * @brief  seek_blocks seeks to the index of the block to read/write based
- * 			on the offset provided.
- * @note   
- * @param  fd: file descriptor id
- * @param  offset: offset to read data from
- * @retval -1 if offset is out of bounds. Otherwise, return index of the block.
+ * @brief  store_superblock encodes a superblock in the layout of its version.
+ * @param  sb: superblock to encode
+ * @param  block: buffer of `sb->block_size` bytes to be filled
+ * @retval None
  */
-int seek_blocks(int fd, size_t offset)
+static void store_superblock(const Superblock *sb, void *block)
 {
-	// traverse through the blocks based on the offset
-	int blks_traversed = 0;
-	while (offset > BLOCK_SIZE)
-	{
-		offset -= BLOCK_SIZE;
-		blks_traversed++;
-	}
-
-	// return the first block if blocks traversed is 0
-	OFT[fd].blks_traversed = blks_traversed;
-	uint16_t curr_block = OFT[fd].metadata->first_data_block_index;
-	if (blks_traversed == 0)
+	SuperblockV1 *v1 = (SuperblockV1 *)block;
+	SuperblockV2 *v2 = (SuperblockV2 *)block;
+	memset(block, 0, sb->block_size);
+	memcpy(v1->sig, sb->sig, sizeof(sb->sig));
+	if (sb->version == FS_VERSION_2)
 	{
-		return curr_block;
+		v2->version = SB_VERSION_2;
+		v2->total_num_blocks = sb->total_num_blocks;
+		v2->root_dir_block_index = sb->root_dir_block_index;
+		v2->data_block_start_index = sb->data_block_start_index;
+		v2->total_num_data_blocks = sb->total_num_data_blocks;
+		v2->num_block_fat = sb->num_block_fat;
+		v2->journal_magic = sb->journal_magic;
+		v2->journal_start = sb->journal_start;
+		v2->journal_blocks = sb->journal_blocks;
+		v2->block_size = sb->block_size;
 	}
-
-	// else return the block index after some count of traversal
-	for (size_t i = 0; i < blks_traversed; i++)
+	else
 	{
-		curr_block = FAT[curr_block];
-		if (curr_block == FAT_EOC)
-		{ // offset is so high such that the user is trying to read beyond EOF
-			return -1;
-		}
+		v1->total_num_blocks = sb->total_num_blocks;
+		v1->root_dir_block_index = sb->root_dir_block_index;
+		v1->data_block_start_index = sb->data_block_start_index;
+		v1->total_num_data_blocks = sb->total_num_data_blocks;
+		v1->num_block_fat = sb->num_block_fat;
+		v1->journal_magic = sb->journal_magic;
+		v1->journal_start = sb->journal_start;
+		v1->journal_blocks = sb->journal_blocks;
 	}
-	OFT[fd].seeked_block = curr_block;
-	return curr_block;
 }
 /**
- * @brief  add_fat_entry adds an entry to the FAT index, and updates the old
- * 			EOF block to new entry and the new entry to EOF.
- * @note   
- * @param  eof_block: update the old EOF block.. 
- * @retval -1 if no free blocks available. Otherwise returns the index of the
- * 			new FAT entry.
+ * @brief  load_dir_entry/store_dir_entry decode and encode entry `i` of the
+ * 			directory blocks `rdir`, in the layout of the version of the
+ * 			file system.
+ * @param  rdir: content of the root directory blocks, or of a subdirectory
+ * 			block
+ * @param  i: index of the entry
+ * @param  entry: decoded entry
+ * @retval None
  */
-int add_fat_entry(int eof_block)
+static void load_dir_entry(struct fs *fs, DirectoryTableNode *entry,
+						   const void *rdir, size_t i)
 {
-	uint16_t entries = superblock.total_num_data_blocks;
-	if (count_fat_entries() >= entries)
+	if (fs->superblock.version == FS_VERSION_2)
 	{
-		// no space available in the FAT
-		return -1;
+		const DirectoryEntryV2 *v2 = (const DirectoryEntryV2 *)rdir + i;
+		memcpy(entry->filename, v2->filename, FS_FILENAME_LEN);
+		entry->file_size = v2->file_size;
+		entry->first_data_block_index =
+			v2->first_data_block_index == FAT32_EOC
+				? FAT_EOC
+				: v2->first_data_block_index;
+		entry->type = v2->type;
 	}
-	// find the first free entry in the FAT
-	size_t free_entry_idx = 0;
-	for (free_entry_idx = 0; free_entry_idx < entries; free_entry_idx++)
+	else
 	{
-		if (FAT[free_entry_idx] == 0)
-		{
-			break;
-		}
+		const DirectoryEntryV1 *v1 = (const DirectoryEntryV1 *)rdir + i;
+		memcpy(entry->filename, v1->filename, FS_FILENAME_LEN);
+		entry->file_size = v1->file_size;
+		entry->first_data_block_index =
+			v1->first_data_block_index == FAT16_EOC
+				? FAT_EOC
+				: v1->first_data_block_index;
+		entry->type = DIRENT_FILE;
 	}
-	// replace EOF block with new FAT entry, and update new FAT entry with
-	// FAT EOC
-	FAT[free_entry_idx] = FAT_EOC;
-	FAT[eof_block] = free_entry_idx;
-
-	return free_entry_idx;
 }
-//*************************************
-// * IMPLEMENTATION
-//*************************************
-
-int fs_mount(const char *diskname)
+static void store_dir_entry(struct fs *fs, void *rdir, size_t i,
+							const DirectoryTableNode *entry)
 {
-	memset(&superblock, 0, BLOCK_SIZE);
-	char *signature = "ECS150FS";
-
-	if (block_disk_open(diskname))
+	if (fs->superblock.version == FS_VERSION_2)
 	{
-		print_out("disk cannot be opened.\n");
-		return -1;
+		DirectoryEntryV2 *v2 = (DirectoryEntryV2 *)rdir + i;
+		memset(v2, 0, sizeof(DirectoryEntryV2));
+		memcpy(v2->filename, entry->filename, FS_FILENAME_LEN);
+		v2->file_size = entry->file_size;
+		v2->first_data_block_index =
+			entry->first_data_block_index == FAT_EOC
+				? FAT32_EOC
+				: entry->first_data_block_index;
+		v2->type = entry->type;
 	}
-
-	if (block_read(0, &superblock))
+	else
 	{
-		print_out("unable to read superblock from disk.\n");
-		return -1;
+		DirectoryEntryV1 *v1 = (DirectoryEntryV1 *)rdir + i;
+		memset(v1, 0, sizeof(DirectoryEntryV1));
+		memcpy(v1->filename, entry->filename, FS_FILENAME_LEN);
+		v1->file_size = entry->file_size;
+		v1->first_data_block_index =
+			entry->first_data_block_index == FAT_EOC
+				? FAT16_EOC
+				: entry->first_data_block_index;
 	}
-
-	for (size_t i = 0; i < strlen(signature); i++)
+}
+/**
+ * @brief  read_rdir reads the root directory blocks and decodes every entry.
+ * @retval -1 if memory cannot be allocated or the blocks cannot be read. 0
+ * 			otherwise.
+ */
+static int read_rdir(struct fs *fs)
+{
+	char *rdir = malloc(fs->rdir_blocks * fs->block_size);
+	size_t *blocks = malloc(fs->rdir_blocks * sizeof(size_t));
+	void **bufs = malloc(fs->rdir_blocks * sizeof(void *));
+	int ret = -1;
+	if (rdir != MALLOC_FAIL && blocks != MALLOC_FAIL && bufs != MALLOC_FAIL)
 	{
-		if (signature[i] != (char)superblock.sig[i])
+		for (size_t i = 0; i < fs->rdir_blocks; i++)
 		{
-			print_out("invalid signature.\n");
-			return -1;
+			blocks[i] = fs->superblock.root_dir_block_index + i;
+			bufs[i] = rdir + i * fs->block_size;
 		}
+		ret = disk_readv(fs->disk, blocks, bufs, fs->rdir_blocks);
 	}
-	if (superblock.total_num_blocks != block_disk_count())
+	for (size_t i = 0; ret == 0 && i < FS_FILE_MAX_COUNT; i++)
 	{
-		print_out("total number of blocks do not match.\n");
-		return -1;
+		load_dir_entry(fs, &fs->RootDirectory[i], rdir, i);
 	}
-
-	//* allocate File Allocation Table and copy its contents from disk
-	fat_size = superblock.num_block_fat * BLOCK_SIZE;
-	FAT = (uint16_t *)malloc(fat_size);
-	if (FAT == MALLOC_FAIL)
+	free(rdir);
+	free(blocks);
+	free(bufs);
+	return ret;
+}
+/**
+ * @brief  lock_fd checks file descriptor `fd` and locks it.
+ * @param  fd: file descriptor id
+ * @retval -1 if no file system is given, or if `fd` is out of range or not
+ * 			open, in which case nothing is
+ * 			locked. 0 otherwise.
+ */
+static int lock_fd(struct fs *fs, int fd)
+{
+	if (fs == NULL)
 	{
-		print_out("unable to allocate memory for FAT.\n");
+		print_out("no virtual disk was open.\n");
+		return -1;
 	}
-	memset(FAT, 0, fat_size);
-	for (size_t i = 0; i < superblock.num_block_fat; i++)
+	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT)
 	{
-		if (block_read(i + 1, FAT + (i * BLOCK_SIZE / 2)))
-		{
-			print_out("unable to copy contents of the FAT from disk.\n");
-			return -1;
-		}
+		print_out("invalid file descriptor.\n");
+		return -1;
 	}
-	FAT[0] = FAT_EOC;
-
-	//* copy the root directory from disk
-	memset(RootDirectory, 0, BLOCK_SIZE);
-	if (block_read(superblock.root_dir_block_index, RootDirectory))
+	pthread_mutex_lock(&fs->fd_locks[fd]);
+	if (fs->OFT[fd].metadata == NULL)
 	{
-		print_out("unable to copy contents of the root directory from disk.\n");
+		pthread_mutex_unlock(&fs->fd_locks[fd]);
+		print_out("metadata not found.\n");
 		return -1;
 	}
-
-	// clear opened file descriptor array by setting meta data ptr to NULL
-	for (size_t i = 0; i < FS_OPEN_MAX_COUNT; i++)
+	return 0;
+}
+/**
+ * @brief  file_lock returns the lock of the file opened as `fd`.
+ * @param  fd: file descriptor id, locked with `lock_fd()`
+ * @retval pointer to the reader-writer lock of the file
+ */
+static pthread_rwlock_t *file_lock(struct fs *fs, int fd)
+{
+	return &fs->file_locks[fs->OFT[fd].metadata - fs->RootDirectory];
+}
+/**
+ * @brief  fnv_hash hashes the `len` first characters of `str` (FNV-1a).
+ * @retval the hash
+ */
+static uint32_t fnv_hash(const char *str, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; i++)
 	{
-		OFT[i].metadata = NULL;
-		OFT[i].offset = 0;
-		OFT[i].seeked_block = 0;
-		OFT[i].blks_traversed = 0;
+		hash = (hash ^ (uint8_t)str[i]) * 16777619u;
 	}
-
-	// print out superblock, FAT, and root dir block
-	//pcd(15, 0);
-
-	return 0;
+	return hash;
 }
-
-int fs_umount(void)
+/**
+ * @brief  name_hash32 hashes a filename. Subdirectories place their entries
+ * 			by it, so it is part of the on-disk format.
+ * @param  filename: filename, NULL-terminated if shorter than
+ * 			FS_FILENAME_LEN characters
+ * @retval the hash
+ */
+static uint32_t name_hash32(const char *filename)
+{
+	return fnv_hash(filename, strnlen(filename, FS_FILENAME_LEN));
+}
+/**
+ * @brief  name_hash hashes a filename into a bucket of the root directory
+ * 			index.
+ * @param  filename: NULL-terminated filename
+ * @retval index of the bucket
+ */
+static size_t name_hash(const char *filename)
+{
+	return name_hash32(filename) % DIR_HASH_BUCKETS;
+}
+/**
+ * @brief  dir_index_insert/dir_index_remove add and remove root directory
+ * 			entry `slot` to/from its hash chain.
+ * @param  slot: index of the entry in the root directory
+ * @retval None
+ */
+static void dir_index_insert(struct fs *fs, int slot)
+{
+	size_t bucket = name_hash((char *)fs->RootDirectory[slot].filename);
+	fs->dir_next[slot] = fs->dir_buckets[bucket];
+	fs->dir_buckets[bucket] = slot;
+}
+static void dir_index_remove(struct fs *fs, int slot)
 {
-	if (block_disk_count() < 0)
+	size_t bucket = name_hash((char *)fs->RootDirectory[slot].filename);
+	int16_t *link = &fs->dir_buckets[bucket];
+	while (*link != slot)
 	{
-		print_out("no virtual disk was open.\n");
-		return -1;
+		link = &fs->dir_next[*link];
 	}
-
-	if (total_files_open > 0)
+	*link = fs->dir_next[slot];
+}
+/**
+ * @brief  build the filename index and the free-slot stack of the root
+ * 			directory. Called once by `fs_mount()`.
+ * @note   free slots are pushed in reverse so the lowest one is used first.
+ * @retval None
+ */
+static void build_dir_index(struct fs *fs)
+{
+	for (size_t i = 0; i < DIR_HASH_BUCKETS; i++)
 	{
-		print_out("there are files open. cannot close.\n");
-		return -1;
+		fs->dir_buckets[i] = -1;
 	}
-	// copy FAT blocks to disk
-	for (size_t i = 0; i < superblock.num_block_fat; i++)
+	fs->free_slot_count = 0;
+	for (int i = FS_FILE_MAX_COUNT - 1; i >= 0; i--)
 	{
-		// since FAT is of uint16_t (2 bytes) type, pointer arithmetic is
-		// evaluted such that (FAT + i) would actually jump 2i bytes instead of
-		// i bytes. so we must divide by 2. FAT block starts at BLOCK #2 in
-		// ECS150-FS.
-		if (block_write(i + 1, FAT + (i * BLOCK_SIZE / 2)))
+		fs->open_count[i] = 0;
+		if (fs->RootDirectory[i].filename[0] != '\0')
 		{
-			print_out("unable to copy contents of FAT to disk.\n");
-			return -1;
+			dir_index_insert(fs, i);
+		}
+		else
+		{
+			fs->free_slots[fs->free_slot_count++] = i;
 		}
 	}
-	// copy root directory blocks to disk
-	if (block_write(superblock.root_dir_block_index,
-					(const void *)RootDirectory))
+}
+/**
+ * @brief  find_dir_entry looks `filename` up in the root directory index.
+ * @param  filename: NULL-terminated filename
+ * @retval -1 if no entry is named `filename`. Otherwise, return the index of
+ * 			the entry in the root directory.
+ */
+static int find_dir_entry(struct fs *fs, const char *filename)
+{
+	int slot = fs->dir_buckets[name_hash(filename)];
+	while (slot >= 0 &&
+		   strncmp((char *)fs->RootDirectory[slot].filename, filename,
+				   FS_FILENAME_LEN))
 	{
-		print_out("unable to copy contents of the root directory to disk.\n");
-		return -1;
+		slot = fs->dir_next[slot];
+	}
+	return slot;
+}
+/**
+ * @brief  mark_block_free/mark_block_used flip the bit of data block `idx`
+ * 			in the free-space bitmap and keep its summary word and the free
+ * 			block counter in sync.
+ * @param  idx: index of the data block
+ * @retval None
+ */
+static void mark_block_free(struct fs *fs, size_t idx)
+{
+	fs->free_map[idx / 64] |= (uint64_t)1 << (idx % 64);
+	fs->free_summary[idx / 4096] |= (uint64_t)1 << (idx / 64 % 64);
+	fs->free_blocks++;
+}
+static void mark_block_used(struct fs *fs, size_t idx)
+{
+	fs->free_map[idx / 64] &= ~((uint64_t)1 << (idx % 64));
+	if (fs->free_map[idx / 64] == 0)
+	{ // no free block left in this word
+		fs->free_summary[idx / 4096] &= ~((uint64_t)1 << (idx / 64 % 64));
 	}
-	// copy superblock to disk
-	if (block_write(0, &superblock))
+	fs->free_blocks--;
+}
+/**
+ * @brief  run_mask returns the bits of the bitmap word holding data block
+ * 			`idx` that belong to the run [`idx`, `end`), and sets `n` to
+ * 			their count.
+ */
+static uint64_t run_mask(size_t idx, size_t end, size_t *n)
+{
+	size_t bit = idx % 64;
+	*n = end - idx < 64 - bit ? end - idx : 64 - bit;
+	return (*n == 64 ? ~(uint64_t)0 : ((uint64_t)1 << *n) - 1) << bit;
+}
+/**
+ * @brief  mark the `len` data blocks starting at `start` as free/used, like
+ * 			`mark_block_free()`/`mark_block_used()` but a bitmap word at a
+ * 			time.
+ * @param  start: first data block of the run
+ * @param  len: length of the run
+ * @retval None
+ */
+static void mark_run_free(struct fs *fs, size_t start, size_t len)
+{
+	size_t n;
+	for (size_t idx = start; idx < start + len; idx += n)
 	{
-		print_out("unable to write superblock to disk.\n");
-		return -1;
+		fs->free_map[idx / 64] |= run_mask(idx, start + len, &n);
+		fs->free_summary[idx / 4096] |= (uint64_t)1 << (idx / 64 % 64);
 	}
-	if (block_disk_close())
+	fs->free_blocks += len;
+}
+static void mark_run_used(struct fs *fs, size_t start, size_t len)
+{
+	size_t n;
+	for (size_t idx = start; idx < start + len; idx += n)
 	{
-		print_out("unable to close disk file.\n");
-		return -1;
+		fs->free_map[idx / 64] &= ~run_mask(idx, start + len, &n);
+		if (fs->free_map[idx / 64] == 0)
+		{
+			fs->free_summary[idx / 4096] &= ~((uint64_t)1 << (idx / 64 % 64));
+		}
 	}
-
-	free(FAT);
-	return 0;
+	fs->free_blocks -= len;
 }
-
-int fs_info(void)
+/**
+ * @brief  fat_get reads FAT entry `idx`, whatever the width of the entries.
+ * @param  idx: index of the FAT entry
+ * @retval value of the entry, FAT_EOC if it ends a chain.
+ */
+static uint32_t fat_get(struct fs *fs, size_t idx)
 {
-	if (block_disk_count() < 0)
+	if (fs->fat32)
 	{
-		print_out("no virtual disk was open.\n");
-		return -1;
+		uint32_t value = ((uint32_t *)fs->FAT)[idx];
+		return value == FAT32_EOC ? FAT_EOC : value;
 	}
-	fprintf(stdout, "FS Info:\n");
-	fprintf(stdout, "total_blk_count=%d\n", superblock.total_num_blocks);
-	fprintf(stdout, "fat_blk_count=%d\n", superblock.num_block_fat);
-	fprintf(stdout, "rdir_blk=%d\n", superblock.root_dir_block_index);
-	fprintf(stdout, "data_blk=%d\n", superblock.data_block_start_index);
-	fprintf(stdout, "data_blk_count=%d\n", superblock.total_num_data_blocks);
-	fprintf(stdout, "fat_free_ratio=%d/%d\n",
-			superblock.total_num_data_blocks - count_fat_entries(),
-			superblock.total_num_data_blocks);
-	fprintf(stdout, "rdir_free_ratio=%d/%d\n",
-			FS_FILE_MAX_COUNT - count_root_dir_nodes(),
-			FS_FILE_MAX_COUNT);
-	return 0;
+	uint16_t value = ((uint16_t *)fs->FAT)[idx];
+	return value == FAT16_EOC ? FAT_EOC : value;
 }
-
-int fs_create(const char *filename)
+/**
+ * @brief  build the free-space bitmap from the FAT. Entry 0 is always
+ * 			FAT_EOC, so data block 0 is never handed out.
+ * @note   called once by `fs_mount()` or `lock_alloc()`, every later FAT
+ * 			update goes through `set_fat_entry()`.
+ * @retval -1 if memory cannot be allocated, 0 otherwise.
+ */
+static int build_free_map(struct fs *fs)
 {
-	if (block_disk_count() < 0)
+	size_t entries = fs->superblock.total_num_data_blocks;
+	size_t words = (entries + 63) / 64;
+	size_t summary_words = (words + 63) / 64;
+
+	fs->free_map = (uint64_t *)calloc(words, sizeof(uint64_t));
+	fs->free_summary = (uint64_t *)calloc(summary_words, sizeof(uint64_t));
+	if (fs->free_map == MALLOC_FAIL || fs->free_summary == MALLOC_FAIL)
 	{
-		print_out("no virtual disk was open.\n");
+		free(fs->free_map);
+		free(fs->free_summary);
+		fs->free_map = NULL;
+		fs->free_summary = NULL;
 		return -1;
 	}
-	int filename_len = strlen(filename);
-	if (filename_len < 1 || filename_len > FS_FILENAME_LEN - 1)
+	fs->free_blocks = 0;
+	for (size_t i = 0; i < entries; i++)
 	{
-		print_out("invalid filename.\n");
-		return -1;
+		if (fat_get(fs, i) == 0)
+		{
+			mark_block_free(fs, i);
+		}
 	}
-
-	if (count_root_dir_nodes() == FS_FILE_MAX_COUNT)
+	return 0;
+}
+/**
+ * @brief  lock_alloc takes `alloc_lock`, building the free-space bitmap first
+ * 			if the FAT was mapped at mount time and nothing needed it yet.
+ * @note   scanning the FAT touches every one of its blocks, so this is
+ * 			where a mapped FAT is read in.
+ * @retval -1 if the bitmap cannot be built, in which case the lock is not
+ * 			held. 0 otherwise.
+ */
+static int lock_alloc(struct fs *fs)
+{
+	pthread_mutex_lock(&fs->alloc_lock);
+	if (fs->free_map == NULL && build_free_map(fs))
 	{
-		print_out("root directory full.\n");
+		pthread_mutex_unlock(&fs->alloc_lock);
+		print_out("unable to allocate memory for the free-space bitmap.\n");
 		return -1;
 	}
-
-	for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++)
+	return 0;
+}
+static int block_is_free(struct fs *fs, size_t idx)
+{
+	return (fs->free_map[idx / 64] >> (idx % 64)) & 1;
+}
+/**
+ * @brief  scan data blocks [`from`, `to`) for a run of at least `want` free
+ * 			blocks, skipping bitmap words (and summary words) without a free
+ * 			block. Tracks the longest run seen in `best_start`/`best_len`.
+ * @retval 1 if a run of `want` blocks was found, 0 otherwise.
+ */
+static int scan_free_run(struct fs *fs, size_t from, size_t to, size_t want,
+						 size_t *best_start, size_t *best_len)
+{
+	size_t start = from, len = 0;
+	size_t idx = from;
+	while (idx < to)
 	{
-		if (!strcmp((char *)RootDirectory[i].filename, filename))
+		if (idx % 4096 == 0 && fs->free_summary[idx / 4096] == 0)
+		{ // a whole summary word without a free block
+			len = 0;
+			idx += 4096;
+			continue;
+		}
+		if (idx % 64 == 0 && fs->free_map[idx / 64] == 0)
+		{ // a whole bitmap word without a free block
+			len = 0;
+			idx += 64;
+			continue;
+		}
+		if (!block_is_free(fs, idx))
 		{
-			print_out("file already exists with that name.\n");
-			return -1;
+			len = 0;
+			idx++;
+			continue;
 		}
-	}
-
-	// search for an empty entry in the root directory
-	int index_of_empty_entry = -1;
-	for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++)
-	{
-		if (RootDirectory[i].filename[0] == '\0')
+		if (len == 0)
 		{
-			index_of_empty_entry = i;
-			break;
+			start = idx;
+		}
+		len++;
+		if (len > *best_len)
+		{
+			*best_start = start;
+			*best_len = len;
+		}
+		if (len >= want)
+		{
+			return 1;
 		}
+		idx++;
 	}
-	if (index_of_empty_entry < 0)
+	return 0;
+}
+/**
+ * @brief  find_free_run looks for a run of `want` free data blocks, starting
+ * 			at block `goal` and wrapping around to the start of the disk.
+ * @note   the caller makes sure `free_blocks` is not 0.
+ * @param  goal: data block to start looking from
+ * @param  want: wanted length of the run
+ * @param  run_len: set to the length of the returned run (up to `want`)
+ * @retval index of the first block of the first run of `want` blocks, or of
+ * 			the longest run if there is none that long.
+ */
+static size_t find_free_run(struct fs *fs, size_t goal, size_t want,
+							 size_t *run_len)
+{
+	size_t entries = fs->superblock.total_num_data_blocks;
+	size_t best_start = 0, best_len = 0;
+	if (goal >= entries)
 	{
-		print_out("no free entry available.\n");
-		return -1;
+		goal = 0;
 	}
-
-	// reset the struct, empty old information
-	memset(&RootDirectory[index_of_empty_entry], 0, sizeof(DirectoryTableNode));
-
-	// copy filename
-	int i = 0;
-	while (i < filename_len)
+	if (!scan_free_run(fs, goal, entries, want, &best_start, &best_len))
 	{
-		RootDirectory[index_of_empty_entry].filename[i] = filename[i];
-		i++;
+		scan_free_run(fs, 0, goal, want, &best_start, &best_len);
 	}
+	*run_len = best_len < want ? best_len : want;
+	return best_start;
+}
+/**
+ * @brief  release_blocks gives the unused reserved blocks of the file opened
+ * 			as `fd` back to the free-space bitmap.
+ * @param  fd: file descriptor id
+ * @retval None
+ */
+static void release_blocks(struct fs *fs, int fd)
+{
+	for (size_t i = 0; i < fs->OFT[fd].resv_len; i++)
+	{
+		mark_block_free(fs, fs->OFT[fd].resv_start + i);
+	}
+	fs->reserved_blocks -= fs->OFT[fd].resv_len;
+	fs->OFT[fd].resv_len = 0;
+}
+/**
+ * @brief  reserve_blocks reserves `len` free blocks starting at `start` for
+ * 			the file opened as `fd`, after giving back its previous
+ * 			reservation.
+ * @param  fd: file descriptor id
+ * @param  start: first data block of the run
+ * @param  len: length of the run
+ * @retval None
+ */
+static void reserve_blocks(struct fs *fs, int fd, size_t start, size_t len)
+{
+	release_blocks(fs, fd);
+	for (size_t i = start; i < start + len; i++)
+	{
+		mark_block_used(fs, i);
+	}
+	fs->reserved_blocks += len;
+	fs->OFT[fd].resv_start = start;
+	fs->OFT[fd].resv_len = len;
+}
+/**
+ * @brief  mark_rdir_dirty records that the root directory must be written
+ * 			back to disk.
+ * @note   entries change under the directory lock or under their file lock,
+ * 			so the flag is set atomically.
+ * @retval None
+ */
+static void mark_rdir_dirty(struct fs *fs)
+{
+	__atomic_store_n(&fs->rdir_dirty, DIRTY_ALL, __ATOMIC_RELAXED);
+}
+/**
+ * @brief  mark_entry_dirty records that the entry of an open file must be
+ * 			written back to disk, whether it is in the root directory or in
+ * 			a subdirectory.
+ * @note   the entry changes under its file lock.
+ * @param  entry: entry of the file in `RootDirectory`
+ * @retval None
+ */
+static void mark_entry_dirty(struct fs *fs, DirectoryTableNode *entry)
+{
+	size_t node = entry - fs->RootDirectory;
+	if (node < FS_FILE_MAX_COUNT)
+	{
+		mark_rdir_dirty(fs);
+		return;
+	}
+	__atomic_store_n(&fs->sub_locs[node - FS_FILE_MAX_COUNT].dirty, 1,
+					 __ATOMIC_RELAXED);
+}
+/**
+ * @brief  write_fat updates FAT entry `idx` and marks its FAT block dirty,
+ * 			leaving the free-space bitmap to the caller.
+ * @param  idx: index of the FAT entry
+ * @param  value: new value
+ * @retval None
+ */
+static void write_fat(struct fs *fs, size_t idx, uint32_t value)
+{
+	if (fat_get(fs, idx) == value)
+	{
+		return;
+	}
+	if (fs->fat32)
+	{
+		((uint32_t *)fs->FAT)[idx] = value == FAT_EOC ? FAT32_EOC : value;
+	}
+	else
+	{
+		((uint16_t *)fs->FAT)[idx] = value == FAT_EOC ? FAT16_EOC : value;
+	}
+	fs->fat_dirty[idx / fs->fat_per_block] = DIRTY_ALL;
+}
+/**
+ * @brief  set_fat_entry updates FAT entry `idx` and the free-space bitmap.
+ * 			All FAT modifications after mount must go through it, or
+ * 			through the bulk `free_chain()` and `alloc_chain()`.
+ * @param  idx: index of the FAT entry
+ * @param  value: new value (0 frees the block)
+ * @retval None
+ */
+static void set_fat_entry(struct fs *fs, size_t idx, uint32_t value)
+{
+	uint32_t old = fat_get(fs, idx);
+	if (old == 0 && value != 0)
+	{
+		fs->allocated_blocks++;
+	}
+	else if (old != 0 && value == 0)
+	{
+		fs->freed_blocks++;
+	}
+	if (value != 0 && block_is_free(fs, idx))
+	{ // reserved blocks are already marked used
+		mark_block_used(fs, idx);
+	}
+	else if (old != 0 && value == 0)
+	{
+		mark_block_free(fs, idx);
+	}
+	write_fat(fs, idx, value);
+}
+/**
+ * @brief  release_run gives the run of `len` data blocks starting at `start`
+ * 			back to the free-space bitmap, or adds it to `freed` if holes
+ * 			are punched where blocks are freed.
+ * @note   the caller holds `alloc_lock`. If `freed` cannot grow, the run is
+ * 			freed right away and its hole is not punched, unless `freed`
+ * 			holds its runs: they then stay used.
+ * @retval None
+ */
+static void release_run(struct fs *fs, FreedRuns *freed, size_t start,
+						size_t len)
+{
+	if (freed != NULL &&
+		(freed->hold || __atomic_load_n(&fs->discard, __ATOMIC_RELAXED)))
+	{
+		if (freed->len == freed->cap)
+		{
+			size_t cap = freed->cap ? 2 * freed->cap : 16;
+			BlockRun *runs = (BlockRun *)realloc(freed->runs,
+												 cap * sizeof(BlockRun));
+			if (runs != MALLOC_FAIL)
+			{
+				freed->runs = runs;
+				freed->cap = cap;
+			}
+		}
+		if (freed->len < freed->cap)
+		{
+			freed->runs[freed->len].start = start;
+			freed->runs[freed->len].len = len;
+			freed->len++;
+			return;
+		}
+		if (freed->hold)
+		{ // lost until the next mount, rather than reused too soon
+			return;
+		}
+	}
+	mark_run_free(fs, start, len);
+}
+/**
+ * @brief  free_chain frees the FAT chain starting at data block `first` in a
+ * 			single pass. Runs of consecutive blocks are given back to the
+ * 			free-space bitmap together.
+ * @note   the caller holds `alloc_lock`, and hands `freed` to
+ * 			`discard_runs()` once it released it.
+ * @param  first: first block of the chain, or FAT_EOC for an empty chain
+ * @param  freed: runs still to be given back to the free-space bitmap
+ * @retval None
+ */
+static void free_chain(struct fs *fs, uint32_t first, FreedRuns *freed)
+{
+	size_t run_start = 0, run_len = 0;
+	uint32_t curr_block = first;
+	while (curr_block != FAT_EOC)
+	{
+		uint32_t next = fat_get(fs, curr_block);
+		if (run_len > 0 && curr_block != run_start + run_len)
+		{ // the chain jumps, the run is over
+			release_run(fs, freed, run_start, run_len);
+			run_len = 0;
+		}
+		if (run_len == 0)
+		{
+			run_start = curr_block;
+		}
+		run_len++;
+		write_fat(fs, curr_block, 0);
+		fs->freed_blocks++;
+		curr_block = next;
+	}
+	if (run_len > 0)
+	{
+		release_run(fs, freed, run_start, run_len);
+	}
+}
+static int cmp_block_run(const void *a, const void *b)
+{
+	size_t sa = ((const BlockRun *)a)->start;
+	size_t sb = ((const BlockRun *)b)->start;
+	return (sa > sb) - (sa < sb);
+}
+/**
+ * @brief  discard_runs punches a hole in the disk file over each run of
+ * 			`freed`, then gives the runs back to the free-space bitmap.
+ * 			Adjacent runs are merged first, so that each hole takes a single
+ * 			call.
+ * @note   called without `alloc_lock`. If the host cannot punch holes,
+ * 			discarding is turned off for good.
+ * @param  freed: runs collected by `free_chain()`, emptied on return
+ * @retval None
+ */
+static void discard_runs(struct fs *fs, FreedRuns *freed)
+{
+	BlockRun *runs = freed->runs;
+	size_t n = 0;
+	if (freed->len == 0)
+	{
+		return;
+	}
+	qsort(runs, freed->len, sizeof(BlockRun), cmp_block_run);
+	for (size_t i = 0; i < freed->len; i++)
+	{
+		if (n > 0 && runs[n - 1].start + runs[n - 1].len == runs[i].start)
+		{
+			runs[n - 1].len += runs[i].len;
+		}
+		else
+		{
+			runs[n++] = runs[i];
+		}
+	}
+
+	for (size_t i = 0; i < n; i++)
+	{
+		size_t block = fs->superblock.data_block_start_index + runs[i].start;
+		// a cached copy written back later would fill the hole again
+		cache_discard(fs->cache, block, runs[i].len);
+		if (__atomic_load_n(&fs->discard, __ATOMIC_RELAXED) &&
+			disk_discard(fs->disk, block, runs[i].len))
+		{
+			print_out("unable to punch holes, discard turned off.\n");
+			__atomic_store_n(&fs->discard, 0, __ATOMIC_RELAXED);
+		}
+	}
+
+	pthread_mutex_lock(&fs->alloc_lock);
+	for (size_t i = 0; i < n; i++)
+	{
+		mark_run_free(fs, runs[i].start, runs[i].len);
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	free(runs);
+	freed->runs = NULL;
+	freed->len = 0;
+	freed->cap = 0;
+}
+/**
+ * @brief  discard_first_runs takes the first `nr` runs out of `runs` and
+ * 			hands them to `discard_runs()`.
+ * @note   called without `alloc_lock`. If memory cannot be allocated, the
+ * 			runs stay in `runs` for the next call.
+ * @param  runs: `held_runs` or `pending_runs`
+ * @param  nr: number of runs to take, at most `runs->len`
+ * @retval None
+ */
+static void discard_first_runs(struct fs *fs, FreedRuns *runs, size_t nr)
+{
+	FreedRuns taken = {NULL, 0, 0};
+	pthread_mutex_lock(&fs->alloc_lock);
+	taken.runs = (BlockRun *)malloc(nr * sizeof(BlockRun));
+	if (taken.runs != MALLOC_FAIL)
+	{
+		memcpy(taken.runs, runs->runs, nr * sizeof(BlockRun));
+		memmove(runs->runs, runs->runs + nr,
+				(runs->len - nr) * sizeof(BlockRun));
+		runs->len -= nr;
+		taken.len = nr;
+		taken.cap = nr;
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	discard_runs(fs, &taken);
+}
+/**
+ * @brief  alloc_chain allocates `count` free data blocks and chains them
+ * 			after `eof_block`, a whole free run at a time, each run starting
+ * 			as close as possible after the previous one.
+ * @note   the caller holds `alloc_lock` and makes sure there are at least
+ * 			`count` free blocks.
+ * @param  eof_block: last block of the chain to extend, or FAT_EOC to start
+ * 			a new chain
+ * @param  count: number of blocks to allocate, at least 1
+ * @retval index of the first allocated block.
+ */
+static uint32_t alloc_chain(struct fs *fs, uint32_t eof_block, size_t count)
+{
+	uint32_t first = FAT_EOC;
+	uint32_t prev = eof_block;
+	fs->allocated_blocks += count;
+	while (count > 0)
+	{
+		size_t run_len;
+		size_t goal = prev == FAT_EOC ? 0 : prev + 1;
+		size_t start = find_free_run(fs, goal, count, &run_len);
+		mark_run_used(fs, start, run_len);
+		for (size_t i = start; i < start + run_len; i++)
+		{
+			if (prev != FAT_EOC)
+			{
+				write_fat(fs, prev, i);
+			}
+			prev = i;
+		}
+		if (first == FAT_EOC)
+		{
+			first = start;
+		}
+		count -= run_len;
+	}
+	write_fat(fs, prev, FAT_EOC);
+	return first;
+}
+/**
+ * @brief  append_file_block appends data block `block` to the block map of
+ * 			the file opened as `fd`, growing the map if needed.
+ * @param  fd: file descriptor id
+ * @param  block: index of the data block
+ * @retval -1 if memory cannot be allocated, 0 otherwise.
+ */
+static int append_file_block(struct fs *fs, int fd, uint32_t block)
+{
+	OpenedFileNode *file = &fs->OFT[fd];
+	if (file->blk_map_len == file->blk_map_cap)
+	{
+		size_t cap = file->blk_map_cap ? 2 * file->blk_map_cap : 16;
+		uint32_t *map = (uint32_t *)realloc(file->blk_map,
+											cap * sizeof(uint32_t));
+		if (map == MALLOC_FAIL)
+		{
+			return -1;
+		}
+		file->blk_map = map;
+		file->blk_map_cap = cap;
+	}
+	file->blk_map[file->blk_map_len++] = block;
+	return 0;
+}
+/**
+ * @brief  get_file_block returns the data block holding block `lblk` of the
+ * 			file opened as `fd`. Blocks that are already in the block map
+ * 			are found in O(1), others are resolved by walking the FAT from
+ * 			the last resolved block and added to the map.
+ * @param  fd: file descriptor id
+ * @param  lblk: index of the block within the file
+ * @retval FAT_EOC if the file has no block `lblk`, -1 if memory cannot be
+ * 			allocated. Otherwise, return index of the data block.
+ */
+static int get_file_block(struct fs *fs, int fd, size_t lblk)
+{
+	OpenedFileNode *file = &fs->OFT[fd];
+	unsigned int gen = fs->chain_gen[file->metadata - fs->RootDirectory];
+	if (file->blk_map_gen != gen)
+	{ // the file was truncated through another file descriptor
+		file->blk_map_len = 0;
+		file->blk_map_gen = gen;
+	}
+	size_t resolved = file->blk_map_len;
+	int ret = 0;
+	while (file->blk_map_len <= lblk)
+	{
+		uint32_t next = file->blk_map_len == 0
+							? file->metadata->first_data_block_index
+							: fat_get(fs, file->blk_map[file->blk_map_len - 1]);
+		if (next == FAT_EOC)
+		{
+			ret = FAT_EOC;
+			break;
+		}
+		if (append_file_block(fs, fd, next))
+		{
+			ret = -1;
+			break;
+		}
+	}
+	if (file->blk_map_len > resolved)
+	{
+		__atomic_fetch_add(&fs->fat_steps, file->blk_map_len - resolved,
+						   __ATOMIC_RELAXED);
+	}
+	return ret ? ret : file->blk_map[lblk];
+}
+/**
+ * @brief  readahead adapts the readahead window of the file opened as `fd`
+ * 			to a read of its blocks `first` to `last`, and starts reading
+ * 			the blocks that follow into the cache.
+ * @note   The window doubles each time a read starts where the previous
+ * 			one ended, up to `readahead_max` blocks, and halves when a read
+ * 			starts elsewhere, down to 0 which stops readahead. Blocks are
+ * 			read ahead again once half of the window is consumed, so that
+ * 			a sequential reader keeps finding its blocks cached.
+ * @param  fd: file descriptor id
+ * @param  first: index of the first block of the read within the file
+ * @param  last: index of the last block of the read within the file
+ * @retval None
+ */
+static void readahead(struct fs *fs, int fd, size_t first, size_t last)
+{
+	OpenedFileNode *file = &fs->OFT[fd];
+	if (fs->readahead_max == 0)
+	{
+		return;
+	}
+	size_t min_window =
+		fs->readahead_max < RA_MIN_BLOCKS ? fs->readahead_max : RA_MIN_BLOCKS;
+	if (first == file->ra_next)
+	{
+		file->ra_window =
+			file->ra_window == 0 ? min_window : 2 * file->ra_window;
+		if (file->ra_window > fs->readahead_max)
+		{
+			file->ra_window = fs->readahead_max;
+		}
+	}
+	else if (first + 1 != file->ra_next)
+	{ // a read going on in the block the previous one ended in is neither
+		file->ra_window /= 2;
+		if (file->ra_window < min_window)
+		{
+			file->ra_window = 0;
+		}
+		file->ra_end = 0;
+	}
+	file->ra_next = last + 1;
+	if (file->ra_window == 0)
+	{
+		return;
+	}
+
+	size_t start = file->ra_end > last + 1 ? file->ra_end : last + 1;
+	if (start - (last + 1) > file->ra_window / 2)
+	{
+		return;
+	}
+	size_t end = last + 1 + file->ra_window;
+	size_t file_blocks =
+		(file->metadata->file_size + fs->block_size - 1) / fs->block_size;
+	if (end > file_blocks)
+	{
+		end = file_blocks;
+	}
+
+	size_t blocks[IO_BATCH];
+	size_t n = 0;
+	size_t lblk;
+	for (lblk = start; lblk < end; lblk++)
+	{
+		int block_index = get_file_block(fs, fd, lblk);
+		if (block_index < 0 || block_index == FAT_EOC)
+		{
+			break;
+		}
+		blocks[n++] = fs->superblock.data_block_start_index + block_index;
+		if (n == IO_BATCH)
+		{
+			cache_prefetch(fs->cache, blocks, n);
+			n = 0;
+		}
+	}
+	// readahead is only a hint, the read itself reports errors
+	cache_prefetch(fs->cache, blocks, n);
+	file->ra_end = lblk;
+}
+/**
+ * @brief  add_fat_entry adds an entry to the FAT index for the file opened
+ * 			as `fd`, and updates the old EOF block to new entry and the new
+ * 			entry to EOF.
+ * @note   the new block is taken from the file's reservation if it has one,
+ * 			else right after the EOF block to keep the file contiguous. If
+ * 			that block is taken, a new extent is started on a free run of up
+ * 			to `prealloc_blocks` blocks, the rest of which is reserved for
+ * 			the file.
+ * @param  fd: file descriptor id
+ * @param  eof_block: update the old EOF block.
+ * @retval -1 if no free blocks available. Otherwise returns the index of the
+ * 			new FAT entry.
+ */
+int add_fat_entry(struct fs *fs, int fd, int eof_block)
+{
+	OpenedFileNode *file = &fs->OFT[fd];
+	size_t free_entry_idx;
+	if (file->resv_len > 0)
+	{
+		free_entry_idx = file->resv_start++;
+		file->resv_len--;
+		fs->reserved_blocks--;
+	}
+	else if (fs->free_blocks == 0)
+	{
+		// no space available in the FAT
+		return -1;
+	}
+	else if (eof_block != FAT_EOC &&
+			 eof_block + 1 < fs->superblock.total_num_data_blocks &&
+			 block_is_free(fs, eof_block + 1))
+	{
+		free_entry_idx = eof_block + 1;
+	}
+	else
+	{
+		size_t run_len;
+		size_t goal = eof_block == FAT_EOC ? 0 : eof_block + 1;
+		free_entry_idx = find_free_run(fs, goal, fs->prealloc_blocks, &run_len);
+		if (run_len > 1)
+		{
+			reserve_blocks(fs, fd, free_entry_idx + 1, run_len - 1);
+		}
+	}
+	// replace EOF block with new FAT entry, and update new FAT entry with
+	// FAT EOC
+	set_fat_entry(fs, free_entry_idx, FAT_EOC);
+	if (eof_block != FAT_EOC)
+	{ // an empty file has no EOF block to link from
+		set_fat_entry(fs, eof_block, free_entry_idx);
+	}
+
+	return free_entry_idx;
+}
+/**
+ * @brief  count_fragments walks the FAT chain of every file and counts the
+ * 			links between consecutive blocks of a file (`links`), and how
+ * 			many of them jump to a non-adjacent block (`breaks`).
+ * @note   the caller holds `alloc_lock`.
+ * @param  subs: first blocks of the files in subdirectories, see
+ * 			`sub_chains()`
+ * @param  nr_subs: number of blocks in `subs`
+ * @retval None
+ */
+static void count_fragments(struct fs *fs, const uint32_t *subs,
+							size_t nr_subs, size_t *breaks, size_t *links)
+{
+	*breaks = 0;
+	*links = 0;
+	for (size_t i = 0; i < FS_FILE_MAX_COUNT + nr_subs; i++)
+	{
+		if (i < FS_FILE_MAX_COUNT &&
+			fs->RootDirectory[i].filename[0] == '\0')
+		{
+			continue;
+		}
+		uint32_t curr_block =
+			i < FS_FILE_MAX_COUNT
+				? fs->RootDirectory[i].first_data_block_index
+				: subs[i - FS_FILE_MAX_COUNT];
+		while (curr_block != FAT_EOC)
+		{
+			uint32_t next = fat_get(fs, curr_block);
+			if (next == FAT_EOC)
+			{
+				break;
+			}
+			(*links)++;
+			if (next != curr_block + 1)
+			{
+				(*breaks)++;
+			}
+			curr_block = next;
+		}
+	}
+}
+/**
+ * @brief  extend_file allocates a new block at the end of the file opened as
+ * 			`fd`, and adds it to the file's block map.
+ * @note   the block map of `fd` must already be resolved up to the end of
+ * 			the file, and the file must be locked for writing.
+ * @param  fd: file descriptor id
+ * @retval -1 if no free blocks available or memory cannot be allocated.
+ * 			Otherwise returns the index of the new block.
+ */
+static int extend_file(struct fs *fs, int fd)
+{
+	OpenedFileNode *file = &fs->OFT[fd];
+	// make room in the map first, so a failure doesn't leak a block
+	if (append_file_block(fs, fd, FAT_EOC))
+	{
+		return -1;
+	}
+	file->blk_map_len--;
+
+	int eof_block = file->blk_map_len == 0
+						? FAT_EOC
+						: file->blk_map[file->blk_map_len - 1];
+	if (lock_alloc(fs))
+	{
+		return -1;
+	}
+	int new_block = add_fat_entry(fs, fd, eof_block);
+	if (new_block >= 0 && eof_block == FAT_EOC)
+	{
+		file->metadata->first_data_block_index = new_block;
+		mark_entry_dirty(fs, file->metadata);
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	if (new_block < 0)
+	{
+		return -1;
+	}
+	file->blk_map[file->blk_map_len++] = new_block;
+	return new_block;
+}
+/**
+ * @brief  alloc_file_blocks makes sure the FAT chain of the file opened as
+ * 			`fd` has at least `nr_blocks` blocks, allocating the missing
+ * 			ones at once. Blocks past the end of the file are kept.
+ * @note   the file must be locked for writing. Its reservation is given
+ * 			back first, so that its blocks can be part of the new runs.
+ * @param  fd: file descriptor id
+ * @param  nr_blocks: number of blocks the chain must have
+ * @retval -1 if there are not enough free blocks or memory cannot be
+ * 			allocated, 1 if blocks were allocated, 0 otherwise.
+ */
+static int alloc_file_blocks(struct fs *fs, int fd, size_t nr_blocks)
+{
+	OpenedFileNode *file = &fs->OFT[fd];
+	// resolve the whole chain, blocks past the end of the file included
+	if (get_file_block(fs, fd, SIZE_MAX - 1) < 0)
+	{
+		print_out("unable to resolve the blocks of the file.\n");
+		return -1;
+	}
+	if (nr_blocks <= file->blk_map_len)
+	{
+		return 0;
+	}
+	size_t needed = nr_blocks - file->blk_map_len;
+	uint32_t eof_block = file->blk_map_len == 0
+							 ? FAT_EOC
+							 : file->blk_map[file->blk_map_len - 1];
+	if (lock_alloc(fs))
+	{
+		return -1;
+	}
+	release_blocks(fs, fd);
+	if (needed > fs->free_blocks)
+	{
+		pthread_mutex_unlock(&fs->alloc_lock);
+		print_out("not enough free blocks.\n");
+		return -1;
+	}
+	uint32_t first = alloc_chain(fs, eof_block, needed);
+	if (eof_block == FAT_EOC)
+	{
+		file->metadata->first_data_block_index = first;
+		mark_entry_dirty(fs, file->metadata);
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	return 1;
+}
+/**
+ * @brief  grow_file extends the file opened as `fd` to `size` bytes, the new
+ * 			ones reading as zeros.
+ * @note   the file must be locked for writing. Blocks the file already has
+ * 			past its end are used first.
+ * @param  fd: file descriptor id
+ * @param  size: new size, larger than the current one
+ * @retval -1 if there are not enough free blocks or a block cannot be
+ * 			written, in which case the file keeps its size. 0 otherwise.
+ */
+static int grow_file(struct fs *fs, int fd, size_t size)
+{
+	static const char zero_block[BLOCK_SIZE_MAX];
+	OpenedFileNode *file = &fs->OFT[fd];
+	size_t bs = fs->block_size;
+	size_t old_size = file->metadata->file_size;
+	size_t old_blocks = (old_size + bs - 1) / bs;
+	size_t new_blocks = (size + bs - 1) / bs;
+	if (alloc_file_blocks(fs, fd, new_blocks) < 0 ||
+		get_file_block(fs, fd, new_blocks - 1) < 0)
+	{
+		return -1;
+	}
+
+	// the old last block keeps whatever was past the old end
+	if (old_size % bs != 0)
+	{
+		size_t block = fs->superblock.data_block_start_index +
+					   file->blk_map[old_size / bs];
+		if (cache_read(fs->cache, block, file->block_buf) < 0)
+		{
+			print_out("read from old block failed.\n");
+			return -1;
+		}
+		memset(file->block_buf + old_size % bs, 0, bs - old_size % bs);
+		if (cache_write(fs->cache, block, file->block_buf) < 0)
+		{
+			print_out("unable to write to old block.\n");
+			return -1;
+		}
+	}
+
+	// and so do the blocks after it, which are never read
+	size_t batch_blocks[IO_BATCH];
+	const void *batch_bufs[IO_BATCH];
+	size_t batch_len = 0;
+	for (size_t lblk = old_blocks; lblk < new_blocks; lblk++)
+	{
+		batch_blocks[batch_len] =
+			fs->superblock.data_block_start_index + file->blk_map[lblk];
+		batch_bufs[batch_len] = zero_block;
+		batch_len++;
+		if ((batch_len == IO_BATCH || lblk + 1 == new_blocks) &&
+			cache_writev(fs->cache, batch_blocks, batch_bufs, batch_len) < 0)
+		{
+			print_out("unable to write to new blocks.\n");
+			return -1;
+		}
+		batch_len %= IO_BATCH;
+	}
+
+	file->metadata->file_size = size;
+	mark_entry_dirty(fs, file->metadata);
+	return 0;
+}
+/**
+ * @brief  shrink_file cuts the file opened as `fd` down to `size` bytes, and
+ * 			frees every block of the file past the new end in one pass,
+ * 			including those left past the old end by `fs_fallocate()`.
+ * @note   the file must be locked for writing.
+ * @param  fd: file descriptor id
+ * @param  size: new size, at most the current one
+ * @retval -1 if memory cannot be allocated, 0 otherwise.
+ */
+static int shrink_file(struct fs *fs, int fd, size_t size)
+{
+	OpenedFileNode *file = &fs->OFT[fd];
+	size_t keep = (size + fs->block_size - 1) / fs->block_size;
+	int last_block = FAT_EOC;
+	if (keep > 0 && (last_block = get_file_block(fs, fd, keep - 1)) < 0)
+	{
+		print_out("unable to resolve the blocks of the file.\n");
+		return -1;
+	}
+
+	uint32_t first_freed = FAT_EOC;
+	FreedRuns freed = {NULL, 0, 0};
+	if (lock_alloc(fs))
+	{
+		return -1;
+	}
+	release_blocks(fs, fd);
+	if (keep == 0)
+	{
+		first_freed = file->metadata->first_data_block_index;
+		file->metadata->first_data_block_index = FAT_EOC;
+	}
+	else if (last_block != FAT_EOC)
+	{
+		first_freed = fat_get(fs, last_block);
+		write_fat(fs, last_block, FAT_EOC);
+	}
+	// with a journal, the holes wait for the commit, see `pending_runs`
+	free_chain(fs, first_freed,
+			   fs->journal != NULL ? &fs->pending_runs : &freed);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	discard_runs(fs, &freed);
+
+	if (first_freed != FAT_EOC)
+	{
+		// block maps of the file may point to the freed blocks
+		fs->chain_gen[file->metadata - fs->RootDirectory]++;
+	}
+	if (first_freed != FAT_EOC || size != file->metadata->file_size)
+	{
+		file->metadata->file_size = size;
+		mark_entry_dirty(fs, file->metadata);
+	}
+	return 0;
+}
+/**
+ * @brief  parse_path splits `path` into the path of its directory and its
+ * 			last name.
+ * @note   the leading slash is optional. Names are separated by single
+ * 			slashes, and are 1 to FS_FILENAME_LEN - 1 characters long.
+ * 			Version 1 file systems have no directories: `path` is then a
+ * 			flat filename of the root directory, slashes included.
+ * @param  path: NULL-terminated path
+ * @param  rel: set to `path` without its leading slash
+ * @param  dir_len: set to the length of the path of the directory, at the
+ * 			start of `rel`, 0 for the root directory
+ * @param  name: set to the last name of `rel`
+ * @retval -1 if `path` is invalid. 0 otherwise.
+ */
+static int parse_path(struct fs *fs, const char *path, const char **rel,
+					  size_t *dir_len, const char **name)
+{
+	if (path == NULL)
+	{
+		return -1;
+	}
+	if (fs->superblock.version != FS_VERSION_2)
+	{
+		size_t len = strlen(path);
+		if (len < 1 || len > FS_FILENAME_LEN - 1)
+		{
+			return -1;
+		}
+		*rel = path;
+		*dir_len = 0;
+		*name = path;
+		return 0;
+	}
+	if (path[0] == '/')
+	{
+		path++;
+	}
+	size_t len = strlen(path);
+	if (len == 0 || len > FS_PATH_LEN - 1)
+	{
+		return -1;
+	}
+	size_t start = 0;
+	for (size_t i = 0; i <= len; i++)
+	{
+		if (path[i] != '/' && path[i] != '\0')
+		{
+			continue;
+		}
+		if (i == start || i - start > FS_FILENAME_LEN - 1)
+		{ // empty or too long name
+			return -1;
+		}
+		if (path[i] == '/')
+		{
+			start = i + 1;
+		}
+	}
+	*rel = path;
+	*dir_len = start ? start - 1 : 0;
+	*name = path + start;
+	return 0;
+}
+/**
+ * @brief  split_name splits the path of a subdirectory, as given by
+ * 			`parse_path()`, into the path of its parent and its name.
+ * @param  path: path of the subdirectory, not NULL-terminated
+ * @param  len: length of `path`
+ * @param  name: filled with the NULL-terminated name of the subdirectory
+ * @retval length of the path of the parent, 0 for the root directory.
+ */
+static size_t split_name(const char *path, size_t len, char *name)
+{
+	size_t start = len;
+	while (start > 0 && path[start - 1] != '/')
+	{
+		start--;
+	}
+	memset(name, 0, FS_FILENAME_LEN);
+	memcpy(name, path + start, len - start);
+	return start ? start - 1 : 0;
+}
+/**
+ * @brief  path_cache_find looks the subdirectory at `path` up in the path
+ * 			cache.
+ * @param  path: path of the subdirectory, not NULL-terminated
+ * @param  len: length of `path`
+ * @retval NULL if the subdirectory is not cached. Otherwise, its node.
+ */
+static PathCacheNode *path_cache_find(struct fs *fs, const char *path,
+									  size_t len)
+{
+	int i = fs->path_buckets[fnv_hash(path, len) % PATH_CACHE_BUCKETS];
+	while (i >= 0)
+	{
+		PathCacheNode *node = &fs->path_cache[i];
+		if (strlen(node->path) == len && !memcmp(node->path, path, len))
+		{
+			node->last_used = ++fs->path_clock;
+			return node;
+		}
+		i = node->next;
+	}
+	return NULL;
+}
+/**
+ * @brief  path_cache_remove forgets the subdirectory of node `i` of the path
+ * 			cache.
+ * @param  i: index of the node, which is used
+ * @retval None
+ */
+static void path_cache_remove(struct fs *fs, int i)
+{
+	PathCacheNode *node = &fs->path_cache[i];
+	size_t bucket =
+		fnv_hash(node->path, strlen(node->path)) % PATH_CACHE_BUCKETS;
+	int16_t *link = &fs->path_buckets[bucket];
+	while (*link != i)
+	{
+		link = &fs->path_cache[*link].next;
+	}
+	*link = node->next;
+	free(node->blk_map);
+	node->blk_map = NULL;
+	node->path[0] = '\0';
+}
+/**
+ * @brief  path_cache_add resolves the FAT chain of the subdirectory starting
+ * 			at data block `first` into a block map, and adds the
+ * 			subdirectory to the path cache. The least recently used one is
+ * 			evicted if the cache is full.
+ * @param  path: path of the subdirectory, not NULL-terminated
+ * @param  len: length of `path`
+ * @param  first: first block of the subdirectory
+ * @retval NULL if the chain is not a valid hash table or memory cannot be
+ * 			allocated. Otherwise, node of the subdirectory.
+ */
+static PathCacheNode *path_cache_add(struct fs *fs, const char *path,
+									 size_t len, uint32_t first)
+{
+	uint32_t *blk_map = NULL;
+	size_t n = 0, cap = 0;
+	for (uint32_t block = first; block != FAT_EOC; block = fat_get(fs, block))
+	{
+		if (block >= fs->superblock.total_num_data_blocks ||
+			n == DIR_MAX_BUCKETS)
+		{
+			free(blk_map);
+			print_out("corrupted directory.\n");
+			return NULL;
+		}
+		if (n == cap)
+		{
+			cap = cap ? 2 * cap : 16;
+			uint32_t *map = (uint32_t *)realloc(blk_map,
+												cap * sizeof(uint32_t));
+			if (map == MALLOC_FAIL)
+			{
+				free(blk_map);
+				print_out("unable to allocate memory for the directory.\n");
+				return NULL;
+			}
+			blk_map = map;
+		}
+		blk_map[n++] = block;
+	}
+	__atomic_fetch_add(&fs->fat_steps, n, __ATOMIC_RELAXED);
+	if (n == 0 || (n & (n - 1)) != 0)
+	{
+		free(blk_map);
+		print_out("corrupted directory.\n");
+		return NULL;
+	}
+
+	int victim = 0;
+	for (int i = 0; i < PATH_CACHE_SIZE; i++)
+	{
+		if (fs->path_cache[i].path[0] == '\0')
+		{
+			victim = i;
+			break;
+		}
+		if (fs->path_cache[i].last_used < fs->path_cache[victim].last_used)
+		{
+			victim = i;
+		}
+	}
+	if (fs->path_cache[victim].path[0] != '\0')
+	{
+		path_cache_remove(fs, victim);
+	}
+	PathCacheNode *node = &fs->path_cache[victim];
+	memcpy(node->path, path, len);
+	node->path[len] = '\0';
+	node->blk_map = blk_map;
+	node->nr_buckets = n;
+	node->last_used = ++fs->path_clock;
+	size_t bucket = fnv_hash(path, len) % PATH_CACHE_BUCKETS;
+	node->next = fs->path_buckets[bucket];
+	fs->path_buckets[bucket] = victim;
+	return node;
+}
+/**
+ * @brief  dir_block_find finds data block `block` among the subdirectory
+ * 			blocks waiting for a journal commit.
+ * @note   the caller holds `dir_lock`.
+ * @retval -1 if the block is not waiting. Otherwise, index of its entry in
+ * 			`dir_blocks`.
+ */
+static int32_t dir_block_find(struct fs *fs, uint32_t block)
+{
+	int32_t i = fs->dir_block_buckets[block % DIR_BLOCK_BUCKETS];
+	while (i >= 0 && fs->dir_blocks[i].block != block)
+	{
+		i = fs->dir_blocks[i].next;
+	}
+	return i;
+}
+/**
+ * @brief  dir_block_drop forgets the change to data block `block` waiting for
+ * 			a journal commit, if any.
+ * @note   the caller holds `dir_lock`.
+ * @retval None
+ */
+static void dir_block_drop(struct fs *fs, uint32_t block)
+{
+	int32_t *link = &fs->dir_block_buckets[block % DIR_BLOCK_BUCKETS];
+	while (*link >= 0 && fs->dir_blocks[*link].block != block)
+	{
+		link = &fs->dir_blocks[*link].next;
+	}
+	if (*link < 0)
+	{
+		return;
+	}
+	int32_t i = *link;
+	*link = fs->dir_blocks[i].next;
+	fs->dir_blocks[i].next = fs->dir_free;
+	fs->dir_free = i;
+	fs->nr_dir_blocks--;
+}
+/**
+ * @brief  dir_read reads data block `block` of a subdirectory, as changed in
+ * 			memory if it is waiting for a journal commit.
+ * @note   the caller holds `dir_lock`.
+ * @retval -1 if the block cannot be read. 0 otherwise.
+ */
+static int dir_read(struct fs *fs, uint32_t block, void *buf)
+{
+	int32_t i = fs->dir_blocks != NULL ? dir_block_find(fs, block) : -1;
+	if (i >= 0)
+	{
+		memcpy(buf, fs->dir_blocks[i].data, fs->block_size);
+		return 0;
+	}
+	if (cache_read(fs->cache, fs->superblock.data_block_start_index + block,
+				   buf))
+	{
+		print_out("unable to read the directory.\n");
+		return -1;
+	}
+	return 0;
+}
+/**
+ * @brief  dir_write writes data block `block` of a subdirectory. With a
+ * 			journal, the block is kept in memory until `sync_fs()` commits
+ * 			it with the FAT and the root directory. Without one, it goes
+ * 			through the cache.
+ * @note   the caller holds `dir_lock` and checked with `dir_room()` that
+ * 			there is room for the block. Blocks that no entry points to yet,
+ * 			such as new buckets, are written through the cache either way:
+ * 			they are on disk before the FAT that makes them part of the
+ * 			directory is committed.
+ * @retval -1 if the block cannot be written. 0 otherwise.
+ */
+static int dir_write(struct fs *fs, uint32_t block, const void *buf)
+{
+	if (fs->dir_blocks == NULL)
+	{
+		if (cache_write(fs->cache,
+						fs->superblock.data_block_start_index + block, buf))
+		{
+			print_out("unable to write the directory.\n");
+			return -1;
+		}
+		return 0;
+	}
+	int32_t i = dir_block_find(fs, block);
+	if (i < 0)
+	{
+		if (fs->dir_free < 0)
+		{
+			print_out("too many directory blocks changed.\n");
+			return -1;
+		}
+		i = fs->dir_free;
+		DirBlock *dblock = &fs->dir_blocks[i];
+		if (dblock->data == NULL)
+		{
+			dblock->data = malloc(fs->block_size);
+			if (dblock->data == MALLOC_FAIL)
+			{
+				print_out("unable to allocate memory for the directory.\n");
+				return -1;
+			}
+		}
+		fs->dir_free = dblock->next;
+		dblock->block = block;
+		dblock->next = fs->dir_block_buckets[block % DIR_BLOCK_BUCKETS];
+		fs->dir_block_buckets[block % DIR_BLOCK_BUCKETS] = i;
+		fs->nr_dir_blocks++;
+	}
+	memcpy(fs->dir_blocks[i].data, buf, fs->block_size);
+	fs->dir_blocks[i].dirty = 1;
+	return 0;
+}
+/**
+ * @brief  dir_slot_valid checks whether `v2`, in slot of bucket `bucket` of
+ * 			a subdirectory of `nr_buckets` buckets, is an entry. A split
+ * 			leaves the entries it moved in their old bucket, where they no
+ * 			longer hash to and are ignored.
+ * @retval 1 if it is an entry. 0 if the slot is free.
+ */
+static int dir_slot_valid(const DirectoryEntryV2 *v2, size_t bucket,
+						  size_t nr_buckets)
+{
+	return v2->filename[0] != '\0' &&
+		   (name_hash32((const char *)v2->filename) & (nr_buckets - 1)) ==
+			   bucket;
+}
+/**
+ * @brief  dir_lookup looks `name` up in the bucket of subdirectory `dir`
+ * 			it hashes to, which is left in the first block of `dir_buf`.
+ * @param  name: NULL-terminated name
+ * @param  entry: filled with the entry, if found
+ * @param  block: set to the data block of the bucket if the entry is found
+ * 			or the bucket has an empty slot, FAT_EOC if it is full
+ * @param  slot: set to the slot of the entry, or of the first empty one
+ * @retval -1 if the bucket cannot be read, 1 if the entry is found. 0
+ * 			otherwise.
+ */
+static int dir_lookup(struct fs *fs, PathCacheNode *dir, const char *name,
+					  DirectoryTableNode *entry, uint32_t *block,
+					  uint32_t *slot)
+{
+	size_t bucket = name_hash32(name) & (dir->nr_buckets - 1);
+	uint32_t bucket_block = dir->blk_map[bucket];
+	size_t per_block = fs->block_size / sizeof(DirectoryEntryV2);
+	if (dir_read(fs, bucket_block, fs->dir_buf))
+	{
+		return -1;
+	}
+	*block = FAT_EOC;
+	for (size_t i = 0; i < per_block; i++)
+	{
+		const DirectoryEntryV2 *v2 = (const DirectoryEntryV2 *)fs->dir_buf + i;
+		// a name that hashes here is never left behind by a split
+		if (!dir_slot_valid(v2, bucket, dir->nr_buckets))
+		{
+			if (*block == FAT_EOC)
+			{
+				*block = bucket_block;
+				*slot = i;
+			}
+			continue;
+		}
+		if (!strncmp((const char *)v2->filename, name, FS_FILENAME_LEN))
+		{
+			load_dir_entry(fs, entry, fs->dir_buf, i);
+			*block = bucket_block;
+			*slot = i;
+			return 1;
+		}
+	}
+	return 0;
+}
+/**
+ * @brief  resolve_dir finds the subdirectory at `path`, in the path cache or
+ * 			by looking its name up in its parent, resolved the same way.
+ * @param  path: path of the subdirectory, as given by `parse_path()`, not
+ * 			NULL-terminated
+ * @param  len: length of `path`, at least 1
+ * @retval NULL if a directory of the path doesn't exist or cannot be read.
+ * 			Otherwise, node of the subdirectory in the path cache, valid
+ * 			until the next subdirectory is added to the cache.
+ */
+static PathCacheNode *resolve_dir(struct fs *fs, const char *path, size_t len)
+{
+	PathCacheNode *dir = path_cache_find(fs, path, len);
+	if (dir != NULL)
+	{
+		return dir;
+	}
+	char name[FS_FILENAME_LEN];
+	size_t parent_len = split_name(path, len, name);
+	DirectoryTableNode entry;
+	if (parent_len == 0)
+	{
+		int index_of_entry = find_dir_entry(fs, name);
+		if (index_of_entry < 0)
+		{
+			print_out("no entry found.\n");
+			return NULL;
+		}
+		entry = fs->RootDirectory[index_of_entry];
+	}
+	else
+	{
+		uint32_t block, slot;
+		PathCacheNode *parent = resolve_dir(fs, path, parent_len);
+		if (parent == NULL ||
+			dir_lookup(fs, parent, name, &entry, &block, &slot) != 1)
+		{
+			print_out("no entry found.\n");
+			return NULL;
+		}
+	}
+	if (entry.type != DIRENT_DIR)
+	{
+		print_out("not a directory.\n");
+		return NULL;
+	}
+	return path_cache_add(fs, path, len, entry.first_data_block_index);
+}
+/**
+ * @brief  find_sub_node finds the entry of the open file whose entry lives in
+ * 			slot `slot` of subdirectory block `block`.
+ * @retval -1 if no such file is open. Otherwise, index of the entry in
+ * 			`RootDirectory`.
+ */
+static int find_sub_node(struct fs *fs, uint32_t block, uint32_t slot)
+{
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+	{
+		if (fs->open_count[FS_FILE_MAX_COUNT + i] > 0 &&
+			fs->sub_locs[i].block == block && fs->sub_locs[i].slot == slot)
+		{
+			return FS_FILE_MAX_COUNT + i;
+		}
+	}
+	return -1;
+}
+/**
+ * @brief  write_sub_entry writes the entry of a file open in a subdirectory
+ * 			back to its directory block, see `dir_write()`.
+ * @param  node: index of the entry in `RootDirectory`
+ * @retval -1 if the block cannot be written, in which case the entry stays
+ * 			dirty. 0 otherwise.
+ */
+static int write_sub_entry(struct fs *fs, int node)
+{
+	SubdirEntryLoc *loc = &fs->sub_locs[node - FS_FILE_MAX_COUNT];
+	DirectoryTableNode entry;
+	__atomic_store_n(&loc->dirty, 0, __ATOMIC_RELAXED);
+	pthread_rwlock_rdlock(&fs->file_locks[node]);
+	entry = fs->RootDirectory[node];
+	pthread_rwlock_unlock(&fs->file_locks[node]);
+	if (dir_read(fs, loc->block, fs->dir_buf))
+	{
+		__atomic_store_n(&loc->dirty, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	store_dir_entry(fs, fs->dir_buf, loc->slot, &entry);
+	if (dir_write(fs, loc->block, fs->dir_buf))
+	{
+		__atomic_store_n(&loc->dirty, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	return 0;
+}
+/**
+ * @brief  flush_sub_entries writes back the entries of the files open in
+ * 			subdirectories that changed.
+ * @retval -1 if an entry cannot be written back. 0 otherwise.
+ */
+static int flush_sub_entries(struct fs *fs)
+{
+	int ret = 0;
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+	{
+		if (fs->open_count[FS_FILE_MAX_COUNT + i] > 0 &&
+			__atomic_load_n(&fs->sub_locs[i].dirty, __ATOMIC_RELAXED) &&
+			write_sub_entry(fs, FS_FILE_MAX_COUNT + i))
+		{
+			ret = -1;
+		}
+	}
+	return ret;
+}
+/**
+ * @brief  alloc_dir_block allocates the first block of a new subdirectory,
+ * 			an empty bucket.
+ * @note   the block is zeroed through the second block of `dir_buf`.
+ * @retval FAT_EOC if there is no free block or it cannot be written.
+ * 			Otherwise, index of the block.
+ */
+static uint32_t alloc_dir_block(struct fs *fs)
+{
+	if (lock_alloc(fs))
+	{
+		return FAT_EOC;
+	}
+	if (fs->free_blocks == 0)
+	{
+		pthread_mutex_unlock(&fs->alloc_lock);
+		print_out("no free blocks.\n");
+		return FAT_EOC;
+	}
+	uint32_t block = alloc_chain(fs, FAT_EOC, 1);
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	char *zeros = fs->dir_buf + fs->block_size;
+	memset(zeros, 0, fs->block_size);
+	if (cache_write(fs->cache, fs->superblock.data_block_start_index + block,
+					zeros))
+	{
+		print_out("unable to write the directory.\n");
+		pthread_mutex_lock(&fs->alloc_lock);
+		set_fat_entry(fs, block, 0);
+		pthread_mutex_unlock(&fs->alloc_lock);
+		return FAT_EOC;
+	}
+	return block;
+}
+/**
+ * @brief  dir_split doubles the hash table of subdirectory `dir`, when the
+ * 			bucket of a new name is full. The entries of bucket `i` whose
+ * 			hash has bit `nr_buckets` set are copied to the same slot of the
+ * 			new bucket `i + nr_buckets`, so only one bucket is in memory at a
+ * 			time and open files only change blocks.
+ * @note   the old buckets are not rewritten: the copies they keep no longer
+ * 			hash to them, see `dir_slot_valid()`. Only new blocks are
+ * 			written, so with a journal the split needs no more room in a
+ * 			record than the FAT blocks of the longer chain.
+ * @note   the new size of the directory is left to the caller, see
+ * 			`update_dir_size()`.
+ * @retval -1 if the directory cannot grow anymore, if there are not enough
+ * 			free blocks or if a block cannot be read or written, in which
+ * 			case the directory is left as it was. 0 otherwise.
+ */
+static int dir_split(struct fs *fs, PathCacheNode *dir)
+{
+	size_t n = dir->nr_buckets;
+	size_t bs = fs->block_size;
+	size_t per_block = bs / sizeof(DirectoryEntryV2);
+	if (2 * n > DIR_MAX_BUCKETS)
+	{
+		print_out("directory full.\n");
+		return -1;
+	}
+	uint32_t *blk_map = (uint32_t *)realloc(dir->blk_map,
+											2 * n * sizeof(uint32_t));
+	if (blk_map == MALLOC_FAIL)
+	{
+		print_out("unable to allocate memory for the directory.\n");
+		return -1;
+	}
+	dir->blk_map = blk_map;
+	if (lock_alloc(fs))
+	{
+		return -1;
+	}
+	if (fs->free_blocks < n)
+	{
+		pthread_mutex_unlock(&fs->alloc_lock);
+		print_out("not enough free blocks.\n");
+		return -1;
+	}
+	uint32_t block = alloc_chain(fs, blk_map[n - 1], n);
+	for (size_t i = n; i < 2 * n; i++)
+	{
+		blk_map[i] = block;
+		block = fat_get(fs, block);
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	// open files whose entries move, and their new blocks
+	int moved[FS_OPEN_MAX_COUNT];
+	uint32_t moved_to[FS_OPEN_MAX_COUNT];
+	size_t nr_moved = 0;
+	char *old_bucket = fs->dir_buf;
+	char *new_bucket = fs->dir_buf + bs;
+	size_t data_start = fs->superblock.data_block_start_index;
+	for (size_t i = 0; i < n; i++)
+	{
+		if (dir_read(fs, blk_map[i], old_bucket))
+		{
+			goto undo;
+		}
+		memset(new_bucket, 0, bs);
+		for (size_t j = 0; j < per_block; j++)
+		{
+			DirectoryEntryV2 *v2 = (DirectoryEntryV2 *)old_bucket + j;
+			if (!dir_slot_valid(v2, i, n) ||
+				!(name_hash32((const char *)v2->filename) & n))
+			{
+				continue;
+			}
+			memcpy((DirectoryEntryV2 *)new_bucket + j, v2,
+				   sizeof(DirectoryEntryV2));
+			int node = find_sub_node(fs, blk_map[i], j);
+			if (node >= 0)
+			{
+				moved[nr_moved] = node;
+				moved_to[nr_moved++] = blk_map[i + n];
+			}
+		}
+		if (cache_write(fs->cache, data_start + blk_map[i + n], new_bucket))
+		{
+			print_out("unable to write the directory.\n");
+			goto undo;
+		}
+	}
+	// names hash to the new buckets only once they are all written
+	dir->nr_buckets = 2 * n;
+	for (size_t i = 0; i < nr_moved; i++)
+	{
+		fs->sub_locs[moved[i] - FS_FILE_MAX_COUNT].block = moved_to[i];
+	}
+	return 0;
+
+undo:
+	// nothing points to the new blocks, they go back as they are
+	for (size_t i = n; i < 2 * n; i++)
+	{
+		cache_discard(fs->cache, data_start + blk_map[i], 1);
+	}
+	pthread_mutex_lock(&fs->alloc_lock);
+	set_fat_entry(fs, blk_map[n - 1], FAT_EOC);
+	free_chain(fs, blk_map[n], NULL);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	return -1;
+}
+/**
+ * @brief  update_dir_size records the size of the hash table of the
+ * 			subdirectory at `path` in its entry, once it grew.
+ * @param  path: path of the subdirectory, not NULL-terminated
+ * @param  len: length of `path`
+ * @param  size: size of the hash table, in bytes
+ * @retval -1 if the entry cannot be updated. 0 otherwise.
+ */
+static int update_dir_size(struct fs *fs, const char *path, size_t len,
+						   size_t size)
+{
+	char name[FS_FILENAME_LEN];
+	size_t parent_len = split_name(path, len, name);
+	if (parent_len == 0)
+	{
+		int index_of_entry = find_dir_entry(fs, name);
+		if (index_of_entry < 0)
+		{
+			return -1;
+		}
+		fs->RootDirectory[index_of_entry].file_size = size;
+		mark_rdir_dirty(fs);
+		return 0;
+	}
+	DirectoryTableNode entry;
+	uint32_t block, slot;
+	PathCacheNode *parent = resolve_dir(fs, path, parent_len);
+	if (parent == NULL ||
+		dir_lookup(fs, parent, name, &entry, &block, &slot) != 1)
+	{
+		return -1;
+	}
+	entry.file_size = size;
+	store_dir_entry(fs, fs->dir_buf, slot, &entry);
+	return dir_write(fs, block, fs->dir_buf);
+}
+/**
+ * @brief  dir_is_empty checks whether subdirectory `dir` has no entry.
+ * @retval -1 if a block cannot be read, 1 if it is empty. 0 otherwise.
+ */
+static int dir_is_empty(struct fs *fs, PathCacheNode *dir)
+{
+	size_t per_block = fs->block_size / sizeof(DirectoryEntryV2);
+	for (size_t i = 0; i < dir->nr_buckets; i++)
+	{
+		if (dir_read(fs, dir->blk_map[i], fs->dir_buf))
+		{
+			return -1;
+		}
+		for (size_t j = 0; j < per_block; j++)
+		{
+			if (dir_slot_valid((const DirectoryEntryV2 *)fs->dir_buf + j, i,
+							   dir->nr_buckets))
+			{
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+/**
+ * @brief  sync_fs writes the dirty data blocks, then the metadata blocks that
+ * 			changed. Without a journal, they are written in place. With one,
+ * 			they are committed to the journal in one sequential write, and only
+ * 			written in place by a checkpoint, which then empties the journal.
+ * 			Either way, the disk is flushed before returning.
+ * @note   the metadata is copied under the locks and written once they are
+ * 			released. Root directory entries are copied before the FAT, so
+ * 			every block they point to is already in the copy of the FAT.
+ * 			Entries of files open in subdirectories are written back to
+ * 			their directory blocks first. With a journal, the subdirectory
+ * 			blocks that changed are committed in the same record, and only
+ * 			handed to the cache afterwards. Without one, they go with the
+ * 			data blocks.
+ * @param  checkpoint: 1 to checkpoint even if the journal has room left
+ * @retval -1 if a block cannot be written, in which case the metadata stays
+ * 			dirty. 0 otherwise.
+ */
+static int sync_fs(struct fs *fs, int checkpoint)
+{
+	size_t nr_fat = fs->superblock.num_block_fat;
+	size_t nr_meta = nr_fat + fs->rdir_blocks;
+	// metadata blocks to write, in disk order, and the dirty flags taken
+	// from each of them. A version 2 FAT can be too large for the stack
+	char *copies = malloc(nr_meta * fs->block_size);
+	size_t *blocks = malloc((nr_meta + fs->dir_budget) * sizeof(size_t));
+	const void **bufs = malloc((nr_meta + fs->dir_budget) * sizeof(void *));
+	uint8_t *flags = malloc(nr_meta + fs->dir_budget);
+	if (copies == MALLOC_FAIL || blocks == MALLOC_FAIL ||
+		bufs == MALLOC_FAIL || flags == MALLOC_FAIL)
+	{
+		print_out("unable to allocate memory to sync the metadata.\n");
+		free(copies);
+		free(blocks);
+		free(bufs);
+		free(flags);
+		return -1;
+	}
+	size_t n = 0;
+	// the root directory is copied after the FAT blocks, zero-padded
+	char *rdir_copy = copies + nr_fat * fs->block_size;
+	memset(rdir_copy, 0, fs->rdir_blocks * fs->block_size);
+
+	// an older copy must not be written after a newer one
+	pthread_mutex_lock(&fs->sync_lock);
+	// keep room in the journal for the record of a checkpoint
+	if (fs->journal != NULL &&
+		journal_space(fs->journal) < JOURNAL_RESERVE(fs) * 2)
+	{
+		checkpoint = 1;
+	}
+	uint8_t mask = fs->journal == NULL || checkpoint ? DIRTY_ALL
+													 : DIRTY_JOURNAL;
+
+	pthread_mutex_lock(&fs->dir_lock);
+	int ret = flush_sub_entries(fs);
+	// subdirectory blocks are committed with the FAT that points to them
+	size_t nr_dir = 0;
+	uint32_t *dir_nums = NULL;
+	char *dir_copies = NULL;
+	if (fs->nr_dir_blocks > 0)
+	{
+		dir_nums = malloc(fs->nr_dir_blocks * sizeof(uint32_t));
+		dir_copies = malloc(fs->nr_dir_blocks * fs->block_size);
+		if (dir_nums == MALLOC_FAIL || dir_copies == MALLOC_FAIL)
+		{
+			print_out("unable to allocate memory to sync the directories.\n");
+			ret = -1;
+		}
+		for (size_t b = 0; ret == 0 && b < DIR_BLOCK_BUCKETS; b++)
+		{
+			for (int32_t i = fs->dir_block_buckets[b]; i >= 0;
+				 i = fs->dir_blocks[i].next)
+			{
+				if (fs->dir_blocks[i].dirty)
+				{
+					fs->dir_blocks[i].dirty = 0;
+					dir_nums[nr_dir] = fs->dir_blocks[i].block;
+					memcpy(dir_copies + nr_dir * fs->block_size,
+						   fs->dir_blocks[i].data, fs->block_size);
+					nr_dir++;
+				}
+			}
+		}
+	}
+	uint8_t rdir_flags = __atomic_fetch_and(&fs->rdir_dirty, ~mask,
+											__ATOMIC_RELAXED) &
+						 mask;
+	for (size_t i = 0; rdir_flags && i < FS_FILE_MAX_COUNT; i++)
+	{
+		// empty entries only change under the directory lock
+		int used = fs->RootDirectory[i].filename[0] != '\0';
+		if (used)
+		{
+			pthread_rwlock_rdlock(&fs->file_locks[i]);
+		}
+		store_dir_entry(fs, rdir_copy, i, &fs->RootDirectory[i]);
+		if (used)
+		{
+			pthread_rwlock_unlock(&fs->file_locks[i]);
+		}
+	}
+	pthread_mutex_lock(&fs->alloc_lock);
+	for (size_t i = 0; i < nr_fat; i++)
+	{
+		if (fs->fat_dirty[i] & mask)
+		{
+			flags[n] = fs->fat_dirty[i] & mask;
+			fs->fat_dirty[i] &= ~mask;
+			// FAT blocks start right after the superblock
+			blocks[n] = i + 1;
+			bufs[n] = copies + n * fs->block_size;
+			memcpy(copies + n * fs->block_size, fs->FAT + i * fs->block_size,
+				   fs->block_size);
+			n++;
+		}
+	}
+	// subdirectories deleted and files freed so far are in this copy of the FAT
+	size_t nr_held = fs->held_runs.len;
+	size_t nr_pending = fs->pending_runs.len;
+	pthread_mutex_unlock(&fs->alloc_lock);
+	pthread_mutex_unlock(&fs->dir_lock);
+	for (size_t i = 0; rdir_flags && i < fs->rdir_blocks; i++)
+	{
+		flags[n] = rdir_flags;
+		blocks[n] = fs->superblock.root_dir_block_index + i;
+		bufs[n] = rdir_copy + i * fs->block_size;
+		n++;
+	}
+	size_t data_start = fs->superblock.data_block_start_index;
+	for (size_t i = 0; i < nr_dir; i++)
+	{
+		flags[n] = DIRTY_ALL;
+		blocks[n] = data_start + dir_nums[i];
+		bufs[n] = dir_copies + i * fs->block_size;
+		n++;
+	}
+
+	int in_place = fs->journal == NULL || checkpoint;
+	// write back cached data blocks before the metadata that points to them
+	if (cache_flush(fs->cache))
+	{
+		print_out("unable to write back cached blocks to disk.\n");
+		ret = -1;
+	}
+	if (ret == 0 && n > 0 && fs->journal != NULL &&
+		journal_commit(fs->journal, blocks, bufs, n))
+	{
+		print_out("unable to commit the metadata to the journal.\n");
+		ret = -1;
+	}
+	if (ret == 0 && n > 0 && in_place &&
+		disk_writev(fs->disk, blocks, bufs, n))
+	{
+		print_out("unable to write the metadata to disk.\n");
+		ret = -1;
+	}
+	// the records can only go once their blocks are stable in place
+	if (ret == 0 && fs->journal != NULL && checkpoint &&
+		(disk_flush(fs->disk) || journal_reset(fs->journal)))
+	{
+		print_out("unable to checkpoint the journal.\n");
+		ret = -1;
+	}
+	// a commit or a checkpoint made the blocks stable, otherwise they may
+	// still only be in the page cache or the mapping of the disk
+	if (ret == 0 && (fs->journal == NULL || (n == 0 && !checkpoint)) &&
+		disk_flush(fs->disk))
+	{
+		print_out("unable to flush the disk.\n");
+		ret = -1;
+	}
+
+	// committed subdirectory blocks leave memory, unless they changed since
+	if (nr_dir > 0)
+	{
+		pthread_mutex_lock(&fs->dir_lock);
+	}
+	for (size_t i = 0; i < nr_dir; i++)
+	{
+		int32_t j = dir_block_find(fs, dir_nums[i]);
+		if (j < 0)
+		{ // deleted since
+			continue;
+		}
+		if (ret)
+		{
+			fs->dir_blocks[j].dirty = 1;
+			continue;
+		}
+		size_t block = data_start + dir_nums[i];
+		if (in_place)
+		{
+			// an older copy written back later would undo the checkpoint
+			cache_discard(fs->cache, block, 1);
+		}
+		else if (cache_write(fs->cache, block,
+							 dir_copies + i * fs->block_size) < 0)
+		{
+			fs->dir_blocks[j].dirty = 1;
+			continue;
+		}
+		if (!fs->dir_blocks[j].dirty)
+		{
+			dir_block_drop(fs, dir_nums[i]);
+		}
+	}
+	if (nr_dir > 0)
+	{
+		pthread_mutex_unlock(&fs->dir_lock);
+	}
+	// the blocks of subdirectories deleted before the copy of the FAT can
+	// be reused once the journal holds no record of them anymore
+	if (ret == 0 && fs->journal != NULL && checkpoint && nr_held > 0)
+	{
+		discard_first_runs(fs, &fs->held_runs, nr_held);
+	}
+	// and the holes of the blocks freed before it can be punched now that
+	// it is committed
+	if (ret == 0 && nr_pending > 0)
+	{
+		discard_first_runs(fs, &fs->pending_runs, nr_pending);
+	}
+
+	if (ret)
+	{
+		// try again next time, rewriting a block is harmless
+		pthread_mutex_lock(&fs->alloc_lock);
+		for (size_t i = 0; i < n; i++)
+		{
+			if (blocks[i] - 1 < nr_fat)
+			{
+				fs->fat_dirty[blocks[i] - 1] |= flags[i];
+			}
+		}
+		pthread_mutex_unlock(&fs->alloc_lock);
+		__atomic_fetch_or(&fs->rdir_dirty, rdir_flags, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&fs->sync_lock);
+	free(copies);
+	free(blocks);
+	free(bufs);
+	free(flags);
+	free(dir_nums);
+	free(dir_copies);
+	return ret;
+}
+/**
+ * @brief  commit_wait makes the metadata changes of the caller durable, when
+ * 			`durable_metadata` is set. Concurrent callers share a commit:
+ * 			the first one runs it, the others wait for it.
+ * @note   a commit that is already running may have missed the caller's
+ * 			changes, so the caller needs one that starts afterwards.
+ * @retval -1 if the commit fails. 0 otherwise.
+ */
+static int commit_wait(struct fs *fs)
+{
+	if (!fs->durable_metadata)
+	{
+		return 0;
+	}
+	pthread_mutex_lock(&fs->commit_lock);
+	unsigned long want = fs->commit_next;
+	while (fs->commit_done < want)
+	{
+		if (fs->committing)
+		{
+			pthread_cond_wait(&fs->commit_cond, &fs->commit_lock);
+			continue;
+		}
+		fs->committing = 1;
+		unsigned long id = fs->commit_next++;
+		pthread_mutex_unlock(&fs->commit_lock);
+		int ret = sync_fs(fs, 0);
+		pthread_mutex_lock(&fs->commit_lock);
+		fs->committing = 0;
+		fs->commit_done = id;
+		fs->commit_result = ret;
+		pthread_cond_broadcast(&fs->commit_cond);
+	}
+	int ret = fs->commit_result;
+	pthread_mutex_unlock(&fs->commit_lock);
+	return ret;
+}
+/**
+ * @brief  dir_room makes sure `need` more subdirectory blocks can wait for a
+ * 			journal commit, on top of those of the entries of the files open
+ * 			in subdirectories, syncing to make room if needed.
+ * @note   the caller holds `dir_lock`, which is released during the sync,
+ * 			so it looks entries up only afterwards.
+ * @retval -1 if the journal is too small for directories, or if the sync
+ * 			fails. 0 otherwise.
+ */
+static int dir_room(struct fs *fs, size_t need)
+{
+	if (fs->journal == NULL)
+	{
+		return 0;
+	}
+	if (fs->dir_budget == 0)
+	{
+		print_out("journal too small for directories.\n");
+		return -1;
+	}
+	while (fs->nr_dir_blocks + FS_OPEN_MAX_COUNT + need > fs->dir_budget)
+	{
+		pthread_mutex_unlock(&fs->dir_lock);
+		int ret = sync_fs(fs, 0);
+		pthread_mutex_lock(&fs->dir_lock);
+		if (ret)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+/**
+ * @brief  create_journal carves a journal out of the free data blocks, at
+ * 			the end of the disk, and records it in the superblock.
+ * @note   the journal blocks are chained in the FAT like a file, so that
+ * 			they are never allocated, but no directory entry points to them.
+ * 			The superblock is written last, so a crash leaves at worst a few
+ * 			lost blocks.
+ * @param  nr_blocks: size of the journal
+ * @retval -1 if `nr_blocks` is below JOURNAL_MIN_BLOCKS, if there is no free
+ * 			run large enough, or if the journal cannot be written. 0
+ * 			otherwise.
+ */
+static int create_journal(struct fs *fs, size_t nr_blocks)
+{
+	size_t nr_fat = fs->superblock.num_block_fat;
+	size_t total = fs->superblock.total_num_data_blocks;
+	if (nr_blocks < JOURNAL_MIN_BLOCKS(fs, 0))
+	{
+		print_out("journal too small, it needs %zu blocks at least.\n",
+				  (size_t)JOURNAL_MIN_BLOCKS(fs, 0));
+		return -1;
+	}
+	if (lock_alloc(fs))
+	{
+		return -1;
+	}
+	// nothing else runs during mount, the lock only builds the bitmap
+	pthread_mutex_unlock(&fs->alloc_lock);
+	size_t run_len = 0;
+	size_t start = 0;
+	// the superblock of version 1 records the size of the journal in 16 bits
+	if (nr_blocks < total && (fs->superblock.version == FS_VERSION_2 ||
+							  nr_blocks <= UINT16_MAX))
+	{
+		start = find_free_run(fs, total - nr_blocks, nr_blocks, &run_len);
+	}
+	if (run_len < nr_blocks)
+	{
+		print_out("not enough contiguous free blocks for the journal.\n");
+		return -1;
+	}
+	for (size_t i = 0; i < nr_blocks; i++)
+	{
+		set_fat_entry(fs, start + i,
+					  i + 1 < nr_blocks ? start + i + 1 : FAT_EOC);
+	}
+
+	size_t first = fs->superblock.data_block_start_index + start;
+	if (journal_format(fs->disk, first, nr_blocks))
+	{
+		print_out("unable to write the journal.\n");
+		return -1;
+	}
+	// the FAT must reserve the journal before the superblock points to it
+	for (size_t i = 0; i < nr_fat; i++)
+	{
+		if (fs->fat_dirty[i] &&
+			disk_write(fs->disk, i + 1, fs->FAT + i * fs->block_size))
+		{
+			print_out("unable to copy contents of FAT to disk.\n");
+			return -1;
+		}
+		fs->fat_dirty[i] = 0;
+	}
+	fs->superblock.journal_magic = SB_JOURNAL_MAGIC;
+	fs->superblock.journal_start = start;
+	fs->superblock.journal_blocks = nr_blocks;
+	char *sb_block = malloc(fs->block_size);
+	if (sb_block == MALLOC_FAIL)
+	{
+		print_out("unable to allocate memory for the superblock.\n");
+		return -1;
+	}
+	store_superblock(&fs->superblock, sb_block);
+	int ret = disk_flush(fs->disk) || disk_write(fs->disk, 0, sb_block) ||
+			  disk_flush(fs->disk);
+	free(sb_block);
+	if (ret)
+	{
+		print_out("unable to write superblock to disk.\n");
+		return -1;
+	}
+	fs->journal = journal_open(fs->disk, first, nr_blocks);
+	return fs->journal == NULL ? -1 : 0;
+}
+/**
+ * @brief  init_dir_blocks sizes the set of subdirectory blocks waiting for a
+ * 			journal commit: DIR_JOURNAL_BLOCKS, or fewer if the journal
+ * 			could not hold JOURNAL_MIN_RECORDS records of that many between
+ * 			checkpoints. A larger set would only make the records larger and
+ * 			the checkpoints more frequent.
+ * @note   with room for fewer blocks than the entries of every open file and
+ * 			the largest operation need, directories other than the root
+ * 			cannot be used.
+ * @retval -1 if memory cannot be allocated. 0 otherwise.
+ */
+static int init_dir_blocks(struct fs *fs)
+{
+	if (fs->journal == NULL || fs->superblock.version != FS_VERSION_2)
+	{
+		return 0;
+	}
+	// the journal is empty after mount, its header aside
+	size_t space = journal_space(fs->journal);
+	size_t fixed = fs->superblock.num_block_fat + fs->rdir_blocks;
+	size_t per_record = space / (JOURNAL_MIN_RECORDS + 2);
+	size_t budget = per_record > fixed ? per_record - fixed : 0;
+	if (budget > DIR_JOURNAL_BLOCKS)
+	{
+		budget = DIR_JOURNAL_BLOCKS;
+	}
+	while (budget > 0 && JOURNAL_MIN_BLOCKS(fs, budget) > space + 1)
+	{
+		budget--;
+	}
+	if (budget < FS_OPEN_MAX_COUNT + DIR_OP_BLOCKS)
+	{
+		return 0;
+	}
+	fs->dir_blocks = (DirBlock *)calloc(budget, sizeof(DirBlock));
+	if (fs->dir_blocks == MALLOC_FAIL)
+	{
+		print_out("unable to allocate memory for the directories.\n");
+		return -1;
+	}
+	for (size_t i = 0; i < budget; i++)
+	{
+		fs->dir_blocks[i].next = i + 1 < budget ? (int32_t)i + 1 : -1;
+	}
+	fs->dir_free = 0;
+	fs->dir_budget = budget;
+	return 0;
+}
+/**
+ * @brief  flusher is the body of the background flusher thread. It syncs the
+ * 			file system every `flush_interval_ms`, or sooner when asked to.
+ * @param  arg: the file system
+ * @retval NULL
+ */
+static void *flusher(void *arg)
+{
+	struct fs *fs = arg;
+	pthread_mutex_lock(&fs->flush_lock);
+	while (!fs->flush_stop)
+	{
+		if (!fs->flush_requested)
+		{
+			struct timespec deadline;
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_sec += fs->flush_interval_ms / 1000;
+			deadline.tv_nsec += (fs->flush_interval_ms % 1000) * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L)
+			{
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			// woken up early by a request, or on time to bound the age of
+			// the changes: sync either way
+			pthread_cond_timedwait(&fs->flush_wake, &fs->flush_lock,
+								   &deadline);
+			if (fs->flush_stop)
+			{
+				break;
+			}
+		}
+		fs->flush_requested = 0;
+		pthread_mutex_unlock(&fs->flush_lock);
+		// a failed sync leaves the blocks dirty, the next pass retries
+		sync_fs(fs, 0);
+		pthread_mutex_lock(&fs->flush_lock);
+		fs->flush_passes++;
+		pthread_cond_broadcast(&fs->flush_done);
+	}
+	pthread_mutex_unlock(&fs->flush_lock);
+	return NULL;
+}
+/**
+ * @brief  start_flusher starts the background flusher thread.
+ * @retval -1 if the thread cannot be created. 0 otherwise.
+ */
+static int start_flusher(struct fs *fs)
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&fs->flush_wake, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&fs->flush_done, NULL);
+	pthread_mutex_init(&fs->flush_lock, NULL);
+	if (pthread_create(&fs->flusher, NULL, flusher, fs))
+	{
+		pthread_cond_destroy(&fs->flush_wake);
+		pthread_cond_destroy(&fs->flush_done);
+		pthread_mutex_destroy(&fs->flush_lock);
+		return -1;
+	}
+	fs->flusher_running = 1;
+	return 0;
+}
+/**
+ * @brief  stop_flusher stops the background flusher thread, if any, once its
+ * 			current pass is over. Throttled writers are released.
+ * @retval None
+ */
+static void stop_flusher(struct fs *fs)
+{
+	if (!fs->flusher_running)
+	{
+		return;
+	}
+	pthread_mutex_lock(&fs->flush_lock);
+	fs->flush_stop = 1;
+	pthread_cond_signal(&fs->flush_wake);
+	pthread_cond_broadcast(&fs->flush_done);
+	pthread_mutex_unlock(&fs->flush_lock);
+	pthread_join(fs->flusher, NULL);
+	fs->flusher_running = 0;
+	pthread_cond_destroy(&fs->flush_wake);
+	pthread_cond_destroy(&fs->flush_done);
+	pthread_mutex_destroy(&fs->flush_lock);
+}
+/**
+ * @brief  wake_flusher asks the background flusher for a pass as soon as
+ * 			possible.
+ * @retval None
+ */
+static void wake_flusher(struct fs *fs)
+{
+	pthread_mutex_lock(&fs->flush_lock);
+	fs->flush_requested = 1;
+	pthread_cond_signal(&fs->flush_wake);
+	pthread_mutex_unlock(&fs->flush_lock);
+}
+/**
+ * @brief  balance_dirty is called by writers, without any lock held, once
+ * 			they dirtied blocks. It wakes up the flusher past
+ * 			`dirty_background` dirty blocks, and makes the writer wait for a
+ * 			full flusher pass past `dirty_limit`.
+ * @note   at most two passes are waited for, so writers can't get stuck if
+ * 			the disk keeps failing.
+ * @retval None
+ */
+static void balance_dirty(struct fs *fs)
+{
+	if (!fs->flusher_running ||
+		cache_dirty(fs->cache) < fs->dirty_background)
+	{
+		return;
+	}
+	pthread_mutex_lock(&fs->flush_lock);
+	// the pass in progress may have missed our blocks, the next one can't
+	unsigned long target = fs->flush_passes + 2;
+	do
+	{
+		fs->flush_requested = 1;
+		pthread_cond_signal(&fs->flush_wake);
+		if (cache_dirty(fs->cache) < fs->dirty_limit)
+		{
+			break;
+		}
+		pthread_cond_wait(&fs->flush_done, &fs->flush_lock);
+	} while (fs->flush_passes < target && !fs->flush_stop);
+	pthread_mutex_unlock(&fs->flush_lock);
+}
+/**
+ * @brief  files_open checks whether files are still open on the file system.
+ * @retval 1 if files are open, in which case it cannot be unmounted. 0
+ * 			otherwise.
+ */
+static int files_open(struct fs *fs)
+{
+	pthread_mutex_lock(&fs->dir_lock);
+	int files_open = fs->total_files_open;
+	pthread_mutex_unlock(&fs->dir_lock);
+	if (files_open > 0)
+	{
+		print_out("there are files open. cannot close.\n");
+		return 1;
+	}
+	return 0;
+}
+/**
+ * @brief  free_fs releases the memory and locks of a file system, once its
+ * 			disk and cache are closed.
+ * @retval None
+ */
+static void free_fs(struct fs *fs)
+{
+	for (size_t i = 0; i < FS_OPEN_MAX_COUNT; i++)
+	{
+		pthread_mutex_destroy(&fs->fd_locks[i]);
+	}
+	for (size_t i = 0; i < NODE_COUNT; i++)
+	{
+		pthread_rwlock_destroy(&fs->file_locks[i]);
+	}
+	for (size_t i = 0; i < PATH_CACHE_SIZE; i++)
+	{
+		free(fs->path_cache[i].blk_map);
+	}
+	free(fs->dir_buf);
+	for (size_t i = 0; i < fs->dir_budget; i++)
+	{
+		free(fs->dir_blocks[i].data);
+	}
+	free(fs->dir_blocks);
+	free(fs->held_runs.runs);
+	free(fs->pending_runs.runs);
+	pthread_mutex_destroy(&fs->dir_lock);
+	pthread_mutex_destroy(&fs->alloc_lock);
+	pthread_mutex_destroy(&fs->sync_lock);
+	pthread_mutex_destroy(&fs->commit_lock);
+	pthread_cond_destroy(&fs->commit_cond);
+	free(fs->free_map);
+	free(fs->free_summary);
+	free(fs->fat_dirty);
+	if (fs->fat_mapped)
+	{
+		disk_unmap(fs->FAT, fs->fat_size);
+	}
+	else
+	{
+		free(fs->FAT);
+	}
+	free(fs);
+}
+/**
+ * @brief  umount writes the file system back to disk and releases it, even if
+ * 			the write back fails. No file must be open.
+ * @param  final: filled with the final cache counters, can be NULL
+ * @retval -1 if the file system could not be fully written back. 0 otherwise.
+ */
+static int umount(struct fs *fs, struct fs_cache_stats *final)
+{
+	stop_flusher(fs);
+	// leave the metadata in place and the journal empty
+	int ret = sync_fs(fs, 1);
+	struct cache_stats cs;
+	if (cache_destroy(fs->cache, &cs))
+	{
+		print_out("unable to write back cached blocks to disk.\n");
+		ret = -1;
+	}
+	if (final != NULL)
+	{
+		final->capacity = cs.capacity;
+		final->hits = cs.hits;
+		final->misses = cs.misses;
+		final->evictions = cs.evictions;
+		final->writebacks = cs.writebacks;
+		final->readahead = cs.prefetched;
+	}
+	journal_close(fs->journal);
+	if (disk_close(fs->disk))
+	{
+		print_out("unable to close disk file.\n");
+		ret = -1;
+	}
+
+	free_fs(fs);
+	return ret;
+}
+/**
+ * @brief  now_ns reads the monotonic clock.
+ * @retval time, in nanoseconds.
+ */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+/**
+ * @brief  op_start marks the start of call `op`: the block requests of the
+ * 			calling thread are tagged with `op` + 1 in disk traces until
+ * 			`op_end()`, 0 standing for requests made outside of any call.
+ * @retval time the call starts, to be handed to `op_end()`.
+ */
+static uint64_t op_start(enum fs_op op)
+{
+	block_trace_tag(op + 1);
+	return now_ns();
+}
+/**
+ * @brief  op_end counts a call that started at `start` in the counters of
+ * 			`fs_stats()`.
+ * @note   the counters are shared by every thread, they are only ever
+ * 			added to atomically.
+ * @param  op: the call
+ * @param  ret: value returned by the call, -1 counts as an error
+ * @param  bytes: bytes read or written by the call
+ * @retval None
+ */
+static void op_end(struct fs *fs, enum fs_op op, uint64_t start, int ret,
+				   size_t bytes)
+{
+	block_trace_tag(0);
+	if (fs == NULL)
+	{
+		return;
+	}
+	struct fs_op_stats *st = &fs->op_stats[op];
+	uint64_t ns = now_ns() - start;
+	int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+	if (bucket >= FS_LAT_BUCKETS)
+	{
+		bucket = FS_LAT_BUCKETS - 1;
+	}
+	__atomic_fetch_add(&st->calls, 1, __ATOMIC_RELAXED);
+	if (ret < 0)
+	{
+		__atomic_fetch_add(&st->errors, 1, __ATOMIC_RELAXED);
+	}
+	if (bytes)
+	{
+		__atomic_fetch_add(&st->bytes, bytes, __ATOMIC_RELAXED);
+	}
+	__atomic_fetch_add(&st->total_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&st->latency_ns[bucket], 1, __ATOMIC_RELAXED);
+}
+//*************************************
+// * IMPLEMENTATION
+//*************************************
+
+void fs_options_init(struct fs_options *opts)
+{
+	opts->cache_blocks = FS_CACHE_DEFAULT_BLOCKS;
+	opts->prealloc_blocks = FS_PREALLOC_DEFAULT_BLOCKS;
+	opts->readahead_blocks = FS_READAHEAD_DEFAULT_BLOCKS;
+	opts->backend = FS_BACKEND_SYSCALL;
+	opts->flush_interval_ms = 0;
+	opts->dirty_background_blocks = 0;
+	opts->dirty_limit_blocks = 0;
+	opts->journal_blocks = 0;
+	opts->durable_metadata = 0;
+	opts->discard = 0;
+	opts->lazy_fat = 0;
+	opts->trace = NULL;
+}
+
+void fs_format_options_init(struct fs_format_options *opts)
+{
+	opts->version = 0;
+	opts->block_size = BLOCK_SIZE;
+}
+
+int fs_format(const char *diskname, size_t data_blocks)
+{
+	return fs_format_opts(diskname, data_blocks, NULL);
+}
+
+int fs_format_version(const char *diskname, size_t data_blocks, int version)
+{
+	struct fs_format_options opts;
+	fs_format_options_init(&opts);
+	opts.version = version;
+	return fs_format_opts(diskname, data_blocks, &opts);
+}
+
+int fs_format_opts(const char *diskname, size_t data_blocks,
+				   const struct fs_format_options *opts)
+{
+	struct fs_format_options defaults;
+	if (opts == NULL)
+	{
+		fs_format_options_init(&defaults);
+		opts = &defaults;
+	}
+	int version = opts->version;
+	size_t bs = opts->block_size;
+	if (bs < BLOCK_SIZE_MIN || bs > BLOCK_SIZE_MAX || (bs & (bs - 1)) != 0)
+	{
+		print_out("invalid block size.\n");
+		return -1;
+	}
+	size_t rdir_blocks = RDIR_BLOCKS(bs);
+	size_t fat_blocks = (data_blocks * 2 + bs - 1) / bs;
+	size_t total_blocks = 1 + fat_blocks + rdir_blocks + data_blocks;
+	// block indexes are 16-bit in version 1, and FAT16_EOC is not a valid
+	// data block. Its superblock has no room for the block size either
+	if (version == 0)
+	{
+		version = total_blocks > UINT16_MAX || fat_blocks > UINT8_MAX ||
+						  bs != BLOCK_SIZE
+					  ? FS_VERSION_2
+					  : FS_VERSION_1;
+	}
+	if (version == FS_VERSION_2)
+	{
+		fat_blocks = (data_blocks * 4 + bs - 1) / bs;
+		total_blocks = 1 + fat_blocks + rdir_blocks + data_blocks;
+	}
+	// the disk counts its blocks with an int
+	if (data_blocks == 0 || total_blocks > INT32_MAX ||
+		(version != FS_VERSION_1 && version != FS_VERSION_2) ||
+		(version == FS_VERSION_1 &&
+		 (total_blocks > UINT16_MAX || fat_blocks > UINT8_MAX ||
+		  bs != BLOCK_SIZE)))
+	{
+		print_out("invalid number of data blocks.\n");
+		return -1;
+	}
+	if (block_disk_create_size(diskname, total_blocks, bs))
+	{
+		print_out("unable to create disk file.\n");
+		return -1;
+	}
+	struct disk *disk = disk_open(diskname, BLOCK_BACKEND_FD);
+	if (disk == NULL)
+	{
+		print_out("disk cannot be opened.\n");
+		unlink(diskname);
+		return -1;
+	}
+
+	Superblock superblock;
+	memset(&superblock, 0, sizeof(Superblock));
+	memcpy(superblock.sig, "ECS150FS", 8);
+	superblock.version = version;
+	superblock.total_num_blocks = total_blocks;
+	superblock.root_dir_block_index = 1 + fat_blocks;
+	superblock.data_block_start_index = 1 + fat_blocks + rdir_blocks;
+	superblock.total_num_data_blocks = data_blocks;
+	superblock.num_block_fat = fat_blocks;
+	superblock.block_size = bs;
+	char *sb_block = malloc(bs);
+	// the rest of the FAT, the empty root directory and the data blocks are
+	// all zeros: they are left as holes in the disk file
+	uint8_t *fat_block = calloc(1, bs);
+
+	int ret = 0;
+	if (sb_block == MALLOC_FAIL || fat_block == MALLOC_FAIL)
+	{
+		print_out("unable to allocate memory for the file system.\n");
+		ret = -1;
+	}
+	else
+	{
+		store_superblock(&superblock, sb_block);
+		if (version == FS_VERSION_2)
+		{
+			((uint32_t *)fat_block)[0] = FAT32_EOC;
+		}
+		else
+		{
+			((uint16_t *)fat_block)[0] = FAT16_EOC;
+		}
+	}
+
+	if (ret == 0 && (disk_set_block_size(disk, bs) ||
+					 disk_write(disk, 0, sb_block) ||
+					 disk_write(disk, 1, fat_block) || disk_flush(disk)))
+	{
+		print_out("unable to write the file system to disk.\n");
+		ret = -1;
+	}
+	if (disk_close(disk))
+	{
+		ret = -1;
+	}
+	if (ret)
+	{
+		unlink(diskname);
+	}
+	free(sb_block);
+	free(fat_block);
+	return ret;
+}
+
+int fs_mount(const char *diskname)
+{
+	return fs_mount_opts(diskname, NULL);
+}
+
+int fs_mount_opts(const char *diskname, const struct fs_options *opts)
+{
+	pthread_mutex_lock(&default_lock);
+	if (default_fs != NULL)
+	{
+		pthread_mutex_unlock(&default_lock);
+		print_out("a file system is already mounted.\n");
+		return -1;
+	}
+	default_fs = fs_mount_ex(diskname, opts);
+	int ret = default_fs == NULL ? -1 : 0;
+	pthread_mutex_unlock(&default_lock);
+	return ret;
+}
+
+struct fs *fs_mount_ex(const char *diskname, const struct fs_options *opts)
+{
+	uint64_t start = op_start(FS_OP_MOUNT);
+	struct fs_options defaults;
+	if (opts == NULL)
+	{
+		fs_options_init(&defaults);
+		opts = &defaults;
+	}
+
+	struct fs *fs = calloc(1, sizeof(struct fs));
+	if (fs == MALLOC_FAIL)
+	{
+		print_out("unable to allocate memory for the file system.\n");
+		return NULL;
+	}
+	for (size_t i = 0; i < FS_OPEN_MAX_COUNT; i++)
+	{
+		pthread_mutex_init(&fs->fd_locks[i], NULL);
+	}
+	for (size_t i = 0; i < NODE_COUNT; i++)
+	{
+		pthread_rwlock_init(&fs->file_locks[i], NULL);
+	}
+	for (size_t i = 0; i < PATH_CACHE_BUCKETS; i++)
+	{
+		fs->path_buckets[i] = -1;
+	}
+	for (size_t i = 0; i < DIR_BLOCK_BUCKETS; i++)
+	{
+		fs->dir_block_buckets[i] = -1;
+	}
+	fs->dir_free = -1;
+	fs->held_runs.hold = 1;
+	pthread_mutex_init(&fs->dir_lock, NULL);
+	pthread_mutex_init(&fs->alloc_lock, NULL);
+	pthread_mutex_init(&fs->sync_lock, NULL);
+	pthread_mutex_init(&fs->commit_lock, NULL);
+	pthread_cond_init(&fs->commit_cond, NULL);
+	fs->commit_next = 1;
+	char *signature = "ECS150FS";
+
+	enum block_backend backend = BLOCK_BACKEND_FD;
+	if (opts->backend == FS_BACKEND_MMAP)
+	{
+		backend = BLOCK_BACKEND_MMAP;
+	}
+	else if (opts->backend == FS_BACKEND_IO_URING)
+	{
+		backend = BLOCK_BACKEND_IO_URING;
+	}
+
+	fs->disk = disk_open(diskname, backend);
+	if (fs->disk == NULL)
+	{
+		print_out("disk cannot be opened.\n");
+		goto fail;
+	}
+
+	// the superblock fits in the smallest block, and tells the block size
+	char sb_block[BLOCK_SIZE_MIN];
+	if (disk_set_block_size(fs->disk, BLOCK_SIZE_MIN) ||
+		disk_read(fs->disk, 0, sb_block))
+	{
+		print_out("unable to read superblock from disk.\n");
+		goto fail;
+	}
+	load_superblock(&fs->superblock, sb_block);
+
+	for (size_t i = 0; i < strlen(signature); i++)
+	{
+		if (signature[i] != (char)fs->superblock.sig[i])
+		{
+			print_out("invalid signature.\n");
+			goto fail;
+		}
+	}
+	if (disk_set_block_size(fs->disk, fs->superblock.block_size))
+	{
+		print_out("invalid block size.\n");
+		goto fail;
+	}
+	if (fs->superblock.total_num_blocks != (size_t)disk_count(fs->disk))
+	{
+		print_out("total number of blocks do not match.\n");
+		goto fail;
+	}
+	if (opts->trace != NULL && disk_trace_start(fs->disk, opts->trace))
+	{
+		print_out("unable to start the disk trace.\n");
+		goto fail;
+	}
+	fs->block_size = fs->superblock.block_size;
+	fs->rdir_blocks = RDIR_BLOCKS(fs->block_size);
+	fs->fat32 = fs->superblock.version == FS_VERSION_2;
+	fs->fat_per_block = fs->block_size / (fs->fat32 ? 4 : 2);
+	if (fs->superblock.num_block_fat * fs->fat_per_block <
+			fs->superblock.total_num_data_blocks ||
+		fs->superblock.root_dir_block_index < 1 + fs->superblock.num_block_fat ||
+		fs->superblock.root_dir_block_index + fs->rdir_blocks >
+			fs->superblock.data_block_start_index ||
+		fs->superblock.data_block_start_index +
+				fs->superblock.total_num_data_blocks >
+			fs->superblock.total_num_blocks ||
+		fs->superblock.total_num_data_blocks >= FAT_EOC)
+	{
+		print_out("invalid superblock.\n");
+		goto fail;
+	}
+
+	// bring the metadata up to date before reading it
+	if (fs->superblock.journal_magic == SB_JOURNAL_MAGIC)
+	{
+		fs->journal = journal_open(fs->disk,
+								   fs->superblock.data_block_start_index +
+									   fs->superblock.journal_start,
+								   fs->superblock.journal_blocks);
+		if (fs->journal == NULL)
+		{
+			print_out("unable to replay the journal.\n");
+			goto fail;
+		}
+	}
+
+	//* allocate File Allocation Table and copy its contents from disk
+	size_t nr_fat = fs->superblock.num_block_fat;
+	fs->fat_size = nr_fat * fs->block_size;
+	if (opts->lazy_fat)
+	{
+		// FAT blocks are read as they are touched, the journal was
+		// replayed in place already
+		fs->FAT = (uint8_t *)disk_map(fs->disk, 1, nr_fat);
+		if (fs->FAT == NULL)
+		{
+			print_out("unable to map the FAT.\n");
+			goto fail;
+		}
+		fs->fat_mapped = 1;
+	}
+	else
+	{
+		fs->FAT = (uint8_t *)malloc(fs->fat_size);
+		if (fs->FAT == MALLOC_FAIL)
+		{
+			print_out("unable to allocate memory for FAT.\n");
+			goto fail;
+		}
+		// the FAT blocks are contiguous, read them IO_BATCH at a time
+		size_t blocks[IO_BATCH];
+		void *bufs[IO_BATCH];
+		for (size_t i = 0; i < nr_fat; i += IO_BATCH)
+		{
+			size_t n = nr_fat - i < IO_BATCH ? nr_fat - i : IO_BATCH;
+			for (size_t j = 0; j < n; j++)
+			{
+				blocks[j] = 1 + i + j;
+				bufs[j] = fs->FAT + (i + j) * fs->block_size;
+			}
+			if (disk_readv(fs->disk, blocks, bufs, n))
+			{
+				print_out("unable to copy contents of the FAT from disk.\n");
+				goto fail;
+			}
+		}
+	}
+	fs->fat_dirty = calloc(fs->superblock.num_block_fat, sizeof(uint8_t));
+	if (fs->fat_dirty == MALLOC_FAIL)
+	{
+		print_out("unable to allocate memory for FAT.\n");
+		goto fail;
+	}
+	write_fat(fs, 0, FAT_EOC);
+	fs->reserved_blocks = 0;
+	fs->prealloc_blocks = opts->prealloc_blocks ? opts->prealloc_blocks : 1;
+	// read-ahead blocks must not push the blocks being read out of the cache
+	fs->discard = opts->discard;
+	fs->readahead_max = opts->readahead_blocks;
+	if (fs->readahead_max > opts->cache_blocks / 2)
+	{
+		fs->readahead_max = opts->cache_blocks / 2;
+	}
+	// with a mapped FAT, scanning it would read it whole
+	if (!fs->fat_mapped && build_free_map(fs))
+	{
+		print_out("unable to allocate memory for the free-space bitmap.\n");
+		goto fail;
+	}
+
+	//* copy the root directory from disk
+	if (read_rdir(fs))
+	{
+		print_out("unable to copy contents of the root directory from disk.\n");
+		goto fail;
+	}
+	build_dir_index(fs);
+	fs->dir_buf = malloc(2 * fs->block_size);
+	if (fs->dir_buf == MALLOC_FAIL)
+	{
+		print_out("unable to allocate memory for the directories.\n");
+		goto fail;
+	}
+
+	if (fs->journal == NULL && opts->journal_blocks > 0 &&
+		create_journal(fs, opts->journal_blocks))
+	{
+		goto fail;
+	}
+	fs->durable_metadata = fs->journal != NULL && opts->durable_metadata;
+	if (init_dir_blocks(fs))
+	{
+		goto fail;
+	}
+
+	// the opened file table starts empty: calloc() set every metadata ptr to
+	// NULL
+
+	// data blocks go through the block cache from now on
+	fs->cache = cache_init(fs->disk, opts->cache_blocks);
+	if (fs->cache == NULL)
+	{
+		print_out("unable to set up the block cache.\n");
+		goto fail;
+	}
+
+	fs->dirty_background = opts->dirty_background_blocks
+							   ? opts->dirty_background_blocks
+							   : opts->cache_blocks / 4;
+	fs->dirty_limit = opts->dirty_limit_blocks ? opts->dirty_limit_blocks
+											   : opts->cache_blocks / 2;
+	if (fs->dirty_limit < fs->dirty_background)
+	{
+		fs->dirty_limit = fs->dirty_background;
+	}
+	fs->flush_interval_ms = opts->flush_interval_ms;
+	if (fs->flush_interval_ms > 0 && start_flusher(fs))
+	{
+		print_out("unable to start the background flusher.\n");
+		goto fail;
+	}
+
+	// print out superblock, FAT, and root dir block
+	//pcd(fs, 15, 0);
+
+	op_end(fs, FS_OP_MOUNT, start, 0, 0);
+	return fs;
+
+fail:
+	block_trace_tag(0);
+	if (fs->cache != NULL)
+	{
+		cache_destroy(fs->cache, NULL);
+	}
+	journal_close(fs->journal);
+	if (fs->disk != NULL)
+	{
+		disk_close(fs->disk);
+	}
+	free_fs(fs);
+	return NULL;
+}
+
+int fs_umount(void)
+{
+	pthread_mutex_lock(&default_lock);
+	if (default_fs == NULL)
+	{
+		pthread_mutex_unlock(&default_lock);
+		print_out("no virtual disk was open.\n");
+		return -1;
+	}
+	if (files_open(default_fs))
+	{
+		pthread_mutex_unlock(&default_lock);
+		return -1;
+	}
+	int ret = umount(default_fs, &last_stats);
+	default_fs = NULL;
+	pthread_mutex_unlock(&default_lock);
+	return ret;
+}
+
+int fs_sync_ex(struct fs *fs)
+{
+	if (fs == NULL)
+	{
+		print_out("no virtual disk was open.\n");
+		return -1;
+	}
+	uint64_t start = op_start(FS_OP_SYNC);
+	int ret = sync_fs(fs, 0);
+	op_end(fs, FS_OP_SYNC, start, ret, 0);
+	return ret;
+}
+
+int fs_sync_async_ex(struct fs *fs)
+{
+	if (fs == NULL)
+	{
+		print_out("no virtual disk was open.\n");
+		return -1;
+	}
+	uint64_t start = op_start(FS_OP_SYNC_ASYNC);
+	int ret = 0;
+	if (!fs->flusher_running)
+	{
+		ret = sync_fs(fs, 0);
+	}
+	else
+	{
+		wake_flusher(fs);
+	}
+	op_end(fs, FS_OP_SYNC_ASYNC, start, ret, 0);
+	return ret;
+}
+
+int fs_umount_ex(struct fs *fs)
+{
+	if (fs == NULL)
+	{
+		print_out("no virtual disk was open.\n");
+		return -1;
+	}
+	if (files_open(fs))
+	{
+		return -1;
+	}
+	return umount(fs, NULL);
+}
+
+/**
+ * @brief  push_block appends `block` to the array `blocks` of `len` blocks,
+ * 			grown as needed.
+ * @retval -1 if memory cannot be allocated. 0 otherwise.
+ */
+static int push_block(uint32_t **blocks, size_t *len, size_t *cap,
+					  uint32_t block)
+{
+	if (*len == *cap)
+	{
+		size_t new_cap = *cap ? 2 * *cap : 64;
+		uint32_t *new_blocks =
+			(uint32_t *)realloc(*blocks, new_cap * sizeof(uint32_t));
+		if (new_blocks == MALLOC_FAIL)
+		{
+			print_out("unable to allocate memory for the directory.\n");
+			return -1;
+		}
+		*blocks = new_blocks;
+		*cap = new_cap;
+	}
+	(*blocks)[(*len)++] = block;
+	return 0;
+}
+/**
+ * @brief  sub_chains collects the first block of every file and
+ * 			subdirectory below the root directory, for `count_fragments()`.
+ * @note   the caller holds `dir_lock`. Subdirectories are walked from a
+ * 			queue rather than through the path cache, which is left as is.
+ * @param  subs: set to the first blocks, to be freed by the caller
+ * @param  nr_subs: set to the number of blocks in `subs`
+ * @retval -1 if a directory cannot be read or memory cannot be allocated. 0
+ * 			otherwise.
+ */
+static int sub_chains(struct fs *fs, uint32_t **subs, size_t *nr_subs)
+{
+	uint32_t *dirs = NULL;
+	size_t nr_dirs = 0, dirs_cap = 0, subs_cap = 0;
+	size_t per_block = fs->block_size / sizeof(DirectoryEntryV2);
+	int ret = flush_sub_entries(fs);
+	*subs = NULL;
+	*nr_subs = 0;
+	for (size_t i = 0; ret == 0 && i < FS_FILE_MAX_COUNT; i++)
+	{
+		if (fs->RootDirectory[i].filename[0] != '\0' &&
+			fs->RootDirectory[i].type == DIRENT_DIR)
+		{
+			ret = push_block(&dirs, &nr_dirs, &dirs_cap,
+							 fs->RootDirectory[i].first_data_block_index);
+		}
+	}
+	for (size_t d = 0; ret == 0 && d < nr_dirs; d++)
+	{
+		// the buckets of a directory are the blocks of its chain
+		size_t n = 0;
+		for (uint32_t block = dirs[d]; block != FAT_EOC;
+			 block = fat_get(fs, block))
+		{
+			if (block >= fs->superblock.total_num_data_blocks ||
+				n == DIR_MAX_BUCKETS)
+			{
+				print_out("corrupted directory.\n");
+				ret = -1;
+				break;
+			}
+			n++;
+		}
+		size_t bucket = 0;
+		for (uint32_t block = dirs[d]; ret == 0 && block != FAT_EOC;
+			 block = fat_get(fs, block), bucket++)
+		{
+			if (dir_read(fs, block, fs->dir_buf))
+			{
+				ret = -1;
+				break;
+			}
+			for (size_t j = 0; ret == 0 && j < per_block; j++)
+			{
+				DirectoryTableNode entry;
+				if (!dir_slot_valid((const DirectoryEntryV2 *)fs->dir_buf + j,
+									bucket, n))
+				{
+					continue;
+				}
+				load_dir_entry(fs, &entry, fs->dir_buf, j);
+				ret = push_block(subs, nr_subs, &subs_cap,
+								 entry.first_data_block_index);
+				if (ret == 0 && entry.type == DIRENT_DIR)
+				{
+					ret = push_block(&dirs, &nr_dirs, &dirs_cap,
+									 entry.first_data_block_index);
+				}
+			}
+		}
+	}
+	free(dirs);
+	if (ret)
+	{
+		free(*subs);
+		*subs = NULL;
+		*nr_subs = 0;
+	}
+	return ret;
+}
+
+static int print_info(struct fs *fs)
+{
+	if (fs == NULL)
+	{
+		print_out("no virtual disk was open.\n");
+		return -1;
+	}
+	fprintf(stdout, "FS Info:\n");
+	fprintf(stdout, "total_blk_count=%zu\n", fs->superblock.total_num_blocks);
+	fprintf(stdout, "fat_blk_count=%zu\n", fs->superblock.num_block_fat);
+	fprintf(stdout, "rdir_blk=%zu\n", fs->superblock.root_dir_block_index);
+	fprintf(stdout, "data_blk=%zu\n", fs->superblock.data_block_start_index);
+	fprintf(stdout, "data_blk_count=%zu\n",
+			fs->superblock.total_num_data_blocks);
+	uint32_t *subs;
+	size_t nr_subs;
+	pthread_mutex_lock(&fs->dir_lock);
+	if (sub_chains(fs, &subs, &nr_subs))
+	{
+		pthread_mutex_unlock(&fs->dir_lock);
+		return -1;
+	}
+	if (lock_alloc(fs))
+	{
+		pthread_mutex_unlock(&fs->dir_lock);
+		free(subs);
+		return -1;
+	}
+	fprintf(stdout, "fat_free_ratio=%zu/%zu\n",
+			fs->free_blocks + fs->reserved_blocks,
+			fs->superblock.total_num_data_blocks);
+	fprintf(stdout, "rdir_free_ratio=%d/%d\n",
+			fs->free_slot_count,
+			FS_FILE_MAX_COUNT);
+	size_t breaks, links;
+	count_fragments(fs, subs, nr_subs, &breaks, &links);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	pthread_mutex_unlock(&fs->dir_lock);
+	free(subs);
+	fprintf(stdout, "frag_ratio=%zu/%zu\n", breaks, links);
+	if (fs->superblock.version == FS_VERSION_2 || fs->block_size != BLOCK_SIZE)
+	{
+		fprintf(stdout, "blk_size=%zu\n", fs->block_size);
+	}
+	return 0;
+}
+
+int fs_info_ex(struct fs *fs)
+{
+	uint64_t start = op_start(FS_OP_INFO);
+	int ret = print_info(fs);
+	op_end(fs, FS_OP_INFO, start, ret, 0);
+	return ret;
+}
+
+int fs_cache_stats(struct fs_cache_stats *stats)
+{
+	if (stats == NULL)
+	{
+		print_out("invalid stats buffer.\n");
+		return -1;
+	}
+	pthread_mutex_lock(&default_lock);
+	int ret = 0;
+	if (default_fs == NULL)
+	{
+		*stats = last_stats;
+	}
+	else
+	{
+		ret = fs_cache_stats_ex(default_fs, stats);
+	}
+	pthread_mutex_unlock(&default_lock);
+	return ret;
+}
+
+int fs_cache_stats_ex(struct fs *fs, struct fs_cache_stats *stats)
+{
+	struct cache_stats cs;
+	if (fs == NULL || stats == NULL || cache_get_stats(fs->cache, &cs))
+	{
+		print_out("invalid stats buffer.\n");
+		return -1;
+	}
+	stats->capacity = cs.capacity;
+	stats->hits = cs.hits;
+	stats->misses = cs.misses;
+	stats->evictions = cs.evictions;
+	stats->writebacks = cs.writebacks;
+	stats->readahead = cs.prefetched;
+	return 0;
+}
+
+int fs_journal_stats_ex(struct fs *fs, struct fs_journal_stats *stats)
+{
+	struct journal_stats js;
+	if (fs == NULL || stats == NULL)
+	{
+		print_out("invalid stats buffer.\n");
+		return -1;
+	}
+	pthread_mutex_lock(&fs->sync_lock);
+	int ret = journal_get_stats(fs->journal, &js);
+	pthread_mutex_unlock(&fs->sync_lock);
+	if (ret)
+	{
+		print_out("no journal.\n");
+		return -1;
+	}
+	stats->capacity = js.capacity;
+	stats->commits = js.commits;
+	stats->committed_blocks = js.committed_blocks;
+	stats->checkpoints = js.resets;
+	stats->replayed_commits = js.replayed_commits;
+	stats->replayed_blocks = js.replayed_blocks;
+	stats->replay_us = js.replay_us;
+	return 0;
+}
 
-	// set initial filesize
-	RootDirectory[index_of_empty_entry].file_size = 0;
+const char *fs_op_name(enum fs_op op)
+{
+	if ((unsigned int)op >= FS_OP_COUNT)
+	{
+		return NULL;
+	}
+	return op_names[op];
+}
 
-	// set the first data block index to FAT_EOC
-	RootDirectory[index_of_empty_entry].first_data_block_index = FAT_EOC;
+int fs_stats_ex(struct fs *fs, struct fs_stats *stats)
+{
+	struct disk_stats ds;
+	if (fs == NULL || stats == NULL || fs_cache_stats_ex(fs, &stats->cache) ||
+		disk_get_stats(fs->disk, &ds))
+	{
+		print_out("invalid stats buffer.\n");
+		return -1;
+	}
+	for (size_t op = 0; op < FS_OP_COUNT; op++)
+	{
+		struct fs_op_stats *st = &fs->op_stats[op];
+		stats->ops[op].calls = __atomic_load_n(&st->calls, __ATOMIC_RELAXED);
+		stats->ops[op].errors = __atomic_load_n(&st->errors, __ATOMIC_RELAXED);
+		stats->ops[op].bytes = __atomic_load_n(&st->bytes, __ATOMIC_RELAXED);
+		stats->ops[op].total_ns = __atomic_load_n(&st->total_ns,
+												  __ATOMIC_RELAXED);
+		for (size_t i = 0; i < FS_LAT_BUCKETS; i++)
+		{
+			stats->ops[op].latency_ns[i] =
+				__atomic_load_n(&st->latency_ns[i], __ATOMIC_RELAXED);
+		}
+	}
+	stats->fat_steps = __atomic_load_n(&fs->fat_steps, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&fs->alloc_lock);
+	stats->allocated_blocks = fs->allocated_blocks;
+	stats->freed_blocks = fs->freed_blocks;
+	pthread_mutex_unlock(&fs->alloc_lock);
 
+	stats->disk_reads = ds.reads;
+	stats->disk_read_blocks = ds.read_blocks;
+	stats->disk_writes = ds.writes;
+	stats->disk_written_blocks = ds.written_blocks;
+	stats->disk_flushes = ds.flushes;
+	stats->disk_read_total_ns = ds.read_total_ns;
+	stats->disk_write_total_ns = ds.write_total_ns;
+	for (size_t i = 0; i < FS_LAT_BUCKETS && i < DISK_LAT_BUCKETS; i++)
+	{
+		stats->disk_read_ns[i] = ds.read_ns[i];
+		stats->disk_write_ns[i] = ds.write_ns[i];
+	}
 	return 0;
 }
 
-int fs_delete(const char *filename)
+/**
+ * @brief  dump_histogram prints latency histogram `hist` as a Prometheus
+ * 			histogram in seconds, with cumulative buckets.
+ * @param  name: metric name, without the _bucket/_sum/_count suffixes
+ * @param  labels: labels of every sample, without braces
+ * @param  total_ns: sum of the latencies, in nanoseconds
+ * @retval None
+ */
+static void dump_histogram(FILE *stream, const char *name, const char *labels,
+						   const size_t *hist, size_t total_ns)
 {
-	if (block_disk_count() < 0)
+	size_t last = 0, count = 0;
+	for (size_t i = 0; i < FS_LAT_BUCKETS; i++)
 	{
-		print_out("no virtual disk was open.\n");
+		if (hist[i])
+		{
+			last = i;
+		}
+	}
+	// the last bucket has no upper bound, +Inf stands for it
+	for (size_t i = 0; i <= last && i < FS_LAT_BUCKETS - 1; i++)
+	{
+		count += hist[i];
+		fprintf(stream, "%s_bucket{%s,le=\"%.9g\"} %zu\n", name, labels,
+				(double)((uint64_t)2 << i) / 1e9, count);
+	}
+	count += hist[FS_LAT_BUCKETS - 1];
+	fprintf(stream, "%s_bucket{%s,le=\"+Inf\"} %zu\n", name, labels, count);
+	fprintf(stream, "%s_sum{%s} %.9f\n", name, labels, total_ns / 1e9);
+	fprintf(stream, "%s_count{%s} %zu\n", name, labels, count);
+}
+
+int fs_stats_dump(const struct fs_stats *stats, FILE *stream)
+{
+	if (stats == NULL || stream == NULL)
+	{
+		print_out("invalid stats buffer.\n");
 		return -1;
 	}
+	char labels[64];
+	fprintf(stream, "# TYPE fs_calls_total counter\n");
+	for (size_t op = 0; op < FS_OP_COUNT; op++)
+	{
+		fprintf(stream, "fs_calls_total{op=\"%s\"} %zu\n", op_names[op],
+				stats->ops[op].calls);
+	}
+	fprintf(stream, "# TYPE fs_errors_total counter\n");
+	for (size_t op = 0; op < FS_OP_COUNT; op++)
+	{
+		fprintf(stream, "fs_errors_total{op=\"%s\"} %zu\n", op_names[op],
+				stats->ops[op].errors);
+	}
+	fprintf(stream, "# TYPE fs_bytes_total counter\n");
+	fprintf(stream, "fs_bytes_total{op=\"read\"} %zu\n",
+			stats->ops[FS_OP_READ].bytes);
+	fprintf(stream, "fs_bytes_total{op=\"write\"} %zu\n",
+			stats->ops[FS_OP_WRITE].bytes);
+	fprintf(stream, "# TYPE fs_latency_seconds histogram\n");
+	for (size_t op = 0; op < FS_OP_COUNT; op++)
+	{
+		snprintf(labels, sizeof(labels), "op=\"%s\"", op_names[op]);
+		dump_histogram(stream, "fs_latency_seconds", labels,
+					   stats->ops[op].latency_ns, stats->ops[op].total_ns);
+	}
+	fprintf(stream, "# TYPE fs_fat_steps_total counter\n");
+	fprintf(stream, "fs_fat_steps_total %zu\n", stats->fat_steps);
+	fprintf(stream, "# TYPE fs_allocated_blocks_total counter\n");
+	fprintf(stream, "fs_allocated_blocks_total %zu\n",
+			stats->allocated_blocks);
+	fprintf(stream, "# TYPE fs_freed_blocks_total counter\n");
+	fprintf(stream, "fs_freed_blocks_total %zu\n", stats->freed_blocks);
+	fprintf(stream, "# TYPE fs_cache_hits_total counter\n");
+	fprintf(stream, "fs_cache_hits_total %zu\n", stats->cache.hits);
+	fprintf(stream, "# TYPE fs_cache_misses_total counter\n");
+	fprintf(stream, "fs_cache_misses_total %zu\n", stats->cache.misses);
+	fprintf(stream, "# TYPE fs_cache_evictions_total counter\n");
+	fprintf(stream, "fs_cache_evictions_total %zu\n", stats->cache.evictions);
+	fprintf(stream, "# TYPE fs_cache_writebacks_total counter\n");
+	fprintf(stream, "fs_cache_writebacks_total %zu\n",
+			stats->cache.writebacks);
+	fprintf(stream, "# TYPE fs_cache_readahead_total counter\n");
+	fprintf(stream, "fs_cache_readahead_total %zu\n", stats->cache.readahead);
+	fprintf(stream, "# TYPE fs_disk_requests_total counter\n");
+	fprintf(stream, "fs_disk_requests_total{dir=\"read\"} %zu\n",
+			stats->disk_reads);
+	fprintf(stream, "fs_disk_requests_total{dir=\"write\"} %zu\n",
+			stats->disk_writes);
+	fprintf(stream, "# TYPE fs_disk_blocks_total counter\n");
+	fprintf(stream, "fs_disk_blocks_total{dir=\"read\"} %zu\n",
+			stats->disk_read_blocks);
+	fprintf(stream, "fs_disk_blocks_total{dir=\"write\"} %zu\n",
+			stats->disk_written_blocks);
+	fprintf(stream, "# TYPE fs_disk_flushes_total counter\n");
+	fprintf(stream, "fs_disk_flushes_total %zu\n", stats->disk_flushes);
+	fprintf(stream, "# TYPE fs_disk_latency_seconds histogram\n");
+	dump_histogram(stream, "fs_disk_latency_seconds", "dir=\"read\"",
+				   stats->disk_read_ns, stats->disk_read_total_ns);
+	dump_histogram(stream, "fs_disk_latency_seconds", "dir=\"write\"",
+				   stats->disk_write_ns, stats->disk_write_total_ns);
+	return ferror(stream) ? -1 : 0;
+}
+
+/**
+ * @brief  add_root_entry adds an empty file or directory named `filename` to
+ * 			the root directory.
+ * @note   the caller holds `dir_lock`.
+ * @param  filename: valid NULL-terminated filename
+ * @param  type: DIRENT_FILE or DIRENT_DIR
+ * @retval -1 if the root directory is full, if the name is taken, or if the
+ * 			directory cannot be allocated. 0 otherwise.
+ */
+static int add_root_entry(struct fs *fs, const char *filename, uint8_t type)
+{
 	int filename_len = strlen(filename);
-	if (filename_len < 1 || filename_len > FS_FILENAME_LEN)
+	if (fs->free_slot_count == 0)
 	{
-		print_out("invalid filename.\n");
+		print_out("root directory full.\n");
 		return -1;
 	}
-	// check if the file is currently open
-	for (size_t i = 0; i < FS_OPEN_MAX_COUNT; i++)
+
+	if (find_dir_entry(fs, filename) >= 0)
+	{
+		print_out("file already exists with that name.\n");
+		return -1;
+	}
+
+	// a directory starts with a single empty bucket
+	uint32_t first = FAT_EOC;
+	if (type == DIRENT_DIR && (first = alloc_dir_block(fs)) == FAT_EOC)
+	{
+		return -1;
+	}
+
+	// take an empty entry in the root directory
+	int index_of_empty_entry = fs->free_slots[--fs->free_slot_count];
+
+	// reset the struct, empty old information
+	memset(&fs->RootDirectory[index_of_empty_entry], 0, sizeof(DirectoryTableNode));
+
+	// copy filename
+	int i = 0;
+	while (i < filename_len)
+	{
+		fs->RootDirectory[index_of_empty_entry].filename[i] = filename[i];
+		i++;
+	}
+
+	// set initial filesize
+	fs->RootDirectory[index_of_empty_entry].file_size =
+		first == FAT_EOC ? 0 : fs->block_size;
+
+	// set the first data block index, FAT_EOC for a file
+	fs->RootDirectory[index_of_empty_entry].first_data_block_index = first;
+	fs->RootDirectory[index_of_empty_entry].type = type;
+
+	dir_index_insert(fs, index_of_empty_entry);
+	mark_rdir_dirty(fs);
+	return 0;
+}
+/**
+ * @brief  add_subdir_entry adds an empty file or directory named `name` to
+ * 			the subdirectory at `path`, doubling its hash table until the
+ * 			bucket of the name has room.
+ * @note   the caller holds `dir_lock`.
+ * @param  path: path of the subdirectory, not NULL-terminated
+ * @param  len: length of `path`
+ * @param  name: valid NULL-terminated name
+ * @param  type: DIRENT_FILE or DIRENT_DIR
+ * @retval -1 if the subdirectory doesn't exist, if the name is taken, if
+ * 			there is no room left, or if a block cannot be read or written.
+ * 			0 otherwise.
+ */
+static int add_subdir_entry(struct fs *fs, const char *path, size_t len,
+							const char *name, uint8_t type)
+{
+	PathCacheNode *dir = resolve_dir(fs, path, len);
+	if (dir == NULL)
 	{
-		if (OFT[i].metadata != NULL)
+		return -1;
+	}
+	size_t old_buckets = dir->nr_buckets;
+	DirectoryTableNode entry;
+	uint32_t block, slot;
+	int found;
+	while ((found = dir_lookup(fs, dir, name, &entry, &block, &slot)) == 0 &&
+		   block == FAT_EOC)
+	{ // the bucket of the name is full
+		if (dir_split(fs, dir))
 		{
-			if (!strcmp((char *)OFT[i].metadata->filename, filename))
-			{
-				print_out("cannot delete. file currently open.\n");
-				return -1;
-			}
+			return -1;
 		}
 	}
+	if (found != 0)
+	{
+		print_out("file already exists with that name.\n");
+		return -1;
+	}
+	size_t new_buckets = dir->nr_buckets;
 
-	// search for `filename` in the root directory and get its index
-	int index_of_entry = -1;
-	for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++)
+	memset(&entry, 0, sizeof(DirectoryTableNode));
+	memcpy(entry.filename, name, strlen(name));
+	entry.first_data_block_index = FAT_EOC;
+	entry.type = type;
+	if (type == DIRENT_DIR)
 	{
-		if (!strcmp((char *)RootDirectory[i].filename, filename))
+		if ((entry.first_data_block_index = alloc_dir_block(fs)) == FAT_EOC)
 		{
-			index_of_entry = i;
-			break;
+			return -1;
 		}
+		entry.file_size = fs->block_size;
 	}
-	if (index_of_entry < 0)
+	// the bucket is still in `dir_buf`
+	store_dir_entry(fs, fs->dir_buf, slot, &entry);
+	if (dir_write(fs, block, fs->dir_buf))
 	{
-		print_out("no entry found.\n");
+		return -1;
+	}
+	if (new_buckets != old_buckets &&
+		update_dir_size(fs, path, len, new_buckets * fs->block_size))
+	{
+		return -1;
+	}
+	return 0;
+}
+/**
+ * @brief  create_entry creates an empty file or directory at `path`.
+ * @param  path: path of the new entry
+ * @param  type: DIRENT_FILE or DIRENT_DIR
+ * @retval -1 if the entry cannot be created. 0 otherwise.
+ */
+static int create_entry(struct fs *fs, const char *path, uint8_t type)
+{
+	if (fs == NULL)
+	{
+		print_out("no virtual disk was open.\n");
+		return -1;
+	}
+	const char *rel, *name;
+	size_t dir_len;
+	if (parse_path(fs, path, &rel, &dir_len, &name))
+	{
+		print_out("invalid filename.\n");
+		return -1;
+	}
+	if (type == DIRENT_DIR && fs->superblock.version != FS_VERSION_2)
+	{
+		print_out("directories need a version 2 file system.\n");
 		return -1;
 	}
 
-	// * remove all data blocks from the FAT
-	// set current block = the starting block
-	uint16_t curr_block = RootDirectory[index_of_entry].first_data_block_index;
-	uint16_t tmp;
-	while (FAT[curr_block] != FAT_EOC)
+	pthread_mutex_lock(&fs->dir_lock);
+	int ret = (type == DIRENT_DIR || rel != name) &&
+			  dir_room(fs, DIR_OP_BLOCKS);
+	if (ret == 0)
+	{
+		ret = rel == name ? add_root_entry(fs, name, type)
+						  : add_subdir_entry(fs, rel, dir_len, name, type);
+	}
+	pthread_mutex_unlock(&fs->dir_lock);
+
+	return ret ? -1 : commit_wait(fs);
+}
+
+int fs_create_ex(struct fs *fs, const char *filename)
+{
+	uint64_t start = op_start(FS_OP_CREATE);
+	int ret = create_entry(fs, filename, DIRENT_FILE);
+	op_end(fs, FS_OP_CREATE, start, ret, 0);
+	return ret;
+}
+
+int fs_mkdir_ex(struct fs *fs, const char *path)
+{
+	uint64_t start = op_start(FS_OP_MKDIR);
+	int ret = create_entry(fs, path, DIRENT_DIR);
+	op_end(fs, FS_OP_MKDIR, start, ret, 0);
+	return ret;
+}
+
+/**
+ * @brief  remove_root_entry removes the file or directory named `filename`
+ * 			from the root directory.
+ * @note   the caller holds `dir_lock`, and frees the blocks.
+ * @param  filename: valid NULL-terminated filename
+ * @param  type: DIRENT_FILE or DIRENT_DIR
+ * @param  first: set to the first block of the entry
+ * @retval -1 if there is no such entry of type `type`, or if the file is
+ * 			open. 0 otherwise.
+ */
+static int remove_root_entry(struct fs *fs, const char *filename,
+							 uint8_t type, uint32_t *first)
+{
+	// search for `filename` in the root directory and get its index
+	int index_of_entry = find_dir_entry(fs, filename);
+	if (index_of_entry < 0 || fs->RootDirectory[index_of_entry].type != type)
 	{
-		tmp = FAT[curr_block]; // temporarily store the next block
-		FAT[curr_block] = 0;   // free the current block
-		curr_block = tmp;	  // set next block to the current block
+		print_out("no entry found.\n");
+		return -1;
 	}
-	if (FAT[curr_block] == FAT_EOC)
+	// check if the file is currently open. nobody can open it while the
+	// directory is locked, so its blocks can be freed without its file lock
+	if (fs->open_count[index_of_entry] > 0)
 	{
-		FAT[curr_block] = 0;
+		print_out("cannot delete. file currently open.\n");
+		return -1;
 	}
+	*first = fs->RootDirectory[index_of_entry].first_data_block_index;
 
 	// reset the struct, empty old information
-	memset(&RootDirectory[index_of_entry], 0, sizeof(DirectoryTableNode));
-
+	dir_index_remove(fs, index_of_entry);
+	memset(&fs->RootDirectory[index_of_entry], 0, sizeof(DirectoryTableNode));
+	fs->free_slots[fs->free_slot_count++] = index_of_entry;
+	mark_rdir_dirty(fs);
 	return 0;
 }
+/**
+ * @brief  remove_subdir_entry removes the file or directory named `name`
+ * 			from the subdirectory at `path`.
+ * @note   the caller holds `dir_lock`, and frees the blocks.
+ * @param  path: path of the subdirectory, not NULL-terminated
+ * @param  len: length of `path`
+ * @param  name: valid NULL-terminated name
+ * @param  type: DIRENT_FILE or DIRENT_DIR
+ * @param  first: set to the first block of the entry
+ * @retval -1 if there is no such entry of type `type`, if the file is open,
+ * 			or if a block cannot be read or written. 0 otherwise.
+ */
+static int remove_subdir_entry(struct fs *fs, const char *path, size_t len,
+							   const char *name, uint8_t type,
+							   uint32_t *first)
+{
+	PathCacheNode *dir = resolve_dir(fs, path, len);
+	DirectoryTableNode entry;
+	uint32_t block, slot;
+	if (dir == NULL ||
+		dir_lookup(fs, dir, name, &entry, &block, &slot) != 1 ||
+		entry.type != type)
+	{
+		print_out("no entry found.\n");
+		return -1;
+	}
+	if (find_sub_node(fs, block, slot) >= 0)
+	{
+		print_out("cannot delete. file currently open.\n");
+		return -1;
+	}
+	*first = entry.first_data_block_index;
+
+	// the bucket is still in `dir_buf`
+	memset((DirectoryEntryV2 *)fs->dir_buf + slot, 0, sizeof(DirectoryEntryV2));
+	return dir_write(fs, block, fs->dir_buf);
+}
+/**
+ * @brief  delete_entry deletes the file, or the empty directory, at `path`,
+ * 			and frees its blocks.
+ * @param  path: path of the entry
+ * @param  type: DIRENT_FILE or DIRENT_DIR
+ * @retval -1 if the entry cannot be deleted. 0 otherwise.
+ */
+static int delete_entry(struct fs *fs, const char *path, uint8_t type)
+{
+	if (fs == NULL)
+	{
+		print_out("no virtual disk was open.\n");
+		return -1;
+	}
+	const char *rel, *name;
+	size_t dir_len;
+	if (parse_path(fs, path, &rel, &dir_len, &name))
+	{
+		print_out("invalid filename.\n");
+		return -1;
+	}
 
-int fs_ls(void)
+	pthread_mutex_lock(&fs->dir_lock);
+	// build the free-space bitmap first, so that the blocks can be freed
+	// once the entry is gone
+	if (lock_alloc(fs))
+	{
+		pthread_mutex_unlock(&fs->dir_lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	int ret = rel != name && dir_room(fs, 1);
+	if (ret == 0 && type == DIRENT_DIR)
+	{
+		PathCacheNode *dir = resolve_dir(fs, rel, strlen(rel));
+		if (dir == NULL)
+		{
+			ret = -1;
+		}
+		else if (dir_is_empty(fs, dir) != 1)
+		{
+			print_out("cannot delete. directory not empty.\n");
+			ret = -1;
+		}
+	}
+	uint32_t first = FAT_EOC;
+	if (ret == 0)
+	{
+		ret = rel == name
+				  ? remove_root_entry(fs, name, type, &first)
+				  : remove_subdir_entry(fs, rel, dir_len, name, type, &first);
+	}
+
+	// * remove all data blocks from the FAT
+	FreedRuns freed = {NULL, 0, 0};
+	if (ret == 0)
+	{
+		PathCacheNode *dir;
+		if (type == DIRENT_DIR &&
+			(dir = path_cache_find(fs, rel, strlen(rel))) != NULL)
+		{
+			path_cache_remove(fs, dir - fs->path_cache);
+		}
+		pthread_mutex_lock(&fs->alloc_lock);
+		if (type == DIRENT_DIR && fs->journal != NULL)
+		{ // the journal may still hold copies of the blocks, see `held_runs`
+			for (uint32_t block = first;
+				 fs->dir_blocks != NULL && block != FAT_EOC;
+				 block = fat_get(fs, block))
+			{
+				dir_block_drop(fs, block);
+			}
+			free_chain(fs, first, &fs->held_runs);
+		}
+		else
+		{ // with a journal, the holes wait for the commit, see `pending_runs`
+			free_chain(fs, first,
+					   fs->journal != NULL ? &fs->pending_runs : &freed);
+		}
+		pthread_mutex_unlock(&fs->alloc_lock);
+	}
+	pthread_mutex_unlock(&fs->dir_lock);
+	discard_runs(fs, &freed);
+
+	return ret ? -1 : commit_wait(fs);
+}
+
+int fs_delete_ex(struct fs *fs, const char *filename)
 {
-	if (block_disk_count() < 0)
+	uint64_t start = op_start(FS_OP_DELETE);
+	int ret = delete_entry(fs, filename, DIRENT_FILE);
+	op_end(fs, FS_OP_DELETE, start, ret, 0);
+	return ret;
+}
+
+int fs_rmdir_ex(struct fs *fs, const char *path)
+{
+	uint64_t start = op_start(FS_OP_RMDIR);
+	int ret = delete_entry(fs, path, DIRENT_DIR);
+	op_end(fs, FS_OP_RMDIR, start, ret, 0);
+	return ret;
+}
+
+static int list_files(struct fs *fs)
+{
+	if (fs == NULL)
 	{
 		print_out("no virtual disk was open.\n");
 		return -1;
 	}
 	fprintf(stdout, "FS Ls:\n");
+	pthread_mutex_lock(&fs->dir_lock);
 	for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++)
 	{
-		if (RootDirectory[i].filename[0] != '\0')
+		if (fs->RootDirectory[i].filename[0] != '\0')
 		{
-			fprintf(stdout, "file: %s, size: %d, data_blk: %d\n",
-					RootDirectory[i].filename,
-					RootDirectory[i].file_size,
-					RootDirectory[i].first_data_block_index);
+			pthread_rwlock_rdlock(&fs->file_locks[i]);
+			// empty files show the end-of-chain value of the disk format
+			uint32_t first = fs->RootDirectory[i].first_data_block_index;
+			if (first == FAT_EOC)
+			{
+				first = fs->fat32 ? FAT32_EOC : FAT16_EOC;
+			}
+			fprintf(stdout, "%s: %s, size: %zu, data_blk: %u\n",
+					fs->RootDirectory[i].type == DIRENT_DIR ? "dir" : "file",
+					fs->RootDirectory[i].filename,
+					fs->RootDirectory[i].file_size, first);
+			pthread_rwlock_unlock(&fs->file_locks[i]);
 		}
 	}
+	pthread_mutex_unlock(&fs->dir_lock);
 	return 0;
 }
 
-int fs_open(const char *filename)
+int fs_ls_ex(struct fs *fs)
+{
+	uint64_t start = op_start(FS_OP_LS);
+	int ret = list_files(fs);
+	op_end(fs, FS_OP_LS, start, ret, 0);
+	return ret;
+}
+
+/**
+ * @brief  add_dirent appends `entry` to the entries collected by
+ * 			`read_dir()`, growing the array if needed.
+ * @retval -1 if memory cannot be allocated. 0 otherwise.
+ */
+static int add_dirent(struct fs_dirent **ents, size_t *len, size_t *cap,
+					  const DirectoryTableNode *entry)
 {
-	if (total_files_open == FS_OPEN_MAX_COUNT)
+	if (*len == *cap)
 	{
-		print_out("Open file table full.\n");
+		size_t new_cap = *cap ? 2 * *cap : 64;
+		struct fs_dirent *new_ents = (struct fs_dirent *)realloc(
+			*ents, new_cap * sizeof(struct fs_dirent));
+		if (new_ents == MALLOC_FAIL)
+		{
+			print_out("unable to allocate memory for the entries.\n");
+			return -1;
+		}
+		*ents = new_ents;
+		*cap = new_cap;
+	}
+	struct fs_dirent *ent = &(*ents)[(*len)++];
+	memcpy(ent->name, entry->filename, FS_FILENAME_LEN);
+	ent->name[FS_FILENAME_LEN - 1] = '\0';
+	ent->size = entry->file_size;
+	ent->is_dir = entry->type == DIRENT_DIR;
+	return 0;
+}
+
+static int read_dir(struct fs *fs, const char *path, fs_readdir_fn fn,
+					void *arg)
+{
+	if (fs == NULL)
+	{
+		print_out("no virtual disk was open.\n");
+		return -1;
+	}
+	const char *rel, *name;
+	size_t dir_len;
+	int root = path != NULL && (!strcmp(path, "") || !strcmp(path, "/"));
+	if (fn == NULL || (!root && parse_path(fs, path, &rel, &dir_len, &name)))
+	{
+		print_out("invalid path.\n");
 		return -1;
 	}
 
-	int filename_len = strlen(filename);
-	if (filename_len < 1 || filename_len > FS_FILENAME_LEN)
+	// entries are collected under the lock, and handed out without it
+	struct fs_dirent *ents = NULL;
+	size_t len = 0, cap = 0;
+	int ret = 0;
+	pthread_mutex_lock(&fs->dir_lock);
+	if (root)
+	{
+		for (size_t i = 0; ret == 0 && i < FS_FILE_MAX_COUNT; i++)
+		{
+			if (fs->RootDirectory[i].filename[0] != '\0')
+			{
+				pthread_rwlock_rdlock(&fs->file_locks[i]);
+				ret = add_dirent(&ents, &len, &cap, &fs->RootDirectory[i]);
+				pthread_rwlock_unlock(&fs->file_locks[i]);
+			}
+		}
+	}
+	else
+	{
+		// files open in the directory can be newer in memory
+		PathCacheNode *dir = NULL;
+		if (flush_sub_entries(fs) ||
+			(dir = resolve_dir(fs, rel, strlen(rel))) == NULL)
+		{
+			ret = -1;
+		}
+		size_t per_block = fs->block_size / sizeof(DirectoryEntryV2);
+		for (size_t i = 0; ret == 0 && i < dir->nr_buckets; i++)
+		{
+			if (dir_read(fs, dir->blk_map[i], fs->dir_buf))
+			{
+				ret = -1;
+				break;
+			}
+			for (size_t j = 0; ret == 0 && j < per_block; j++)
+			{
+				DirectoryTableNode entry;
+				if (dir_slot_valid((const DirectoryEntryV2 *)fs->dir_buf + j,
+								   i, dir->nr_buckets))
+				{
+					load_dir_entry(fs, &entry, fs->dir_buf, j);
+					ret = add_dirent(&ents, &len, &cap, &entry);
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&fs->dir_lock);
+
+	for (size_t i = 0; ret == 0 && i < len; i++)
+	{
+		if (fn(&ents[i], arg))
+		{
+			break;
+		}
+	}
+	free(ents);
+	return ret;
+}
+
+int fs_readdir_ex(struct fs *fs, const char *path, fs_readdir_fn fn,
+				  void *arg)
+{
+	uint64_t start = op_start(FS_OP_READDIR);
+	int ret = read_dir(fs, path, fn, arg);
+	op_end(fs, FS_OP_READDIR, start, ret, 0);
+	return ret;
+}
+
+/**
+ * @brief  open_subdir_file finds the file named `name` in the subdirectory
+ * 			at `path`, and loads its entry in memory unless the file is open
+ * 			already.
+ * @note   the caller holds `dir_lock` and makes sure fewer than
+ * 			FS_OPEN_MAX_COUNT files are open, so that an entry is free.
+ * @param  path: path of the subdirectory, not NULL-terminated
+ * @param  len: length of `path`
+ * @param  name: valid NULL-terminated name
+ * @retval -1 if there is no such file. Otherwise, index of the entry of the
+ * 			file in `RootDirectory`.
+ */
+static int open_subdir_file(struct fs *fs, const char *path, size_t len,
+							const char *name)
+{
+	PathCacheNode *dir = resolve_dir(fs, path, len);
+	DirectoryTableNode entry;
+	uint32_t block, slot;
+	if (dir == NULL ||
+		dir_lookup(fs, dir, name, &entry, &block, &slot) != 1 ||
+		entry.type != DIRENT_FILE)
+	{
+		return -1;
+	}
+	int node = find_sub_node(fs, block, slot);
+	if (node >= 0)
+	{
+		return node;
+	}
+	for (node = FS_FILE_MAX_COUNT; fs->open_count[node] > 0; node++)
+		;
+	fs->RootDirectory[node] = entry;
+	fs->sub_locs[node - FS_FILE_MAX_COUNT].block = block;
+	fs->sub_locs[node - FS_FILE_MAX_COUNT].slot = slot;
+	fs->sub_locs[node - FS_FILE_MAX_COUNT].dirty = 0;
+	return node;
+}
+
+static int open_file(struct fs *fs, const char *filename)
+{
+	if (fs == NULL)
+	{
+		print_out("no virtual disk was open.\n");
+		return -1;
+	}
+	const char *rel, *name;
+	size_t dir_len;
+	if (parse_path(fs, filename, &rel, &dir_len, &name))
+	{
+		print_out("invalid filename.\n");
+		return -1;
+	}
+	char *block_buf = malloc(fs->block_size);
+	if (block_buf == MALLOC_FAIL)
+	{
+		print_out("unable to allocate memory for the file.\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&fs->dir_lock);
+	// the entry of a file of a subdirectory is written back at close
+	if (rel != name && dir_room(fs, 0))
 	{
-		print_out("invalid filename.\n");
+		pthread_mutex_unlock(&fs->dir_lock);
+		free(block_buf);
 		return -1;
 	}
-
-	int index_of_entry = -1;
-	for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++)
+	if (fs->total_files_open == FS_OPEN_MAX_COUNT)
 	{
-		if (!strcmp((char *)RootDirectory[i].filename, filename))
-		{
-			index_of_entry = i;
-			break;
-		}
+		pthread_mutex_unlock(&fs->dir_lock);
+		free(block_buf);
+		print_out("Open file table full.\n");
+		return -1;
 	}
-	if (index_of_entry < 0)
+
+	int index_of_entry = rel == name
+							 ? find_dir_entry(fs, name)
+							 : open_subdir_file(fs, rel, dir_len, name);
+	if (index_of_entry < 0 ||
+		fs->RootDirectory[index_of_entry].type != DIRENT_FILE)
 	{
+		pthread_mutex_unlock(&fs->dir_lock);
+		free(block_buf);
 		print_out("no entry found.\n");
 		return -1;
 	}
@@ -572,283 +4748,712 @@ int fs_open(const char *filename)
 	// find the first free entry from OFT and get its index
 	for (size_t i = 0; i < FS_OPEN_MAX_COUNT; i++)
 	{
-		if (OFT[i].metadata == NULL)
+		if (fs->OFT[i].metadata == NULL)
 		{
 			fd_index = i;
 			break;
 		}
 	}
 
-	OFT[fd_index].metadata = &RootDirectory[index_of_entry];
-	OFT[fd_index].offset = 0;
-	OFT[fd_index].blks_traversed = 0;
-	OFT[fd_index].seeked_block = OFT[fd_index].metadata->first_data_block_index;
-	total_files_open++;
+	fs->OFT[fd_index].offset = 0;
+	fs->OFT[fd_index].blk_map = NULL;
+	fs->OFT[fd_index].blk_map_len = 0;
+	fs->OFT[fd_index].blk_map_cap = 0;
+	fs->OFT[fd_index].blk_map_gen = fs->chain_gen[index_of_entry];
+	fs->OFT[fd_index].resv_len = 0;
+	fs->OFT[fd_index].ra_next = 0;
+	fs->OFT[fd_index].ra_window = 0;
+	fs->OFT[fd_index].ra_end = 0;
+	fs->OFT[fd_index].block_buf = block_buf;
+	fs->OFT[fd_index].metadata = &fs->RootDirectory[index_of_entry];
+	fs->open_count[index_of_entry]++;
+	fs->total_files_open++;
+	pthread_mutex_unlock(&fs->dir_lock);
 
 	return fd_index;
 }
 
-int fs_close(int fd)
+int fs_open_ex(struct fs *fs, const char *filename)
+{
+	uint64_t start = op_start(FS_OP_OPEN);
+	int ret = open_file(fs, filename);
+	op_end(fs, FS_OP_OPEN, start, ret, 0);
+	return ret;
+}
+
+static int close_file(struct fs *fs, int fd)
 {
-	if (total_files_open < 0)
+	if (lock_fd(fs, fd))
 	{
-		print_out("Open file table already empty.\n");
 		return -1;
 	}
-	if (fd < 0 || fd > FS_OPEN_MAX_COUNT)
+	if (fs->total_files_open < 0)
 	{
-		print_out("invalid file descriptor.\n");
+		pthread_mutex_unlock(&fs->fd_locks[fd]);
+		print_out("Open file table already empty.\n");
 		return -1;
 	}
-	if (OFT[fd].metadata == NULL)
+	pthread_mutex_lock(&fs->dir_lock);
+	int node = fs->OFT[fd].metadata - fs->RootDirectory;
+	// the entry of a file of a subdirectory goes back to its block. If it
+	// cannot, the file stays open, so that a sync or another close retries
+	if (node >= FS_FILE_MAX_COUNT && fs->open_count[node] == 1 &&
+		fs->sub_locs[node - FS_FILE_MAX_COUNT].dirty &&
+		(dir_room(fs, 1) || write_sub_entry(fs, node)))
 	{
-		print_out("metadata not found.\n");
+		pthread_mutex_unlock(&fs->dir_lock);
+		pthread_mutex_unlock(&fs->fd_locks[fd]);
 		return -1;
 	}
-	OFT[fd].metadata = NULL;
-	OFT[fd].offset = 0;
-	OFT[fd].blks_traversed = 0;
-	OFT[fd].seeked_block = 0;
-	total_files_open--;
+	pthread_mutex_lock(&fs->alloc_lock);
+	release_blocks(fs, fd);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	fs->OFT[fd].offset = 0;
+	free(fs->OFT[fd].blk_map);
+	fs->OFT[fd].blk_map = NULL;
+	fs->OFT[fd].blk_map_len = 0;
+	fs->OFT[fd].blk_map_cap = 0;
+	free(fs->OFT[fd].block_buf);
+	fs->OFT[fd].block_buf = NULL;
+	fs->open_count[node]--;
+	fs->OFT[fd].metadata = NULL;
+	fs->total_files_open--;
+	pthread_mutex_unlock(&fs->dir_lock);
+	pthread_mutex_unlock(&fs->fd_locks[fd]);
 	return 0;
 }
 
-int fs_stat(int fd)
+int fs_close_ex(struct fs *fs, int fd)
+{
+	uint64_t start = op_start(FS_OP_CLOSE);
+	int ret = close_file(fs, fd);
+	op_end(fs, FS_OP_CLOSE, start, ret, 0);
+	return ret;
+}
+
+static int stat_file(struct fs *fs, int fd)
 {
-	if (fd < 0 || fd > FS_OPEN_MAX_COUNT)
+	if (lock_fd(fs, fd))
 	{
-		print_out("invalid file descriptor.\n");
 		return -1;
 	}
-	if (OFT[fd].metadata == NULL)
+	pthread_rwlock_rdlock(file_lock(fs, fd));
+	size_t file_size = fs->OFT[fd].metadata->file_size;
+	pthread_rwlock_unlock(file_lock(fs, fd));
+	pthread_mutex_unlock(&fs->fd_locks[fd]);
+	if (file_size > INT_MAX)
 	{
-		print_out("metadata not found.\n");
+		print_out("file size does not fit in the return value.\n");
 		return -1;
 	}
-	return OFT[fd].metadata->file_size;
+	return file_size;
 }
 
-int fs_lseek(int fd, size_t offset)
+int fs_stat_ex(struct fs *fs, int fd)
 {
-	if (fd < 0 || fd > FS_OPEN_MAX_COUNT)
-	{
-		print_out("invalid file descriptor.\n");
-		return -1;
-	}
-	if (OFT[fd].metadata == NULL)
+	uint64_t start = op_start(FS_OP_STAT);
+	int ret = stat_file(fs, fd);
+	op_end(fs, FS_OP_STAT, start, ret, 0);
+	return ret;
+}
+
+static int seek_file(struct fs *fs, int fd, size_t offset)
+{
+	if (lock_fd(fs, fd))
 	{
-		print_out("metadata not found.\n");
 		return -1;
 	}
-	if (seek_blocks(fd, offset) < 0)
+	pthread_rwlock_rdlock(file_lock(fs, fd));
+	size_t file_size = fs->OFT[fd].metadata->file_size;
+	pthread_rwlock_unlock(file_lock(fs, fd));
+	if (offset > file_size)
 	{
+		pthread_mutex_unlock(&fs->fd_locks[fd]);
 		print_out("invalid seek offset.\n");
 		return -1;
 	}
 
-	OFT[fd].offset = offset;
+	fs->OFT[fd].offset = offset;
+	pthread_mutex_unlock(&fs->fd_locks[fd]);
 	return 0;
 }
 
-int fs_write(int fd, void *buf, size_t count)
+int fs_lseek_ex(struct fs *fs, int fd, size_t offset)
+{
+	uint64_t start = op_start(FS_OP_LSEEK);
+	int ret = seek_file(fs, fd, offset);
+	op_end(fs, FS_OP_LSEEK, start, ret, 0);
+	return ret;
+}
+
+/**
+ * @brief  write_blocks writes `count` bytes of `usr_buf` to the file opened as
+ * 			`fd`, at its offset, extending the file block by block when
+ * 			needed. The file is locked for writing.
+ * @note   `bs` is the block size of the file system. `write_file()` inlines
+ * 			this twice, once with the constant BLOCK_SIZE, so that the
+ * 			common case computes block offsets with masks and shifts.
+ * @param  meta_changed: set to 1 if the FAT changed
+ * @retval number of bytes written, short if a block cannot be allocated or
+ * 			written.
+ */
+static inline __attribute__((always_inline)) size_t
+write_blocks(struct fs *fs, int fd, const char *usr_buf, size_t count,
+			 int *meta_changed, const size_t bs)
+{
+	// count of how many bytes actually written so far
+	size_t bytes_written = 0;
+
+	// holds the 'block' to write in this buffer
+	char *block_buf = fs->OFT[fd].block_buf;
+
+	// full blocks waiting to be written with a single vectored call, and the
+	// value of bytes_written when the first of them was queued
+	size_t batch_blocks[IO_BATCH];
+	const void *batch_bufs[IO_BATCH];
+	size_t batch_len = 0;
+	size_t batch_start = 0;
+
+	// logic for writing to the data blocks
+	while (bytes_written < count)
+	{
+		// position in the file, and the block that holds it
+		size_t pos = fs->OFT[fd].offset + bytes_written;
+		size_t offset = pos % bs;
+		// flag set if the block was just allocated by this call, or lies
+		// past the end of the file (allocated by `fs_fallocate()`). its old
+		// content is garbage, so it never has to be read back from disk
+		int new_block = pos - offset >= fs->OFT[fd].metadata->file_size;
+		int block_index = get_file_block(fs, fd, pos / bs);
+		if (block_index == FAT_EOC)
+		{
+			// EOF is reached and writing has not completed, then extend file
+			// by adding an entry in the FAT
+			block_index = extend_file(fs, fd);
+			new_block = 1;
+			*meta_changed = 1;
+		}
+		if (block_index < 0)
+		{
+			print_out("no free blocks available in the FAT.\n");
+			break;
+		}
+
+		// bytes of the user buffer that land in the current block
+		size_t chunk = count - bytes_written;
+		if (chunk > bs - offset)
+		{
+			chunk = bs - offset;
+		}
+
+		if (chunk == bs)
+		{
+			// the whole block is replaced: queue it to be written straight
+			// from the user buffer, its old content does not matter
+			if (batch_len == 0)
+			{
+				batch_start = bytes_written;
+			}
+			batch_blocks[batch_len] =
+				fs->superblock.data_block_start_index + block_index;
+			batch_bufs[batch_len] = usr_buf + bytes_written;
+			batch_len++;
+			if (batch_len == IO_BATCH)
+			{
+				if (cache_writev(fs->cache, batch_blocks, batch_bufs,
+								 batch_len) < 0)
+				{
+					print_out("unable to write to new blocks.\n");
+					bytes_written = batch_start;
+					batch_len = 0;
+					break;
+				}
+				batch_len = 0;
+			}
+		}
+		else
+		{
+			// partial block. keep the old data around it, unless the block
+			// has no old data worth keeping
+			if (new_block)
+			{
+				memset(block_buf, 0, bs);
+			}
+			else if (cache_read(fs->cache,
+								fs->superblock.data_block_start_index +
+									block_index,
+								block_buf) < 0)
+			{
+				print_out("read from old block failed.\n");
+				break;
+			}
+
+			memcpy(block_buf + offset, usr_buf + bytes_written, chunk);
+
+			// a partial block only comes last, after the queued blocks
+			if (batch_len > 0 &&
+				cache_writev(fs->cache, batch_blocks, batch_bufs, batch_len) < 0)
+			{
+				print_out("unable to write to new blocks.\n");
+				bytes_written = batch_start;
+				batch_len = 0;
+				break;
+			}
+			batch_len = 0;
+
+			if (cache_write(fs->cache,
+							fs->superblock.data_block_start_index + block_index,
+							block_buf) < 0)
+			{
+				print_out("unable to write to new block.\n");
+				break;
+			}
+		}
+
+		// update the total number of bytes written
+		bytes_written += chunk;
+	}
+	if (batch_len > 0 &&
+		cache_writev(fs->cache, batch_blocks, batch_bufs, batch_len) < 0)
+	{
+		print_out("unable to write to new blocks.\n");
+		bytes_written = batch_start;
+	}
+	return bytes_written;
+}
+
+static int write_file(struct fs *fs, int fd, void *buf, size_t count)
 {
 	/* TODO: Phase 4 */
-	if (fd < 0 || fd > FS_OPEN_MAX_COUNT)
+	if (lock_fd(fs, fd))
 	{
-		print_out("invalid file descriptor.\n");
 		return -1;
 	}
-	if (OFT[fd].metadata == NULL)
+	if (count == 0)
 	{
-		print_out("metadata not found.\n");
-		return -1;
+		pthread_mutex_unlock(&fs->fd_locks[fd]);
+		return 0;
 	}
+	// writers of the file hold its lock alone
+	pthread_rwlock_wrlock(file_lock(fs, fd));
 
-	// flag for updating file size
-	int update_file_size = 0;
+	// set if the FAT or the root directory changed
+	int meta_changed = 0;
 
-	// get starting block id based on the offset
-	int start_blk_index = OFT[fd].seeked_block;
-	// if file is empty, then create a new entry in the FAT.
-	if (start_blk_index == FAT_EOC)
+	// the file may have been truncated below the offset through another file
+	// descriptor: the gap reads as zeros
+	if (fs->OFT[fd].offset > fs->OFT[fd].metadata->file_size)
 	{
-		start_blk_index = add_fat_entry(start_blk_index);
-		if (start_blk_index < 0)
+		if (grow_file(fs, fd, fs->OFT[fd].offset))
 		{
-			print_out("no free blocks available in the FAT.\n");
+			pthread_rwlock_unlock(file_lock(fs, fd));
+			pthread_mutex_unlock(&fs->fd_locks[fd]);
 			return -1;
 		}
-		OFT[fd].metadata->first_data_block_index = start_blk_index;
-		update_file_size = 1;
+		meta_changed = 1;
 	}
 
-	// get the offset of the block to read from
-	int offset = OFT[fd].offset - (BLOCK_SIZE * OFT[fd].blks_traversed);
-	if (offset < 0)
+	size_t bytes_written =
+		fs->block_size == BLOCK_SIZE
+			? write_blocks(fs, fd, buf, count, &meta_changed, BLOCK_SIZE)
+			: write_blocks(fs, fd, buf, count, &meta_changed, fs->block_size);
+
+	// grow the file if the write went past its end
+	if (fs->OFT[fd].offset + bytes_written > fs->OFT[fd].metadata->file_size)
+	{
+		fs->OFT[fd].metadata->file_size = fs->OFT[fd].offset + bytes_written;
+		mark_entry_dirty(fs, fs->OFT[fd].metadata);
+		meta_changed = 1;
+	}
+	fs->OFT[fd].offset += bytes_written;
+	pthread_rwlock_unlock(file_lock(fs, fd));
+	pthread_mutex_unlock(&fs->fd_locks[fd]);
+	if (meta_changed && commit_wait(fs))
 	{
-		print_out("invalid offset: offset less than 1.\n");
 		return -1;
 	}
+	balance_dirty(fs);
+	return bytes_written;
+}
 
-	// the remaining bytes to write to the new block
-	// this variable holds remaining bytes to write in the current block, not
-	// overall bytes to write
-	int rem_bytes_to_write = BLOCK_SIZE - offset;
-	// count of how many bytes actually read so far
-	int bytes_written = 0;
-	// flag to end the writing
-	int writing_complete = 0;
-	// stores the next block index
-	int block_index = start_blk_index;
-	// stores the current block index
-	int block_index_curr = start_blk_index;
+int fs_write_ex(struct fs *fs, int fd, void *buf, size_t count)
+{
+	uint64_t start = op_start(FS_OP_WRITE);
+	int ret = write_file(fs, fd, buf, count);
+	op_end(fs, FS_OP_WRITE, start, ret, ret > 0 ? ret : 0);
+	return ret;
+}
 
-	// holds the 'block' to write in this buffer
-	char block_buf[BLOCK_SIZE];
+static int reserve_file(struct fs *fs, int fd, size_t size)
+{
+	if (lock_fd(fs, fd))
+	{
+		return -1;
+	}
+	pthread_rwlock_wrlock(file_lock(fs, fd));
+	int ret = -1;
 
-	char *usr_buf = (char *)buf;
+	// give the old reservation back first, it may be part of the new run
+	pthread_mutex_lock(&fs->alloc_lock);
+	release_blocks(fs, fd);
+	pthread_mutex_unlock(&fs->alloc_lock);
 
-	// logic for writing to from the data blocks
-	while (!writing_complete)
+	int last_block = get_file_block(fs, fd, SIZE_MAX - 1);
+	if (last_block < 0)
 	{
-		// read from the block buffer first. this is necessary since we need to
-		// keep the old data in the buffer if reading from a different offset
-		if (block_read(superblock.data_block_start_index + block_index,
-					   block_buf) < 0)
-		{
-			print_out("read from old block failed.\n");
-			return bytes_written;
-		}
+		print_out("unable to resolve the blocks of the file.\n");
+		goto out;
+	}
+	last_block = fs->OFT[fd].blk_map_len == 0
+					 ? FAT_EOC
+					 : fs->OFT[fd].blk_map[fs->OFT[fd].blk_map_len - 1];
 
-		// store in usr_buf char by char until bytes_read is equal to the count
-		size_t i;
-		for (i = 0; i < rem_bytes_to_write; i++)
-		{
-			if (bytes_written + i >= count)
-			{
-				writing_complete = 1;
-				break;
-			}
-			block_buf[offset + i] = usr_buf[bytes_written + i];
-			if (update_file_size == 1)
-			{ // if new block allocated, then update filesize
-				OFT[fd].metadata->file_size++;
-			}
-		}
+	// blocks needed on top of the ones the file already has
+	size_t new_size = fs->OFT[fd].metadata->file_size + size;
+	size_t needed = (new_size + fs->block_size - 1) / fs->block_size;
+	needed = needed > fs->OFT[fd].blk_map_len ? needed - fs->OFT[fd].blk_map_len : 0;
+	if (needed == 0)
+	{
+		ret = size;
+		goto out;
+	}
 
-		// read from the block and store it in `block_buf`
-		if (block_write(superblock.data_block_start_index + block_index,
-						block_buf) < 0)
-		{
-			print_out("unable to write to new block.\n");
-			return bytes_written;
-		}
+	if (lock_alloc(fs))
+	{
+		goto out;
+	}
+	if (needed > fs->free_blocks)
+	{
+		pthread_mutex_unlock(&fs->alloc_lock);
+		print_out("not enough free blocks.\n");
+		goto out;
+	}
+	size_t run_len;
+	size_t goal = last_block == FAT_EOC ? 0 : last_block + 1;
+	size_t start = find_free_run(fs, goal, needed, &run_len);
+	reserve_blocks(fs, fd, start, run_len);
+	pthread_mutex_unlock(&fs->alloc_lock);
 
-		// reset remaining bytes to write to after the first write
-		rem_bytes_to_write = BLOCK_SIZE;
-		//reset offset to 0 after first write
-		offset = 0;
-		// update the total number of bytes written
-		bytes_written += i;
-		// store the current block index
-		block_index_curr = block_index;
-		// goto the next block index
-		block_index = FAT[block_index];
+	ret = run_len < needed ? run_len * fs->block_size : size;
+out:
+	pthread_rwlock_unlock(file_lock(fs, fd));
+	pthread_mutex_unlock(&fs->fd_locks[fd]);
+	return ret;
+}
 
-		// if EOF is reached and writing has not completed, then extend file by
-		// adding an entry in in the FAT
-		if (block_index == FAT_EOC && !writing_complete)
-		{
-			// update block index to the new block index
-			int new_fat_entry = add_fat_entry(block_index_curr);
-			if (new_fat_entry < 0)
-			{
-				print_out("no free blocks available in the FAT.\n");
-				return bytes_written;
-			}
-			block_index = new_fat_entry;
-			// set update file size
-			update_file_size = 1;
-		}
-	}
-	return bytes_written;
+int fs_reserve_ex(struct fs *fs, int fd, size_t size)
+{
+	uint64_t start = op_start(FS_OP_RESERVE);
+	int ret = reserve_file(fs, fd, size);
+	op_end(fs, FS_OP_RESERVE, start, ret, 0);
+	return ret;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+static int truncate_file(struct fs *fs, int fd, size_t size)
 {
-	if (fd < 0 || fd > FS_OPEN_MAX_COUNT)
+	if (lock_fd(fs, fd))
 	{
-		print_out("invalid file descriptor.\n");
 		return -1;
 	}
-	if (OFT[fd].metadata == NULL)
+	pthread_rwlock_wrlock(file_lock(fs, fd));
+	int ret = size > fs->OFT[fd].metadata->file_size
+				  ? grow_file(fs, fd, size)
+				  : shrink_file(fs, fd, size);
+	pthread_rwlock_unlock(file_lock(fs, fd));
+	pthread_mutex_unlock(&fs->fd_locks[fd]);
+	if (ret == 0 && commit_wait(fs))
 	{
-		print_out("metadata not found.\n");
 		return -1;
 	}
-	// get starting block id based on the offset
-	int start_blk_index = OFT[fd].seeked_block;
+	return ret;
+}
+
+int fs_truncate_ex(struct fs *fs, int fd, size_t size)
+{
+	uint64_t start = op_start(FS_OP_TRUNCATE);
+	int ret = truncate_file(fs, fd, size);
+	op_end(fs, FS_OP_TRUNCATE, start, ret, 0);
+	return ret;
+}
 
-	// get the offset of the block to read from
-	int offset = OFT[fd].offset - (BLOCK_SIZE * OFT[fd].blks_traversed);
-	if (offset < 0)
+static int fallocate_file(struct fs *fs, int fd, size_t size)
+{
+	if (lock_fd(fs, fd))
+	{
+		return -1;
+	}
+	pthread_rwlock_wrlock(file_lock(fs, fd));
+	int ret = alloc_file_blocks(fs, fd,
+								(size + fs->block_size - 1) / fs->block_size);
+	pthread_rwlock_unlock(file_lock(fs, fd));
+	pthread_mutex_unlock(&fs->fd_locks[fd]);
+	if (ret == 1 && commit_wait(fs))
 	{
-		print_out("invalid offset: offset less than 1.\n");
 		return -1;
 	}
+	return ret < 0 ? -1 : 0;
+}
+
+int fs_fallocate_ex(struct fs *fs, int fd, size_t size)
+{
+	uint64_t start = op_start(FS_OP_FALLOCATE);
+	int ret = fallocate_file(fs, fd, size);
+	op_end(fs, FS_OP_FALLOCATE, start, ret, 0);
+	return ret;
+}
 
-	// the remaining bytes to read from the new block
-	// this variable holds remaining bytes read for the current block, not
-	// overall bytes to read
-	int rem_bytes_to_read = BLOCK_SIZE - offset;
+/**
+ * @brief  read_blocks reads `count` bytes of the file opened as `fd`, from its
+ * 			offset, into `usr_buf`. The file is locked for reading and has
+ * 			`count` bytes left.
+ * @note   `bs` is the block size of the file system, inlined twice by
+ * 			`read_file()` like `write_blocks()`.
+ * @retval number of bytes read, short if a block cannot be read.
+ */
+static inline __attribute__((always_inline)) size_t
+read_blocks(struct fs *fs, int fd, char *usr_buf, size_t count,
+			const size_t bs)
+{
 	// count of how many bytes actually read so far
-	int bytes_read = 0;
-	// flag to end the reading
-	int reading_complete = 0;
-	int block_index = start_blk_index;
+	size_t bytes_read = 0;
 
-	// holds the 'block' read in this buffer
-	char block_buf[BLOCK_SIZE];
+	// holds a partially requested 'block'
+	char *block_buf = fs->OFT[fd].block_buf;
 
-	char *usr_buf = (char *)buf;
+	// full blocks waiting to be read with a single vectored call, and the
+	// value of bytes_read when the first of them was queued
+	size_t batch_blocks[IO_BATCH];
+	void *batch_bufs[IO_BATCH];
+	size_t batch_len = 0;
+	size_t batch_start = 0;
 
 	// logic for reading from the data blocks
-	while (!reading_complete)
+	while (bytes_read < count)
 	{
-		// read from the block and store it in `block_buf`
-		if (block_read(superblock.data_block_start_index + block_index,
-					   block_buf) < 0)
+		// position in the file, and the block that holds it
+		size_t pos = fs->OFT[fd].offset + bytes_read;
+		size_t offset = pos % bs;
+		int block_index = get_file_block(fs, fd, pos / bs);
+		if (block_index < 0 || block_index == FAT_EOC)
+		{
+			// if somehow EOF is reached, end any reading
+			print_out("block not found in the FAT.\n");
+			break;
+		}
+
+		// bytes of the current block that go to the user buffer
+		size_t chunk = count - bytes_read;
+		if (chunk > bs - offset)
 		{
-			print_out("block out of bounds, inaccessible.\n");
-			return bytes_read;
+			chunk = bs - offset;
 		}
 
-		// store in usr_buf char by char until bytes_read is equal to the count
-		size_t i;
-		for (i = 0; i < rem_bytes_to_read; i++)
+		if (chunk == bs)
+		{
+			// whole block requested: queue it to be read straight into the
+			// user buffer
+			if (batch_len == 0)
+			{
+				batch_start = bytes_read;
+			}
+			batch_blocks[batch_len] =
+				fs->superblock.data_block_start_index + block_index;
+			batch_bufs[batch_len] = usr_buf + bytes_read;
+			batch_len++;
+			if (batch_len == IO_BATCH)
+			{
+				if (cache_readv(fs->cache, batch_blocks, batch_bufs,
+								batch_len) < 0)
+				{
+					print_out("block out of bounds, inaccessible.\n");
+					bytes_read = batch_start;
+					batch_len = 0;
+					break;
+				}
+				batch_len = 0;
+			}
+		}
+		else
 		{
-			if (bytes_read + i >= count)
+			// a partial block only comes first or last
+			if (batch_len > 0 &&
+				cache_readv(fs->cache, batch_blocks, batch_bufs, batch_len) < 0)
+			{
+				print_out("block out of bounds, inaccessible.\n");
+				bytes_read = batch_start;
+				batch_len = 0;
+				break;
+			}
+			batch_len = 0;
+			if (cache_read(fs->cache,
+						   fs->superblock.data_block_start_index + block_index,
+						   block_buf) < 0)
 			{
-				reading_complete = 1;
+				print_out("block out of bounds, inaccessible.\n");
 				break;
 			}
-			usr_buf[bytes_read + i] = block_buf[offset + i];
+			memcpy(usr_buf + bytes_read, block_buf + offset, chunk);
 		}
 
-		// reset remaining bytes to read from after the first read
-		rem_bytes_to_read = BLOCK_SIZE;
-		//reset offset to 0 after first read
-		offset = 0;
 		// update the total number of bytes read
-		bytes_read += i;
-		// goto the next block to read from
-		block_index = FAT[block_index];
+		bytes_read += chunk;
+	}
+	if (batch_len > 0 &&
+		cache_readv(fs->cache, batch_blocks, batch_bufs, batch_len) < 0)
+	{
+		print_out("block out of bounds, inaccessible.\n");
+		bytes_read = batch_start;
+	}
+	return bytes_read;
+}
 
-		// if somehow EOF is reached, end any reading
-		if (block_index == FAT_EOC)
-		{
-			break;
-		}
+static int read_file(struct fs *fs, int fd, void *buf, size_t count)
+{
+	if (lock_fd(fs, fd))
+	{
+		return -1;
+	}
+	// concurrent readers of the file share its lock
+	pthread_rwlock_rdlock(file_lock(fs, fd));
+	// never read past the end of the file
+	size_t file_size = fs->OFT[fd].metadata->file_size;
+	if (fs->OFT[fd].offset >= file_size)
+	{
+		pthread_rwlock_unlock(file_lock(fs, fd));
+		pthread_mutex_unlock(&fs->fd_locks[fd]);
+		return 0;
+	}
+	if (count > file_size - fs->OFT[fd].offset)
+	{
+		count = file_size - fs->OFT[fd].offset;
 	}
+	if (count > 0)
+	{
+		// get the next blocks coming while these ones are read
+		readahead(fs, fd, fs->OFT[fd].offset / fs->block_size,
+				  (fs->OFT[fd].offset + count - 1) / fs->block_size);
+	}
+
+	size_t bytes_read = fs->block_size == BLOCK_SIZE
+							? read_blocks(fs, fd, buf, count, BLOCK_SIZE)
+							: read_blocks(fs, fd, buf, count, fs->block_size);
+	fs->OFT[fd].offset += bytes_read;
+	pthread_rwlock_unlock(file_lock(fs, fd));
+	pthread_mutex_unlock(&fs->fd_locks[fd]);
 	return bytes_read;
 }
+
+int fs_read_ex(struct fs *fs, int fd, void *buf, size_t count)
+{
+	uint64_t start = op_start(FS_OP_READ);
+	int ret = read_file(fs, fd, buf, count);
+	op_end(fs, FS_OP_READ, start, ret, ret > 0 ? ret : 0);
+	return ret;
+}
+
+//*************************************
+// * DEFAULT FILE SYSTEM
+//*************************************
+/*
+ * The functions below work on the file system mounted with `fs_mount()`.
+ */
+
+int fs_sync(void)
+{
+	return fs_sync_ex(default_fs);
+}
+
+int fs_sync_async(void)
+{
+	return fs_sync_async_ex(default_fs);
+}
+
+int fs_info(void)
+{
+	return fs_info_ex(default_fs);
+}
+
+int fs_journal_stats(struct fs_journal_stats *stats)
+{
+	return fs_journal_stats_ex(default_fs, stats);
+}
+
+int fs_stats(struct fs_stats *stats)
+{
+	return fs_stats_ex(default_fs, stats);
+}
+
+int fs_create(const char *filename)
+{
+	return fs_create_ex(default_fs, filename);
+}
+
+int fs_delete(const char *filename)
+{
+	return fs_delete_ex(default_fs, filename);
+}
+
+int fs_ls(void)
+{
+	return fs_ls_ex(default_fs);
+}
+
+int fs_open(const char *filename)
+{
+	return fs_open_ex(default_fs, filename);
+}
+
+int fs_mkdir(const char *path)
+{
+	return fs_mkdir_ex(default_fs, path);
+}
+
+int fs_rmdir(const char *path)
+{
+	return fs_rmdir_ex(default_fs, path);
+}
+
+int fs_readdir(const char *path, fs_readdir_fn fn, void *arg)
+{
+	return fs_readdir_ex(default_fs, path, fn, arg);
+}
+
+int fs_close(int fd)
+{
+	return fs_close_ex(default_fs, fd);
+}
+
+int fs_stat(int fd)
+{
+	return fs_stat_ex(default_fs, fd);
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	return fs_lseek_ex(default_fs, fd, offset);
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	return fs_write_ex(default_fs, fd, buf, count);
+}
+
+int fs_reserve(int fd, size_t size)
+{
+	return fs_reserve_ex(default_fs, fd, size);
+}
+
+int fs_truncate(int fd, size_t size)
+{
+	return fs_truncate_ex(default_fs, fd, size);
+}
+
+int fs_fallocate(int fd, size_t size)
+{
+	return fs_fallocate_ex(default_fs, fd, size);
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	return fs_read_ex(default_fs, fd, buf, count);
+}
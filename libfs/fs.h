@@ -2,6 +2,7 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdio.h> /* for FILE definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -9,9 +10,322 @@
 /** Maximum number of files in the root directory */
 #define FS_FILE_MAX_COUNT 128
 
+/** Maximum path length (including the NULL character) */
+#define FS_PATH_LEN 256
+
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Default number of blocks kept in the block cache */
+#define FS_CACHE_DEFAULT_BLOCKS 256
+
+/** Default number of blocks reserved when a file starts a new extent */
+#define FS_PREALLOC_DEFAULT_BLOCKS 8
+
+/** Default largest number of blocks read ahead of a sequential reader */
+#define FS_READAHEAD_DEFAULT_BLOCKS 32
+
+/**
+ * On-disk format versions. Version 1 has 16-bit FAT entries and block indexes,
+ * which limit it to 65535 blocks (256 MiB), and 32-bit file sizes. Version 2
+ * has 32-bit FAT entries and block indexes, and 64-bit file sizes.
+ */
+#define FS_VERSION_1 1
+#define FS_VERSION_2 2
+
+/** How the blocks of the virtual disk file are accessed */
+enum fs_backend {
+	/** System calls on the file (default) */
+	FS_BACKEND_SYSCALL,
+	/** Memory mapping of the whole file */
+	FS_BACKEND_MMAP,
+	/** Asynchronous io_uring queues, or system calls if unavailable */
+	FS_BACKEND_IO_URING,
+};
+
+/**
+ * struct fs_options - Mount options
+ * @cache_blocks: Number of blocks kept in the write-back block cache (0
+ * disables the cache)
+ * @prealloc_blocks: Number of contiguous blocks reserved for an open file when
+ * it grows into a new extent, so that files appended to concurrently don't get
+ * interleaved (0 or 1 disables preallocation)
+ * @readahead_blocks: Largest number of blocks read ahead of a file descriptor
+ * that reads sequentially (0 disables readahead). The window starts small,
+ * doubles while the reads stay sequential and halves when they turn random.
+ * Blocks are read ahead into the cache, in the background with
+ * %FS_BACKEND_IO_URING, so readahead needs the cache and is limited to half of
+ * it
+ * @backend: How the virtual disk file is accessed. %FS_BACKEND_MMAP avoids a
+ * system call per block, which suits mostly-read images. %FS_BACKEND_IO_URING
+ * keeps many block requests in flight for large reads and writes, which suits
+ * fast devices
+ * @flush_interval_ms: Period of the background flusher thread, which writes
+ * the changes to disk at least that often, in milliseconds (0 disables the
+ * flusher, changes then reach the disk at eviction, fs_sync() or fs_umount()
+ * time)
+ * @dirty_background_blocks: Number of dirty cached blocks from which writers
+ * wake up the flusher before its period is over (0 picks a quarter of the
+ * cache)
+ * @dirty_limit_blocks: Number of dirty cached blocks from which writers wait
+ * for the flusher to write them back, so that the amount of data that can be
+ * lost stays bounded (0 picks half of the cache)
+ * @journal_blocks: Size of the metadata journal to create if the file system
+ * doesn't have one yet, in blocks (0 doesn't create any). The journal is carved
+ * out of the free blocks. Once a file system has a journal, it is always used:
+ * metadata changes are committed to it before they are written in place, and
+ * it is replayed at mount time, so a crash never leaves the FAT and the
+ * directories inconsistent. A commit holds at most the FAT blocks, the root
+ * directory blocks and the blocks listing them, and the journal needs room for
+ * 6 such commits plus a header: 4 between two checkpoints, and 2 kept for the
+ * checkpoint. fs_mount_ex() fails if @journal_blocks is less than that, 25
+ * blocks for a version 1 disk of 4096 data blocks. On version 2 file systems,
+ * the blocks of the other directories that changed go in the same commits, up
+ * to 64 of them in each, or as many as 6 commits fit in the journal; a
+ * directory block changed by fs_create() and the like is kept in memory until
+ * then. With room for fewer than 34, one per open file and two for the call
+ * that changes the directory, directories other than the root cannot be used.
+ * A version 2 disk of 4096 data blocks of 4096 bytes needs 37 blocks, 241 for
+ * directories and 421 for 64 directory blocks per commit
+ * @durable_metadata: With a journal, make fs_create(), fs_delete(), fs_mkdir(),
+ * fs_rmdir() and the fs_write() calls that allocate blocks or grow the file
+ * return only once their metadata changes are committed. Concurrent calls
+ * share commits. Such a call returns -1 if its commit fails
+ * @discard: Punch holes in the virtual disk file where fs_delete(),
+ * fs_rmdir() and fs_truncate() free blocks, so that thinly provisioned storage
+ * can reclaim them. Adjacent freed blocks are punched together. With a
+ * journal, the holes are punched once the change that frees the blocks is
+ * committed, and the blocks are reused only then. Without one, the freed
+ * blocks are gone at once, even if that change doesn't reach the disk before a
+ * crash. Turned off if the host doesn't support it
+ * @lazy_fat: Map the FAT blocks of the virtual disk file in memory instead of
+ * reading them at mount time, so that mount time doesn't depend on the size of
+ * the disk. FAT blocks are read the first time they are used, and the
+ * free-space accounting is set up by the first call that allocates, frees or
+ * counts blocks, which reads the whole FAT
+ * @trace: Name of a file to record every block request to the virtual disk
+ * in, with the block_trace_start() format (NULL records nothing). Requests are
+ * tagged with the &enum fs_op of the call that made them plus 1, or 0 when
+ * they are made outside of any call, by the flusher or at unmount time. The
+ * trace is complete once the file system is unmounted
+ *
+ * Use fs_options_init() to fill in the defaults before changing any field.
+ */
+struct fs_options {
+	size_t cache_blocks;
+	size_t prealloc_blocks;
+	size_t readahead_blocks;
+	enum fs_backend backend;
+	unsigned int flush_interval_ms;
+	size_t dirty_background_blocks;
+	size_t dirty_limit_blocks;
+	size_t journal_blocks;
+	int durable_metadata;
+	int discard;
+	int lazy_fat;
+	const char *trace;
+};
+
+/**
+ * struct fs_cache_stats - Block cache counters
+ * @capacity: Number of blocks the cache can hold
+ * @hits: Block requests served from the cache
+ * @misses: Block requests that had to go to the disk
+ * @evictions: Blocks evicted to make room for other blocks
+ * @writebacks: Dirty blocks written back to the disk
+ * @readahead: Blocks read ahead of sequential readers
+ */
+struct fs_cache_stats {
+	size_t capacity;
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+	size_t writebacks;
+	size_t readahead;
+};
+
+/**
+ * struct fs_journal_stats - Metadata journal counters
+ * @capacity: Number of blocks of the journal
+ * @commits: Commits written to the journal since mount time
+ * @committed_blocks: Metadata blocks written to the journal since mount time
+ * @checkpoints: Times the journal was emptied after its blocks were written in
+ * place
+ * @replayed_commits: Commits replayed at mount time
+ * @replayed_blocks: Metadata blocks replayed at mount time
+ * @replay_us: Time taken to replay the journal at mount time, in microseconds
+ */
+struct fs_journal_stats {
+	size_t capacity;
+	size_t commits;
+	size_t committed_blocks;
+	size_t checkpoints;
+	size_t replayed_commits;
+	size_t replayed_blocks;
+	size_t replay_us;
+};
+
+/** Number of buckets of the latency histograms of &struct fs_stats */
+#define FS_LAT_BUCKETS 32
+
+/** File system calls counted by fs_stats() */
+enum fs_op {
+	FS_OP_MOUNT,
+	FS_OP_SYNC,
+	FS_OP_SYNC_ASYNC,
+	FS_OP_INFO,
+	FS_OP_CREATE,
+	FS_OP_DELETE,
+	FS_OP_LS,
+	FS_OP_OPEN,
+	FS_OP_CLOSE,
+	FS_OP_STAT,
+	FS_OP_LSEEK,
+	FS_OP_WRITE,
+	FS_OP_RESERVE,
+	FS_OP_TRUNCATE,
+	FS_OP_FALLOCATE,
+	FS_OP_READ,
+	FS_OP_MKDIR,
+	FS_OP_RMDIR,
+	FS_OP_READDIR,
+	/** Number of calls */
+	FS_OP_COUNT,
+};
+
+/**
+ * fs_op_name - Get the name of a file system call
+ * @op: Call
+ *
+ * Return: the name of @op, the one of the fs_*() function without the prefix,
+ * or NULL if @op is invalid.
+ */
+const char *fs_op_name(enum fs_op op);
+
+/**
+ * struct fs_op_stats - Counters of a file system call
+ * @calls: Number of calls
+ * @errors: Calls that returned -1
+ * @bytes: Bytes moved, by fs_read() and fs_write()
+ * @total_ns: Time spent in the call, in nanoseconds
+ * @latency_ns: Latency histogram. Bucket i counts the calls that took at least
+ * 2^i and less than 2^(i+1) nanoseconds (bucket 0 those under 2ns, the last
+ * bucket every longer one)
+ */
+struct fs_op_stats {
+	size_t calls;
+	size_t errors;
+	size_t bytes;
+	size_t total_ns;
+	size_t latency_ns[FS_LAT_BUCKETS];
+};
+
+/**
+ * struct fs_stats - File system counters
+ * @ops: Counters of each call, indexed by &enum fs_op. The mount is counted
+ * once it succeeded
+ * @fat_steps: FAT entries followed to find the blocks of files
+ * @allocated_blocks: Data blocks allocated
+ * @freed_blocks: Data blocks freed
+ * @cache: Block cache counters, same as fs_cache_stats()
+ * @disk_reads: Read requests sent to the virtual disk, by the cache, the
+ * journal and the metadata writes alike
+ * @disk_read_blocks: Blocks read by these requests
+ * @disk_writes: Write requests sent to the virtual disk
+ * @disk_written_blocks: Blocks written by these requests
+ * @disk_flushes: Flushes of the virtual disk to stable storage
+ * @disk_read_total_ns: Time spent waiting for read requests, in nanoseconds
+ * @disk_write_total_ns: Time spent waiting for write requests, in nanoseconds
+ * @disk_read_ns: Latency histogram of the read requests that were waited for,
+ * with the buckets of @ops
+ * @disk_write_ns: Same as @disk_read_ns, for the write requests
+ */
+struct fs_stats {
+	struct fs_op_stats ops[FS_OP_COUNT];
+	size_t fat_steps;
+	size_t allocated_blocks;
+	size_t freed_blocks;
+	struct fs_cache_stats cache;
+	size_t disk_reads;
+	size_t disk_read_blocks;
+	size_t disk_writes;
+	size_t disk_written_blocks;
+	size_t disk_flushes;
+	size_t disk_read_total_ns;
+	size_t disk_write_total_ns;
+	size_t disk_read_ns[FS_LAT_BUCKETS];
+	size_t disk_write_ns[FS_LAT_BUCKETS];
+};
+
+/**
+ * struct fs_format_options - Format options
+ * @version: %FS_VERSION_1, %FS_VERSION_2, or 0 (default) for the oldest
+ * version that can hold the file system
+ * @block_size: Size of a block in bytes, a power of 2 between 512 and 65536,
+ * 4096 by default. Version 1 only has 4096-byte blocks. Smaller blocks waste
+ * less room at the end of small files, larger ones make fewer requests to the
+ * disk for large files and keep the FAT smaller
+ *
+ * Use fs_format_options_init() to fill in the defaults before changing any
+ * field.
+ */
+struct fs_format_options {
+	int version;
+	size_t block_size;
+};
+
+/**
+ * fs_format - Create a file system
+ * @diskname: Name of the virtual disk file to create
+ * @data_blocks: Number of data blocks of the file system
+ *
+ * Create virtual disk file @diskname holding an empty file system with
+ * @data_blocks data blocks. Only the blocks that aren't all zeros are written,
+ * the rest of the file is left sparse, so that a new file system takes up
+ * almost no room on the host. File systems of up to 65535 blocks use format
+ * version 1, larger ones version 2.
+ *
+ * Return: -1 if @diskname already exists or cannot be created, or if
+ * @data_blocks is 0 or too large for the FAT. 0 otherwise.
+ */
+int fs_format(const char *diskname, size_t data_blocks);
+
+/**
+ * fs_format_options_init - Fill in default format options
+ * @opts: Options to initialize
+ */
+void fs_format_options_init(struct fs_format_options *opts);
+
+/**
+ * fs_format_opts - Create a file system with options
+ * @diskname: Name of the virtual disk file to create
+ * @data_blocks: Number of data blocks of the file system
+ * @opts: Format options, or NULL for the defaults
+ *
+ * Same as fs_format(), which uses the default options, so that file systems
+ * that fit in version 1 stay readable by older drivers. Every version and
+ * block size is mounted the same way: fs_mount() finds them out from the
+ * superblock of the file system.
+ *
+ * Return: -1 if @diskname already exists or cannot be created, if @opts is
+ * invalid, or if @data_blocks is 0 or too large for the FAT of the version. 0
+ * otherwise.
+ */
+int fs_format_opts(const char *diskname, size_t data_blocks,
+		   const struct fs_format_options *opts);
+
+/**
+ * fs_format_version - Create a file system of a given format version
+ * @diskname: Name of the virtual disk file to create
+ * @data_blocks: Number of data blocks of the file system
+ * @version: Same as the @version format option
+ *
+ * Same as fs_format_opts() with the default options but @version.
+ *
+ * Return: Same as fs_format_opts().
+ */
+int fs_format_version(const char *diskname, size_t data_blocks, int version);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -20,11 +334,34 @@
  * contains. A file system needs to be mounted before files can be read from it
  * with fs_read() or written to it with fs_write().
  *
+ * Once the file system is mounted, the other functions can be called from
+ * several threads at once: reads of a file run in parallel, and so do reads and
+ * writes of different files. Calls on a same file descriptor are serialized.
+ * fs_mount() and fs_umount() must not race with any other call.
+ *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
  */
 int fs_mount(const char *diskname);
 
+/**
+ * fs_options_init - Fill in default mount options
+ * @opts: Options to initialize
+ */
+void fs_options_init(struct fs_options *opts);
+
+/**
+ * fs_mount_opts - Mount a file system with options
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options, or NULL for the defaults
+ *
+ * Same as fs_mount(), but lets the caller tune the mount with @opts.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, if no valid
+ * file system can be located, or if @opts cannot be honored. 0 otherwise.
+ */
+int fs_mount_opts(const char *diskname, const struct fs_options *opts);
+
 /**
  * fs_umount - Unmount file system
  *
@@ -36,46 +373,145 @@ int fs_mount(const char *diskname);
  */
 int fs_umount(void);
 
+/**
+ * fs_sync - Write file system changes to disk
+ *
+ * Write the dirty cached data blocks of the currently mounted file system to
+ * the virtual disk file, followed by the blocks of the FAT and of the root
+ * directory that changed since the last sync. Unchanged metadata is not
+ * written. fs_umount() does the same before closing the disk.
+ *
+ * If the file system has a journal, the metadata blocks are committed to it
+ * instead, and only written in place when the journal fills up or at unmount
+ * time.
+ *
+ * Either way, the virtual disk file is flushed to stable storage (fdatasync(),
+ * and msync() for %FS_BACKEND_MMAP) before fs_sync() returns, so that the
+ * changes survive a crash of the host and not only of the process. Passes of
+ * the background flusher do the same.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if a block cannot be
+ * written or flushed. 0 otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_sync_async - Start writing file system changes to disk
+ *
+ * Wake up the background flusher of the currently mounted file system so that
+ * it does what fs_sync() does, and return without waiting for it. Without a
+ * flusher (see &struct fs_options), same as fs_sync().
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if there is no
+ * flusher and fs_sync() fails. 0 otherwise.
+ */
+int fs_sync_async(void);
+
 /**
  * fs_info - Display information about file system
  *
  * Display some information about the currently mounted file system.
  *
+ * The fragmentation of the files, in subdirectories too, is reported as
+ * frag_ratio=<breaks>/<links>, where <links> counts the links between
+ * consecutive blocks of a same file and <breaks> the ones that don't lead to
+ * the physically next block. On version 2 file systems, the size of the
+ * blocks follows, as blk_size=<bytes>.
+ *
  * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
  */
 int fs_info(void);
 
+/**
+ * fs_cache_stats - Get block cache counters
+ * @stats: Structure to be filled with the counters
+ *
+ * Get the counters of the block cache of the currently mounted file system, or
+ * of the last mounted one if it was unmounted since. Counters are reset at
+ * mount time.
+ *
+ * Return: -1 if @stats is NULL. 0 otherwise.
+ */
+int fs_cache_stats(struct fs_cache_stats *stats);
+
+/**
+ * fs_journal_stats - Get metadata journal counters
+ * @stats: Structure to be filled with the counters
+ *
+ * Get the counters of the journal of the currently mounted file system.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if it has no journal,
+ * or if @stats is NULL. 0 otherwise.
+ */
+int fs_journal_stats(struct fs_journal_stats *stats);
+
+/**
+ * fs_stats - Get file system counters
+ * @stats: Structure to be filled with the counters
+ *
+ * Get a snapshot of the counters of the currently mounted file system: calls,
+ * errors, bytes moved and latency of each call, block allocations, cache and
+ * virtual disk activity. Counters are reset at mount time. They are updated
+ * with atomic operations and a clock read per call, so they are always on.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if @stats is NULL. 0
+ * otherwise.
+ */
+int fs_stats(struct fs_stats *stats);
+
+/**
+ * fs_stats_dump - Print file system counters
+ * @stats: Counters returned by fs_stats()
+ * @stream: Where to print them
+ *
+ * Print @stats in the Prometheus text exposition format, one sample per line:
+ * counters are named fs_<name>_total, calls and disk requests are labeled with
+ * op="<call>" and dir="read" or dir="write", and latencies are histograms in
+ * seconds. Empty histogram buckets past the last used one are left out.
+ *
+ * Return: -1 if @stats or @stream is NULL, or if printing fails. 0 otherwise.
+ */
+int fs_stats_dump(const struct fs_stats *stats, FILE *stream);
+
 /**
  * fs_create - Create a new file
- * @filename: File name
+ * @filename: Path of the file
  *
- * Create a new and empty file named @filename in the root directory of the
- * mounted file system. String @filename must be NULL-terminated and its total
+ * Create a new and empty file at path @filename of the mounted file system. A
+ * path is a list of names separated by single '/' characters, with an optional
+ * leading '/', and its last name is the one of the file: "name" and "/name"
+ * are in the root directory, "dir/name" in directory "dir" of the root
+ * directory. Each name of the path must be NULL-terminated and its total
  * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
- * character).
+ * character). The whole path cannot exceed %FS_PATH_LEN characters. File
+ * systems of format version 1 have no directories: @filename is then the name
+ * of a file of the root directory as it is, '/' characters included.
  *
  * Return: -1 if @filename is invalid, if a file named @filename already exists,
- * or if string @filename is too long, or if the root directory already contains
- * %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * or if string @filename is too long, if a directory of the path doesn't
+ * exist, or if the directory of the file is full: the root directory holds
+ * %FS_FILE_MAX_COUNT files, other directories grow as long as there are free
+ * blocks. 0 otherwise.
  */
 int fs_create(const char *filename);
 
 /**
  * fs_delete - Delete a file
- * @filename: File name
+ * @filename: Path of the file, as for fs_create()
  *
- * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * Delete the file at path @filename of the mounted file system.
  *
  * Return: -1 if @filename is invalid, if there is no file named @filename to
- * delete, or if file @filename is currently open. 0 otherwise.
+ * delete (a directory is deleted with fs_rmdir()), or if file @filename is
+ * currently open. 0 otherwise.
  */
 int fs_delete(const char *filename);
 
 /**
  * fs_ls - List files on file system
  *
- * List information about the files located in the root directory.
+ * List information about the files and directories located in the root
+ * directory.
  *
  * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
  */
@@ -83,9 +519,9 @@ int fs_ls(void);
 
 /**
  * fs_open - Open a file
- * @filename: File name
+ * @filename: Path of the file, as for fs_create()
  *
- * Open file named @filename for reading and writing, and return the
+ * Open file at path @filename for reading and writing, and return the
  * corresponding file descriptor. The file descriptor is a non-negative integer
  * that is used subsequently to access the contents of the file. The file offset
  * of the file descriptor is set to 0 initially (beginning of the file). If the
@@ -93,20 +529,95 @@ int fs_ls(void);
  * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
  * simultaneously.
  *
- * Return: -1 if @filename is invalid, there is no file named @filename to open,
- * or if there are already %FS_OPEN_MAX_COUNT files currently open. Otherwise,
- * return the file descriptor.
+ * Return: -1 if @filename is invalid, there is no file named @filename to open
+ * (directories cannot be opened), or if there are already %FS_OPEN_MAX_COUNT
+ * files currently open. Otherwise, return the file descriptor.
  */
 int fs_open(const char *filename);
 
+/**
+ * fs_mkdir - Create a directory
+ * @path: Path of the directory, as for fs_create()
+ *
+ * Create a new and empty directory at path @path of the mounted file system.
+ * Directories other than the root one are hash tables of blocks indexed by the
+ * names of their entries, so that a name is found in a single block whatever
+ * the number of entries. They start with one block, and double in size when
+ * the block of a new name is full. Only file systems of format version 2 can
+ * hold directories: older drivers would take them for files.
+ *
+ * Return: -1 if @path is invalid, if an entry named @path already exists, if a
+ * directory of the path doesn't exist, if the file system is of format version
+ * 1, if its journal is too small for directories, or if there is no room left
+ * for the directory. 0 otherwise.
+ */
+int fs_mkdir(const char *path);
+
+/**
+ * fs_rmdir - Delete a directory
+ * @path: Path of the directory, as for fs_create()
+ *
+ * Delete the empty directory at path @path of the mounted file system, and free
+ * its blocks. With a journal, the blocks are only reused once the journal is
+ * checkpointed, so that replaying it never writes over them.
+ *
+ * Return: -1 if @path is invalid, if there is no directory named @path to
+ * delete, or if the directory is not empty. 0 otherwise.
+ */
+int fs_rmdir(const char *path);
+
+/**
+ * struct fs_dirent - Directory entry, as returned by fs_readdir()
+ * @name: Name of the entry, NULL-terminated
+ * @size: Size of the file in bytes, or of the hash table of the directory
+ * @is_dir: 1 if the entry is a directory, 0 if it is a file
+ */
+struct fs_dirent {
+	char name[FS_FILENAME_LEN];
+	size_t size;
+	int is_dir;
+};
+
+/**
+ * typedef fs_readdir_fn - Callback of fs_readdir()
+ * @entry: Entry of the directory
+ * @arg: Argument given to fs_readdir()
+ *
+ * Return: 0 to go on with the next entry, anything else to stop.
+ */
+typedef int (*fs_readdir_fn)(const struct fs_dirent *entry, void *arg);
+
+/**
+ * fs_readdir - List a directory
+ * @path: Path of the directory, as for fs_create(), or "" or "/" for the root
+ * directory
+ * @fn: Function called for each entry of the directory
+ * @arg: Argument passed to @fn
+ *
+ * Call @fn on each entry of the directory at path @path, in no particular
+ * order, until it returns non-zero. The entries are taken at once, then handed
+ * to @fn without any lock held, so @fn can call the other functions of the
+ * file system.
+ *
+ * Path resolution is cached: the blocks of the most recently used directories
+ * are remembered along with their paths, so that the functions that take a
+ * path don't look up every directory of it again.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if @path is invalid or
+ * is not a directory, or if @fn is NULL. 0 otherwise.
+ */
+int fs_readdir(const char *path, fs_readdir_fn fn, void *arg);
+
 /**
  * fs_close - Close a file
  * @fd: File descriptor
  *
- * Close file descriptor @fd.
+ * Close file descriptor @fd. The entry of a file of a directory other than the
+ * root is written back to its directory when its last file descriptor closes.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). 0 otherwise.
+ * open), or if the entry cannot be written back, in which case @fd stays open
+ * and the call can be retried. 0 otherwise.
  */
 int fs_close(int fd);
 
@@ -117,7 +628,8 @@ int fs_close(int fd);
  * Get the current size of the file pointed by file descriptor @fd.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). Otherwise return the current size of file.
+ * open), or if the size of the file doesn't fit in an int. Otherwise return the
+ * current size of file.
  */
 int fs_stat(int fd);
 
@@ -157,6 +669,58 @@ int fs_lseek(int fd, size_t offset);
  */
 int fs_write(int fd, void *buf, size_t count);
 
+/**
+ * fs_reserve - Reserve contiguous space for a file
+ * @fd: File descriptor
+ * @size: Number of bytes about to be appended to the file
+ *
+ * Reserve a contiguous run of free blocks, right after the file's last block if
+ * possible, large enough to append @size bytes to the file referenced by file
+ * descriptor @fd. The blocks are used by the following writes that extend the
+ * file. Reserved blocks that are still unused when @fd is closed are freed.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if there are not enough free blocks on disk. Otherwise return the
+ * number of bytes actually reserved, which is smaller than @size if no free run
+ * is long enough.
+ */
+int fs_reserve(int fd, size_t size);
+
+/**
+ * fs_truncate - Set the size of a file
+ * @fd: File descriptor
+ * @size: New size of the file, in bytes
+ *
+ * Cut the file referenced by file descriptor @fd down to @size bytes, or extend
+ * it to @size bytes that read as zeros. When the file shrinks, every block past
+ * its new end is freed, including the ones allocated by fs_fallocate(). The
+ * file offsets of the file descriptors are left alone: writing past the end of
+ * the file first fills the gap with zeros.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if there are not enough free blocks on disk to extend the file, in
+ * which case it keeps its size. 0 otherwise.
+ */
+int fs_truncate(int fd, size_t size);
+
+/**
+ * fs_fallocate - Allocate space for a file
+ * @fd: File descriptor
+ * @size: Number of bytes the file must be able to hold
+ *
+ * Allocate the blocks the file referenced by file descriptor @fd needs to hold
+ * @size bytes, all at once, so that writes up to @size bytes don't have to
+ * allocate any. Unlike fs_reserve(), the blocks become part of the file and
+ * stay allocated once @fd is closed. The size of the file doesn't change, and
+ * the blocks past its end are never read: partial writes to them don't have to
+ * fetch their old content.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if there are not enough free blocks on disk, in which case nothing
+ * is allocated. 0 otherwise.
+ */
+int fs_fallocate(int fd, size_t size);
+
 /**
  * fs_read - Read from a file
  * @fd: File descriptor
@@ -177,4 +741,66 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/*
+ * File systems can also be mounted as independent instances with
+ * fs_mount_ex(), each on its own virtual disk file. Every function then takes
+ * the file system it works on, and different file systems can be used from
+ * different threads without any contention between them. The functions above
+ * work on a default instance, mounted with fs_mount().
+ */
+
+/** Mounted file system (opaque) */
+struct fs;
+
+/**
+ * fs_mount_ex - Mount a file system instance
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options, or NULL for the defaults
+ *
+ * Same as fs_mount_opts(), but return a new file system instance instead of
+ * mounting the default one. The same virtual disk file must not be mounted
+ * twice at the same time.
+ *
+ * Return: NULL if virtual disk file @diskname cannot be opened, if no valid
+ * file system can be located, or if @opts cannot be honored. Otherwise, the
+ * mounted file system.
+ */
+struct fs *fs_mount_ex(const char *diskname, const struct fs_options *opts);
+
+/**
+ * fs_umount_ex - Unmount a file system instance
+ * @fs: File system returned by fs_mount_ex()
+ *
+ * Same as fs_umount(), on file system @fs. Unless files are still open, @fs is
+ * released and cannot be used afterwards, even if -1 is returned.
+ *
+ * Return: -1 if @fs is NULL, if there are still open file descriptors, or if
+ * the file system cannot be fully written back to disk. 0 otherwise.
+ */
+int fs_umount_ex(struct fs *fs);
+
+/* Same as the functions without the _ex suffix, on file system @fs */
+int fs_sync_ex(struct fs *fs);
+int fs_sync_async_ex(struct fs *fs);
+int fs_info_ex(struct fs *fs);
+int fs_cache_stats_ex(struct fs *fs, struct fs_cache_stats *stats);
+int fs_journal_stats_ex(struct fs *fs, struct fs_journal_stats *stats);
+int fs_stats_ex(struct fs *fs, struct fs_stats *stats);
+int fs_create_ex(struct fs *fs, const char *filename);
+int fs_delete_ex(struct fs *fs, const char *filename);
+int fs_ls_ex(struct fs *fs);
+int fs_open_ex(struct fs *fs, const char *filename);
+int fs_mkdir_ex(struct fs *fs, const char *path);
+int fs_rmdir_ex(struct fs *fs, const char *path);
+int fs_readdir_ex(struct fs *fs, const char *path, fs_readdir_fn fn,
+		  void *arg);
+int fs_close_ex(struct fs *fs, int fd);
+int fs_stat_ex(struct fs *fs, int fd);
+int fs_lseek_ex(struct fs *fs, int fd, size_t offset);
+int fs_write_ex(struct fs *fs, int fd, void *buf, size_t count);
+int fs_reserve_ex(struct fs *fs, int fd, size_t size);
+int fs_truncate_ex(struct fs *fs, int fd, size_t size);
+int fs_fallocate_ex(struct fs *fs, int fd, size_t size);
+int fs_read_ex(struct fs *fs, int fd, void *buf, size_t count);
+
 #endif /* _FS_H */
@@ -0,0 +1,405 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "disk.h"
+#include "journal.h"
+
+#define journal_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* "JNLH" and "JNLR" */
+#define HEADER_MAGIC 0x484c4e4a
+#define RECORD_MAGIC 0x524c4e4a
+
+/* Start of the first block of the journal region, the rest is zeros */
+struct __attribute__((packed)) journal_header {
+	uint32_t magic;
+	/* Sequence number of the first record */
+	uint32_t sequence;
+};
+
+/*
+ * Start of the descriptor of a record, which takes as many blocks as its list
+ * of blocks needs, zero-padded
+ */
+struct __attribute__((packed)) journal_record {
+	uint32_t magic;
+	/* One more than the previous record */
+	uint32_t sequence;
+	uint32_t count;
+	/* Checksum of the descriptor (with this field 0) and the copies */
+	uint32_t checksum;
+	/* Blocks the copies following the descriptor belong to */
+	uint32_t blocks[];
+};
+
+/* Journal instance */
+struct journal {
+	struct disk *disk;
+	size_t block_size;
+	/* Journal region */
+	size_t start, nr;
+	/* Sequence number of the next record */
+	uint32_t sequence;
+	/* Region block the next record goes to */
+	size_t head;
+	struct journal_stats stats;
+};
+
+/* FNV-1a, chained from @hash */
+static uint32_t checksum(uint32_t hash, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	for (size_t i = 0; i < len; i++)
+		hash = (hash ^ p[i]) * 16777619u;
+
+	return hash;
+}
+
+/* Number of descriptor blocks of a record of @count copies */
+static size_t descriptor_blocks(size_t block_size, size_t count)
+{
+	size_t len = sizeof(struct journal_record) + count * sizeof(uint32_t);
+
+	return (len + block_size - 1) / block_size;
+}
+
+size_t journal_record_blocks(size_t block_size, size_t count)
+{
+	return descriptor_blocks(block_size, count) + count;
+}
+
+/* @desc is the whole descriptor, @copies the blocks following it */
+static uint32_t record_checksum(const struct journal_record *desc,
+				const void *const *copies, size_t block_size)
+{
+	static const uint32_t zero;
+	size_t len = descriptor_blocks(block_size, desc->count) * block_size;
+	size_t off = offsetof(struct journal_record, checksum);
+	uint32_t hash;
+
+	hash = checksum(2166136261u, desc, off);
+	hash = checksum(hash, &zero, sizeof(zero));
+	hash = checksum(hash, (const char *)desc + off + sizeof(zero),
+			len - off - sizeof(zero));
+	for (size_t i = 0; i < desc->count; i++)
+		hash = checksum(hash, copies[i], block_size);
+
+	return hash;
+}
+
+static int write_header(struct disk *disk, size_t start, uint32_t sequence)
+{
+	struct journal_header *hdr;
+	int ret = 0;
+
+	if (!(hdr = calloc(1, disk_block_size(disk))))
+		return -1;
+	hdr->magic = HEADER_MAGIC;
+	hdr->sequence = sequence;
+	if (disk_write(disk, start, hdr) || disk_flush(disk))
+		ret = -1;
+	free(hdr);
+
+	return ret;
+}
+
+/* Smallest region: a header and a record of one block */
+static int region_valid(struct disk *disk, size_t start, size_t nr_blocks)
+{
+	int count = disk_count(disk);
+
+	return count >= 0 && nr_blocks >= 3 && start < (size_t)count &&
+		nr_blocks <= (size_t)count - start;
+}
+
+int journal_format(struct disk *disk, size_t start, size_t nr_blocks)
+{
+	if (!region_valid(disk, start, nr_blocks)) {
+		journal_error("invalid journal region");
+		return -1;
+	}
+
+	return write_header(disk, start, 1);
+}
+
+/* Copy of a block found in the journal, @seq-th of the copies */
+struct replay_ent {
+	size_t block;
+	size_t seq;
+	const void *buf;
+};
+
+/* By block, then from the oldest copy to the latest */
+static int cmp_replay_ent(const void *a, const void *b)
+{
+	const struct replay_ent *ea = a, *eb = b;
+
+	if (ea->block != eb->block)
+		return (ea->block > eb->block) - (ea->block < eb->block);
+	return (ea->seq > eb->seq) - (ea->seq < eb->seq);
+}
+
+/*
+ * Check the record at region block @pos of @region (the whole journal, read in
+ * memory) and append the copies it holds to @ents, which has room for one per
+ * region block. @copies is scratch room for one pointer per region block.
+ * Return the number of region blocks the record takes, or 0 if there is no
+ * valid record there (the end of the journal).
+ */
+static size_t scan_record(struct journal *j, const char *region, size_t pos,
+			  const void **copies, struct replay_ent *ents,
+			  size_t *nr_ents)
+{
+	const struct journal_record *rec;
+	size_t bs = j->block_size;
+	size_t count = disk_count(j->disk);
+	size_t desc;
+
+	if (pos >= j->nr)
+		return 0;
+	rec = (const struct journal_record *)(region + pos * bs);
+	if (rec->magic != RECORD_MAGIC || rec->sequence != j->sequence ||
+	    !rec->count || rec->count >= j->nr - pos)
+		return 0;
+	desc = descriptor_blocks(bs, rec->count);
+	if (desc + rec->count > j->nr - pos)
+		return 0;
+
+	for (size_t i = 0; i < rec->count; i++) {
+		/* Never let a corrupt record scribble over the journal */
+		if (rec->blocks[i] >= count ||
+		    (rec->blocks[i] >= j->start &&
+		     rec->blocks[i] < j->start + j->nr))
+			return 0;
+		copies[i] = region + (pos + desc + i) * bs;
+	}
+	if (record_checksum(rec, copies, bs) != rec->checksum)
+		return 0;
+
+	for (size_t i = 0; i < rec->count; i++) {
+		ents[*nr_ents].block = rec->blocks[i];
+		ents[*nr_ents].seq = *nr_ents;
+		ents[*nr_ents].buf = copies[i];
+		(*nr_ents)++;
+	}
+
+	j->stats.replayed_commits++;
+	j->stats.replayed_blocks += rec->count;
+
+	return desc + rec->count;
+}
+
+/*
+ * Replay the journal: read it whole in one sequential request, then write the
+ * latest copy of each block it holds once, in disk order. The copies are
+ * sorted once, so that the latest one of each block is the last of its run.
+ */
+static int replay(struct journal *j)
+{
+	size_t *blocks = malloc(j->nr * sizeof(*blocks));
+	void **bufs = malloc(j->nr * sizeof(*bufs));
+	struct replay_ent *ents = malloc(j->nr * sizeof(*ents));
+	char *region = malloc(j->nr * j->block_size);
+	size_t pos, n, nr_ents = 0;
+	int ret = -1;
+
+	if (!blocks || !bufs || !ents || !region) {
+		journal_error("unable to allocate replay buffers");
+		goto out;
+	}
+
+	for (size_t i = 0; i < j->nr; i++) {
+		blocks[i] = j->start + i;
+		bufs[i] = region + i * j->block_size;
+	}
+	if (disk_readv(j->disk, blocks, bufs, j->nr))
+		goto out;
+
+	/* Go through the records in order until the first invalid one */
+	pos = 1;
+	while ((n = scan_record(j, region, pos, (const void **)bufs, ents,
+				&nr_ents))) {
+		pos += n;
+		j->sequence++;
+	}
+	j->head = pos;
+
+	qsort(ents, nr_ents, sizeof(*ents), cmp_replay_ent);
+	n = 0;
+	for (size_t i = 0; i < nr_ents; i++) {
+		if (i + 1 < nr_ents && ents[i + 1].block == ents[i].block)
+			continue;
+		blocks[n] = ents[i].block;
+		bufs[n] = (void *)ents[i].buf;
+		n++;
+	}
+	if (n && disk_writev(j->disk, blocks, (const void *const *)bufs, n))
+		goto out;
+
+	ret = 0;
+out:
+	free(blocks);
+	free(bufs);
+	free(ents);
+	free(region);
+	return ret;
+}
+
+struct journal *journal_open(struct disk *disk, size_t start,
+			     size_t nr_blocks)
+{
+	struct journal_header *hdr;
+	struct timespec t0, t1;
+	struct journal *j;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	if (!region_valid(disk, start, nr_blocks)) {
+		journal_error("invalid journal region");
+		return NULL;
+	}
+
+	if (!(j = calloc(1, sizeof(*j)))) {
+		journal_error("unable to allocate journal");
+		return NULL;
+	}
+	j->disk = disk;
+	j->block_size = disk_block_size(disk);
+	j->start = start;
+	j->nr = nr_blocks;
+
+	if (!(hdr = malloc(j->block_size)) || disk_read(disk, start, hdr) ||
+	    hdr->magic != HEADER_MAGIC) {
+		journal_error("no journal found");
+		free(hdr);
+		free(j);
+		return NULL;
+	}
+	j->sequence = hdr->sequence;
+	free(hdr);
+	j->stats.capacity = nr_blocks;
+
+	/* Make the blocks stable before the records are dropped */
+	if (replay(j) || (j->stats.replayed_commits && disk_flush(disk)) ||
+	    journal_reset(j)) {
+		journal_error("unable to replay journal");
+		free(j);
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	j->stats.replay_us = (t1.tv_sec - t0.tv_sec) * 1000000 +
+		(t1.tv_nsec - t0.tv_nsec) / 1000;
+
+	return j;
+}
+
+void journal_close(struct journal *j)
+{
+	free(j);
+}
+
+size_t journal_space(struct journal *j)
+{
+	if (!j)
+		return 0;
+
+	return j->nr - j->head;
+}
+
+int journal_commit(struct journal *j, const size_t *blocks,
+		   const void *const *bufs, size_t count)
+{
+	struct journal_record *rec;
+	size_t *wblocks;
+	const void **wbufs;
+	size_t desc, total;
+	int ret = -1;
+
+	if (!j) {
+		journal_error("journal not open");
+		return -1;
+	}
+	desc = descriptor_blocks(j->block_size, count);
+	total = desc + count;
+	if (!count || count > UINT32_MAX || total > journal_space(j)) {
+		journal_error("record of %zu blocks doesn't fit", count);
+		return -1;
+	}
+
+	rec = calloc(desc, j->block_size);
+	wblocks = malloc(total * sizeof(*wblocks));
+	wbufs = malloc(total * sizeof(*wbufs));
+	if (!rec || !wblocks || !wbufs) {
+		journal_error("unable to allocate record");
+		goto out;
+	}
+
+	rec->magic = RECORD_MAGIC;
+	rec->sequence = j->sequence;
+	rec->count = count;
+	for (size_t i = 0; i < count; i++)
+		rec->blocks[i] = blocks[i];
+	rec->checksum = record_checksum(rec, bufs, j->block_size);
+
+	/* The descriptor and the copies are contiguous */
+	for (size_t i = 0; i < total; i++) {
+		wblocks[i] = j->start + j->head + i;
+		wbufs[i] = i < desc ? (const char *)rec + i * j->block_size
+				    : bufs[i - desc];
+	}
+	if (disk_writev(j->disk, wblocks, wbufs, total) ||
+	    disk_flush(j->disk))
+		goto out;
+
+	j->head += total;
+	j->sequence++;
+	j->stats.commits++;
+	j->stats.committed_blocks += count;
+	ret = 0;
+out:
+	free(rec);
+	free(wblocks);
+	free(wbufs);
+	return ret;
+}
+
+/*
+ * Records are dropped by moving the sequence number of the header past theirs,
+ * rather than by clearing them: a record is only valid with the sequence number
+ * that follows the previous one, starting from the header's.
+ */
+int journal_reset(struct journal *j)
+{
+	if (!j) {
+		journal_error("journal not open");
+		return -1;
+	}
+
+	if (j->head == 1)
+		return 0;
+
+	if (write_header(j->disk, j->start, j->sequence))
+		return -1;
+
+	j->head = 1;
+	j->stats.resets++;
+
+	return 0;
+}
+
+int journal_get_stats(struct journal *j, struct journal_stats *stats)
+{
+	if (!j || !stats)
+		return -1;
+
+	*stats = j->stats;
+
+	return 0;
+}
@@ -0,0 +1,135 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stddef.h> /* for size_t definition */
+
+struct disk;
+
+/** Metadata journal instance (opaque) */
+struct journal;
+
+/* Journal counters */
+struct journal_stats {
+	/* Number of blocks of the journal region */
+	size_t capacity;
+	/* Records written by journal_commit() */
+	size_t commits;
+	/* Block copies written by journal_commit() */
+	size_t committed_blocks;
+	/* Times the journal was emptied by journal_reset() */
+	size_t resets;
+	/* Records found and applied by journal_open() */
+	size_t replayed_commits;
+	/* Block copies applied by journal_open() */
+	size_t replayed_blocks;
+	/* Time taken by journal_open() to replay the journal, in microseconds */
+	size_t replay_us;
+};
+
+/*
+ * The journal is a region of contiguous blocks. Its first block is a header,
+ * followed by records. A record is a descriptor, listing the blocks it holds
+ * copies of in as many blocks as the list needs, followed by the copies. Each
+ * record carries a sequence number and a checksum, so that a torn record or one
+ * left over from before the last reset is never replayed.
+ *
+ * The journal functions are not thread-safe, callers must serialize them.
+ */
+
+/**
+ * journal_format - Create an empty journal
+ * @disk: Disk holding the journal
+ * @start: Index of the first block of the journal region
+ * @nr_blocks: Number of blocks of the journal region
+ *
+ * Write the header of an empty journal at block @start, and flush it to stable
+ * storage.
+ *
+ * Return: -1 if the region doesn't fit on @disk or is too small, or if the
+ * header cannot be written. 0 otherwise.
+ */
+int journal_format(struct disk *disk, size_t start, size_t nr_blocks);
+
+/**
+ * journal_open - Open and replay a journal
+ * @disk: Disk holding the journal
+ * @start: Index of the first block of the journal region
+ * @nr_blocks: Number of blocks of the journal region
+ *
+ * Apply the records of the journal at block @start, in order, to the blocks
+ * they hold copies of. The journal is then emptied, so it can be committed to.
+ *
+ * Return: NULL if there is no valid journal header at block @start, or if the
+ * journal cannot be replayed. Otherwise, the journal.
+ */
+struct journal *journal_open(struct disk *disk, size_t start,
+			     size_t nr_blocks);
+
+/**
+ * journal_close - Close a journal
+ * @j: Journal, which cannot be used afterwards
+ *
+ * Records still in the journal are kept, and replayed by the next
+ * journal_open().
+ */
+void journal_close(struct journal *j);
+
+/**
+ * journal_space - Get free space in a journal
+ * @j: Journal
+ *
+ * Return: the number of blocks left in the journal, descriptors included. 0 if
+ * @j is NULL.
+ */
+size_t journal_space(struct journal *j);
+
+/**
+ * journal_record_blocks - Get the size of a record
+ * @block_size: Block size of the disk holding the journal
+ * @count: Number of block copies of the record
+ *
+ * Return: the number of journal blocks taken by a record of @count copies,
+ * descriptor included.
+ */
+size_t journal_record_blocks(size_t block_size, size_t count);
+
+/**
+ * journal_commit - Commit block copies to a journal
+ * @j: Journal
+ * @blocks: Indexes of the blocks @bufs are copies of
+ * @bufs: Block copies, one per block
+ * @count: Number of blocks. The record takes journal_record_blocks() blocks of
+ * the journal
+ *
+ * Append a record holding @bufs to the journal, in one sequential write, and
+ * flush it to stable storage. Once this returns, the blocks are guaranteed to
+ * be given the content of @bufs by the next journal_open(), unless
+ * journal_reset() is called first.
+ *
+ * Return: -1 if @j is NULL, if the record doesn't fit, or if it cannot be
+ * written. 0 otherwise.
+ */
+int journal_commit(struct journal *j, const size_t *blocks,
+		   const void *const *bufs, size_t count);
+
+/**
+ * journal_reset - Empty a journal
+ * @j: Journal
+ *
+ * Drop every record of the journal. To be called once the blocks of the records
+ * were written in place and flushed to stable storage.
+ *
+ * Return: -1 if @j is NULL or if the header cannot be written. 0 otherwise.
+ */
+int journal_reset(struct journal *j);
+
+/**
+ * journal_get_stats - Get journal counters
+ * @j: Journal
+ * @stats: Structure to be filled with the counters
+ *
+ * Return: -1 if @j or @stats is NULL. 0 otherwise.
+ */
+int journal_get_stats(struct journal *j, struct journal_stats *stats);
+
+#endif /* _JOURNAL_H */
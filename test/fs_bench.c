@@ -0,0 +1,501 @@
+/*
+Benchmark of the file system library. A scratch disk is formatted, the selected
+workloads are run on it in order, and the disk is removed. Each workload prints
+one line of key=value pairs: throughput in MB/s and operations per second, and
+latency percentiles of the individual operations in microseconds.
+*/
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define test_fs_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	test_fs_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Largest I/O size of any workload */
+#define MAX_IO_SIZE (1024 * 1024)
+
+/*
+ * Operations of the workloads that don't go through a whole file. Appends stop
+ * earlier if the log would outgrow the data file
+ */
+#define RANDOM_OPS 4096
+#define APPEND_OPS 8192
+#define CHURN_OPS 2048
+
+/* Files the churn workload keeps around at once */
+#define CHURN_FILES 32
+
+struct bench {
+	struct fs *fs;
+	/* Size of the file of the sequential and random workloads */
+	size_t file_size;
+	char *buf;
+	/* Latencies of the operations of the running workload, in ns */
+	uint64_t *lat;
+	size_t nr_lat, max_lat;
+	uint64_t start;
+};
+
+/* Scratch disk, removed on exit */
+static char *diskname;
+
+static void remove_disk(void)
+{
+	unlink(diskname);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void record(struct bench *b, uint64_t t0)
+{
+	uint64_t t1 = now_ns();
+
+	if (b->nr_lat == b->max_lat) {
+		b->max_lat = b->max_lat ? b->max_lat * 2 : 4096;
+		b->lat = realloc(b->lat, b->max_lat * sizeof(*b->lat));
+		if (!b->lat)
+			die("Cannot allocate latencies");
+	}
+	b->lat[b->nr_lat++] = t1 - t0;
+}
+
+static void begin(struct bench *b)
+{
+	b->nr_lat = 0;
+	b->start = now_ns();
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(struct bench *b, double p)
+{
+	size_t i = (size_t)(p * b->nr_lat);
+
+	if (i >= b->nr_lat)
+		i = b->nr_lat - 1;
+	return b->lat[i] / 1000.0;
+}
+
+/* End the running workload, which moved @bytes bytes, and report it */
+static void end(struct bench *b, const char *name, size_t io_size,
+		size_t bytes)
+{
+	double secs = (now_ns() - b->start) / 1e9;
+
+	if (!b->nr_lat)
+		die("No operation in workload %s", name);
+	qsort(b->lat, b->nr_lat, sizeof(*b->lat), cmp_u64);
+
+	printf("workload=%s io_size=%zu ops=%zu bytes=%zu secs=%.6f "
+	       "mb_s=%.2f ops_s=%.0f p50_us=%.2f p99_us=%.2f p999_us=%.2f\n",
+	       name, io_size, b->nr_lat, bytes, secs,
+	       bytes / secs / (1024 * 1024), b->nr_lat / secs,
+	       percentile_us(b, 0.50), percentile_us(b, 0.99),
+	       percentile_us(b, 0.999));
+	fflush(stdout);
+}
+
+static int open_file(struct bench *b, const char *filename)
+{
+	int fd = fs_open_ex(b->fs, filename);
+
+	if (fd < 0)
+		die("Cannot open %s", filename);
+	return fd;
+}
+
+static void close_file(struct bench *b, int fd)
+{
+	if (fs_close_ex(b->fs, fd))
+		die("Cannot close file");
+}
+
+/* Random offset of an @io_size chunk of the data file, aligned to @io_size */
+static size_t random_offset(struct bench *b, size_t io_size)
+{
+	return (size_t)rand() % (b->file_size / io_size) * io_size;
+}
+
+/* Make sure the data file exists at its full size, outside of any timing */
+static void prepare_file(struct bench *b)
+{
+	int fd;
+
+	fd = fs_open_ex(b->fs, "data");
+	if (fd >= 0) {
+		int size = fs_stat_ex(b->fs, fd);
+
+		close_file(b, fd);
+		if (size == (int)b->file_size)
+			return;
+		if (fs_delete_ex(b->fs, "data"))
+			die("Cannot delete data file");
+	}
+
+	if (fs_create_ex(b->fs, "data"))
+		die("Cannot create data file");
+	fd = open_file(b, "data");
+	for (size_t done = 0; done < b->file_size; done += MAX_IO_SIZE) {
+		size_t len = b->file_size - done < MAX_IO_SIZE ?
+			b->file_size - done : MAX_IO_SIZE;
+
+		if (fs_write_ex(b->fs, fd, b->buf, len) != (int)len)
+			die("Cannot fill data file, disk too small?");
+	}
+	close_file(b, fd);
+	if (fs_sync_ex(b->fs))
+		die("Cannot sync");
+}
+
+/* Write the data file from scratch, the final sync included */
+static void seq_write(struct bench *b, size_t io_size)
+{
+	int fd;
+
+	fs_delete_ex(b->fs, "data");
+	if (fs_create_ex(b->fs, "data"))
+		die("Cannot create data file");
+	fd = open_file(b, "data");
+
+	begin(b);
+	for (size_t done = 0; done < b->file_size; done += io_size) {
+		uint64_t t0 = now_ns();
+
+		if (fs_write_ex(b->fs, fd, b->buf, io_size) != (int)io_size)
+			die("Short write, disk too small?");
+		record(b, t0);
+	}
+	if (fs_sync_ex(b->fs))
+		die("Cannot sync");
+	end(b, "seq_write", io_size, b->file_size);
+
+	close_file(b, fd);
+}
+
+static void seq_read(struct bench *b, size_t io_size)
+{
+	int fd;
+
+	prepare_file(b);
+	fd = open_file(b, "data");
+
+	begin(b);
+	for (size_t done = 0; done < b->file_size; done += io_size) {
+		uint64_t t0 = now_ns();
+
+		if (fs_read_ex(b->fs, fd, b->buf, io_size) != (int)io_size)
+			die("Short read");
+		record(b, t0);
+	}
+	end(b, "seq_read", io_size, b->file_size);
+
+	close_file(b, fd);
+}
+
+/* Overwrite random chunks of the data file, the final sync included */
+static void rand_write(struct bench *b, size_t io_size)
+{
+	int fd;
+
+	prepare_file(b);
+	fd = open_file(b, "data");
+
+	begin(b);
+	for (size_t i = 0; i < RANDOM_OPS; i++) {
+		uint64_t t0 = now_ns();
+
+		if (fs_lseek_ex(b->fs, fd, random_offset(b, io_size)) ||
+		    fs_write_ex(b->fs, fd, b->buf, io_size) != (int)io_size)
+			die("Cannot write chunk");
+		record(b, t0);
+	}
+	if (fs_sync_ex(b->fs))
+		die("Cannot sync");
+	end(b, "rand_write", io_size, RANDOM_OPS * io_size);
+
+	close_file(b, fd);
+}
+
+static void rand_read(struct bench *b, size_t io_size)
+{
+	int fd;
+
+	prepare_file(b);
+	fd = open_file(b, "data");
+
+	begin(b);
+	for (size_t i = 0; i < RANDOM_OPS; i++) {
+		uint64_t t0 = now_ns();
+
+		if (fs_lseek_ex(b->fs, fd, random_offset(b, io_size)) ||
+		    fs_read_ex(b->fs, fd, b->buf, io_size) != (int)io_size)
+			die("Cannot read chunk");
+		record(b, t0);
+	}
+	end(b, "rand_read", io_size, RANDOM_OPS * io_size);
+
+	close_file(b, fd);
+}
+
+/* Small reads at unaligned random offsets, each after its own seek */
+static void seek_read(struct bench *b, size_t io_size)
+{
+	int fd;
+
+	prepare_file(b);
+	fd = open_file(b, "data");
+
+	begin(b);
+	for (size_t i = 0; i < RANDOM_OPS; i++) {
+		uint64_t t0 = now_ns();
+		size_t offset = (size_t)rand() % (b->file_size - io_size);
+
+		if (fs_lseek_ex(b->fs, fd, offset) ||
+		    fs_read_ex(b->fs, fd, b->buf, io_size) != (int)io_size)
+			die("Cannot read chunk");
+		record(b, t0);
+	}
+	end(b, "seek_read", io_size, RANDOM_OPS * io_size);
+
+	close_file(b, fd);
+}
+
+/* Log-style appends: seek to the end of the file, then write a record */
+static void append(struct bench *b, size_t io_size)
+{
+	size_t ops = b->file_size / io_size;
+	int fd;
+
+	/* The log takes as much room as the data file at most */
+	if (ops > APPEND_OPS)
+		ops = APPEND_OPS;
+
+	fs_delete_ex(b->fs, "log");
+	if (fs_create_ex(b->fs, "log"))
+		die("Cannot create log file");
+	fd = open_file(b, "log");
+
+	begin(b);
+	for (size_t i = 0; i < ops; i++) {
+		uint64_t t0 = now_ns();
+
+		if (fs_lseek_ex(b->fs, fd, fs_stat_ex(b->fs, fd)) ||
+		    fs_write_ex(b->fs, fd, b->buf, io_size) != (int)io_size)
+			die("Cannot append record");
+		record(b, t0);
+	}
+	if (fs_sync_ex(b->fs))
+		die("Cannot sync");
+	end(b, "append", io_size, ops * io_size);
+
+	close_file(b, fd);
+	if (fs_delete_ex(b->fs, "log"))
+		die("Cannot delete log file");
+}
+
+/*
+ * Small-file churn: each operation deletes the oldest of CHURN_FILES files if
+ * it exists, then creates, writes and closes a new one in its place.
+ */
+static void churn(struct bench *b, size_t io_size)
+{
+	char filename[FS_FILENAME_LEN];
+	int fd;
+
+	begin(b);
+	for (size_t i = 0; i < CHURN_OPS; i++) {
+		uint64_t t0 = now_ns();
+
+		snprintf(filename, sizeof(filename), "churn%zu",
+			 i % CHURN_FILES);
+		if (i >= CHURN_FILES && fs_delete_ex(b->fs, filename))
+			die("Cannot delete %s", filename);
+		if (fs_create_ex(b->fs, filename))
+			die("Cannot create %s", filename);
+		fd = open_file(b, filename);
+		if (fs_write_ex(b->fs, fd, b->buf, io_size) != (int)io_size)
+			die("Cannot write %s", filename);
+		close_file(b, fd);
+		record(b, t0);
+	}
+	if (fs_sync_ex(b->fs))
+		die("Cannot sync");
+	end(b, "churn", io_size, CHURN_OPS * io_size);
+
+	for (size_t i = 0; i < CHURN_FILES && i < CHURN_OPS; i++) {
+		snprintf(filename, sizeof(filename), "churn%zu", i);
+		fs_delete_ex(b->fs, filename);
+	}
+}
+
+static struct {
+	const char *name;
+	void (*func)(struct bench *, size_t);
+	/* I/O sizes to run the workload with, 0-terminated */
+	size_t io_sizes[5];
+} workloads[] = {
+	{ "seq_write",	seq_write,	{ 512, 4096, 65536, MAX_IO_SIZE } },
+	{ "seq_read",	seq_read,	{ 512, 4096, 65536, MAX_IO_SIZE } },
+	{ "rand_write",	rand_write,	{ 512, 4096, 65536 } },
+	{ "rand_read",	rand_read,	{ 512, 4096, 65536 } },
+	{ "seek_read",	seek_read,	{ 64 } },
+	{ "append",	append,		{ 100, 4096 } },
+	{ "churn",	churn,		{ 1024 } }
+};
+
+void usage(char *program)
+{
+	int i;
+	fprintf(stderr, "Usage: %s [-n <data blocks>] [-s <file size in MiB>] "
+		"[-c <cache blocks>] [-b <backend>] [-B <block size>] [-l] [-m] "
+		"[-T <trace>] <diskname> [<workload>...]\n", program);
+	fprintf(stderr, "Creates <diskname>, which must not exist, and removes "
+		"it when done.\n");
+	fprintf(stderr, "Backends are 0 (syscall), 1 (mmap), 2 (io_uring).\n");
+	fprintf(stderr, "-B formats with blocks of <block size> bytes instead "
+		"of 4096.\n");
+	fprintf(stderr, "-m prints the fs_stats() counters to stderr at the "
+		"end.\n");
+	fprintf(stderr, "-T records the block requests in <trace>, for "
+		"fs_replay.x.\n");
+	fprintf(stderr, "Possible workloads are (all by default):\n");
+	for (i = 0; i < ARRAY_SIZE(workloads); i++)
+		fprintf(stderr, "\t%s\n", workloads[i].name);
+	exit(1);
+}
+
+static int selected(int argc, char **argv, const char *name)
+{
+	if (!argc)
+		return 1;
+	for (int i = 0; i < argc; i++)
+		if (!strcmp(argv[i], name))
+			return 1;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct fs_options opts;
+	struct fs_format_options format;
+	struct bench b;
+	size_t data_blocks = 16384;
+	int opt, i, metrics = 0;
+
+	memset(&b, 0, sizeof(b));
+	b.file_size = 16 * 1024 * 1024;
+	fs_options_init(&opts);
+	fs_format_options_init(&format);
+
+	while ((opt = getopt(argc, argv, "n:s:c:b:B:lmT:")) != -1) {
+		switch (opt) {
+		case 'n':
+			data_blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			b.file_size = strtoul(optarg, NULL, 0) * 1024 * 1024;
+			break;
+		case 'c':
+			opts.cache_blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			opts.backend = atoi(optarg);
+			break;
+		case 'B':
+			format.block_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			opts.lazy_fat = 1;
+			break;
+		case 'm':
+			metrics = 1;
+			break;
+		case 'T':
+			opts.trace = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind >= argc || b.file_size < MAX_IO_SIZE)
+		usage(argv[0]);
+	diskname = argv[optind++];
+	for (i = optind; i < argc; i++) {
+		int w;
+
+		for (w = 0; w < ARRAY_SIZE(workloads); w++)
+			if (!strcmp(argv[i], workloads[w].name))
+				break;
+		if (w == ARRAY_SIZE(workloads)) {
+			test_fs_error("invalid workload '%s'", argv[i]);
+			usage(argv[0]);
+		}
+	}
+
+	b.buf = malloc(MAX_IO_SIZE);
+	if (!b.buf)
+		die("Cannot allocate buffer");
+	for (i = 0; i < MAX_IO_SIZE; i++)
+		b.buf[i] = 'a' + i % 26;
+
+	if (fs_format_opts(diskname, data_blocks, &format))
+		die("Cannot format %s", diskname);
+	atexit(remove_disk);
+	b.fs = fs_mount_ex(diskname, &opts);
+	if (!b.fs)
+		die("Cannot mount %s", diskname);
+
+	printf("config data_blocks=%zu block_size=%zu file_size=%zu "
+	       "cache_blocks=%zu backend=%d lazy_fat=%d\n", data_blocks,
+	       format.block_size, b.file_size, opts.cache_blocks, opts.backend,
+	       opts.lazy_fat);
+
+	/* Same random offsets from run to run */
+	srand(1);
+	for (i = 0; i < ARRAY_SIZE(workloads); i++) {
+		if (!selected(argc - optind, argv + optind, workloads[i].name))
+			continue;
+		for (size_t *io = workloads[i].io_sizes; *io; io++)
+			workloads[i].func(&b, *io);
+	}
+
+	if (metrics) {
+		struct fs_stats stats;
+
+		if (fs_stats_ex(b.fs, &stats) || fs_stats_dump(&stats, stderr))
+			die("Cannot dump counters");
+	}
+
+	if (fs_umount_ex(b.fs))
+		die("Cannot unmount %s", diskname);
+	free(b.lat);
+	free(b.buf);
+
+	return 0;
+}
@@ -0,0 +1,336 @@
+/*
+Replay of a block trace recorded with block_trace_start() (or the `trace` mount
+option). The requests of the trace are issued again, in order, against a disk
+image or against memory, either as fast as possible or with their original
+timing. The throughput and the latency of each kind of request are reported as
+key=value lines, like fs_bench.x does.
+
+Writes go to the image: replay against a copy of the image that matters.
+*/
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define test_fs_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	test_fs_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Records read from the trace file at once */
+#define REC_BATCH 4096
+
+/* Tags are an fs_op + 1, 0 for requests made outside of any call */
+#define NR_TAGS (FS_OP_COUNT + 1)
+
+static const char *const op_names[] = {
+	[BLOCK_TRACE_READ] = "read",
+	[BLOCK_TRACE_WRITE] = "write",
+	[BLOCK_TRACE_FLUSH] = "flush",
+	[BLOCK_TRACE_DISCARD] = "discard",
+};
+
+/* Counters of a kind of request, or of the requests of a tag */
+struct counters {
+	size_t requests;
+	size_t blocks;
+	/* Latencies of the requests, in ns */
+	uint64_t *lat;
+	size_t max_lat;
+};
+
+struct replay {
+	/* Image the trace is replayed against, or NULL for memory */
+	struct disk *disk;
+	/* Blocks of the memory target, and the block size of the trace */
+	char *mem;
+	size_t nr_blocks;
+	size_t block_size;
+	/* Data buffer of the largest request so far, and its vectors */
+	char *buf;
+	size_t *blocks;
+	void **bufs;
+	size_t max_count;
+	struct counters ops[ARRAY_SIZE(op_names)];
+	struct counters tags[NR_TAGS];
+	/* Largest delay behind the original timing, in ns */
+	uint64_t max_lag;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000,
+		.tv_nsec = ns % 1000000000,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+		;
+}
+
+static void count(struct counters *c, size_t blocks, uint64_t lat)
+{
+	if (c->requests == c->max_lat) {
+		c->max_lat = c->max_lat ? c->max_lat * 2 : 4096;
+		c->lat = realloc(c->lat, c->max_lat * sizeof(*c->lat));
+		if (!c->lat)
+			die("Cannot allocate latencies");
+	}
+	c->lat[c->requests++] = lat;
+	c->blocks += blocks;
+}
+
+/* Make room for a request of @count blocks */
+static void reserve_buffers(struct replay *r, size_t count)
+{
+	if (count <= r->max_count)
+		return;
+
+	free(r->buf);
+	free(r->blocks);
+	free(r->bufs);
+	r->buf = malloc(count * r->block_size);
+	r->blocks = malloc(count * sizeof(*r->blocks));
+	r->bufs = malloc(count * sizeof(*r->bufs));
+	if (!r->buf || !r->blocks || !r->bufs)
+		die("Cannot allocate buffers");
+	for (size_t i = 0; i < count; i++)
+		r->bufs[i] = r->buf + i * r->block_size;
+	r->max_count = count;
+}
+
+/* Issue the request of @rec, return -1 if it fails */
+static int issue(struct replay *r, const struct block_trace_rec *rec)
+{
+	char *mem = r->mem + (size_t)rec->block * r->block_size;
+	size_t len = (size_t)rec->count * r->block_size;
+
+	if (!r->disk) {
+		switch (rec->op) {
+		case BLOCK_TRACE_READ:
+			memcpy(r->buf, mem, len);
+			break;
+		case BLOCK_TRACE_WRITE:
+			memcpy(mem, r->buf, len);
+			break;
+		case BLOCK_TRACE_DISCARD:
+			/* Discarded blocks of an anonymous mapping read zeros */
+			if (len && madvise(mem, len, MADV_DONTNEED))
+				memset(mem, 0, len);
+			break;
+		}
+		return 0;
+	}
+
+	for (size_t i = 0; i < rec->count; i++)
+		r->blocks[i] = rec->block + i;
+
+	switch (rec->op) {
+	case BLOCK_TRACE_READ:
+		return disk_readv(r->disk, r->blocks, r->bufs, rec->count);
+	case BLOCK_TRACE_WRITE:
+		return disk_writev(r->disk, r->blocks,
+				   (const void *const *)r->bufs, rec->count);
+	case BLOCK_TRACE_FLUSH:
+		return disk_flush(r->disk);
+	case BLOCK_TRACE_DISCARD:
+		return disk_discard(r->disk, rec->block, rec->count);
+	}
+
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(struct counters *c, double p)
+{
+	size_t i = (size_t)(p * c->requests);
+
+	if (i >= c->requests)
+		i = c->requests - 1;
+	return c->lat[i] / 1000.0;
+}
+
+static void report(struct counters *c, const char *key, const char *name)
+{
+	if (!c->requests)
+		return;
+
+	qsort(c->lat, c->requests, sizeof(*c->lat), cmp_u64);
+	printf("%s=%s requests=%zu blocks=%zu p50_us=%.2f p99_us=%.2f "
+	       "p999_us=%.2f\n", key, name, c->requests, c->blocks,
+	       percentile_us(c, 0.50), percentile_us(c, 0.99),
+	       percentile_us(c, 0.999));
+}
+
+void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-t <speed>] [-b <backend>] <trace> "
+		"[<diskname>]\n", program);
+	fprintf(stderr, "Replays against <diskname>, which is written to, or "
+		"against memory.\n");
+	fprintf(stderr, "Speed 0 (default) replays as fast as possible, 1 with "
+		"the original timing, 2 twice as fast, and so on.\n");
+	fprintf(stderr, "Backends are 0 (syscall), 1 (mmap), 2 (io_uring).\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct block_trace_header hdr;
+	struct block_trace_rec *recs;
+	struct replay r;
+	enum block_backend backend = BLOCK_BACKEND_FD;
+	double speed = 0;
+	size_t n, nr_recs = 0, blocks = 0;
+	uint64_t start, secs_ns;
+	char *tracename, *diskname = NULL;
+	FILE *f;
+	int opt;
+
+	memset(&r, 0, sizeof(r));
+
+	while ((opt = getopt(argc, argv, "t:b:")) != -1) {
+		switch (opt) {
+		case 't':
+			speed = strtod(optarg, NULL);
+			break;
+		case 'b':
+			backend = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind >= argc || speed < 0)
+		usage(argv[0]);
+	tracename = argv[optind++];
+	if (optind < argc)
+		diskname = argv[optind];
+
+	if (!(f = fopen(tracename, "rb")))
+		die("Cannot open %s", tracename);
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    hdr.magic != BLOCK_TRACE_MAGIC ||
+	    hdr.version != BLOCK_TRACE_VERSION)
+		die("%s is not a block trace", tracename);
+	r.nr_blocks = hdr.nr_blocks;
+	r.block_size = hdr.block_size;
+
+	if (diskname) {
+		r.disk = disk_open(diskname, backend);
+		if (!r.disk)
+			die("Cannot open %s", diskname);
+		if (disk_set_block_size(r.disk, r.block_size))
+			die("%s is not made of %zu-byte blocks", diskname,
+			    r.block_size);
+		if ((size_t)disk_count(r.disk) < r.nr_blocks)
+			die("%s is smaller than the traced disk", diskname);
+	} else {
+		if (r.block_size < BLOCK_SIZE_MIN || r.block_size > BLOCK_SIZE_MAX)
+			die("Trace of invalid %zu-byte blocks", r.block_size);
+		/* Only the blocks that are touched take memory */
+		r.mem = mmap(NULL, r.nr_blocks * r.block_size,
+			     PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (r.mem == MAP_FAILED)
+			die("Cannot allocate %u blocks", hdr.nr_blocks);
+	}
+
+	recs = malloc(REC_BATCH * sizeof(*recs));
+	if (!recs)
+		die("Cannot allocate records");
+
+	start = now_ns();
+	while ((n = fread(recs, sizeof(*recs), REC_BATCH, f)) > 0) {
+		for (size_t i = 0; i < n; i++) {
+			struct block_trace_rec *rec = &recs[i];
+			uint64_t t0;
+
+			if (rec->op >= ARRAY_SIZE(op_names) ||
+			    rec->tag >= NR_TAGS ||
+			    rec->block + (size_t)rec->count > r.nr_blocks)
+				die("Invalid record %zu", nr_recs);
+			reserve_buffers(&r, rec->count);
+
+			if (speed > 0) {
+				uint64_t due = start + rec->time_ns / speed;
+
+				t0 = now_ns();
+				if (t0 < due)
+					sleep_until(due);
+				else if (t0 - due > r.max_lag)
+					r.max_lag = t0 - due;
+			}
+
+			t0 = now_ns();
+			if (issue(&r, rec))
+				die("Request %zu failed", nr_recs);
+			t0 = now_ns() - t0;
+
+			count(&r.ops[rec->op], rec->count, t0);
+			count(&r.tags[rec->tag], rec->count, t0);
+			if (rec->op == BLOCK_TRACE_READ ||
+			    rec->op == BLOCK_TRACE_WRITE)
+				blocks += rec->count;
+			nr_recs++;
+		}
+	}
+	if (ferror(f))
+		die("Cannot read %s", tracename);
+	secs_ns = now_ns() - start;
+	fclose(f);
+
+	if (r.disk && disk_close(r.disk))
+		die("Cannot close %s", diskname);
+
+	printf("replay target=%s speed=%g requests=%zu blocks=%zu secs=%.6f "
+	       "mb_s=%.2f iops=%.0f max_lag_us=%.2f\n",
+	       diskname ? diskname : "memory", speed, nr_recs, blocks,
+	       secs_ns / 1e9,
+	       (double)blocks * r.block_size / (secs_ns / 1e9) / (1024 * 1024),
+	       nr_recs / (secs_ns / 1e9), r.max_lag / 1000.0);
+	for (size_t i = 0; i < ARRAY_SIZE(op_names); i++)
+		report(&r.ops[i], "op", op_names[i]);
+	for (size_t i = 0; i < NR_TAGS; i++)
+		report(&r.tags[i], "tag", i ? fs_op_name(i - 1) : "none");
+
+	for (size_t i = 0; i < ARRAY_SIZE(op_names); i++)
+		free(r.ops[i].lat);
+	for (size_t i = 0; i < NR_TAGS; i++)
+		free(r.tags[i].lat);
+	free(recs);
+	free(r.buf);
+	free(r.blocks);
+	free(r.bufs);
+	if (r.mem)
+		munmap(r.mem, r.nr_blocks * r.block_size);
+
+	return 0;
+}
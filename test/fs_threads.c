@@ -0,0 +1,295 @@
+/*
+Concurrency check of the file system library. A scratch disk is formatted and
+mounted once, then reader threads read random ranges of one shared file while
+writer threads create, write, read back and delete files of their own, and an
+optional thread syncs in a loop. Any data that doesn't read back as written,
+or any call that fails, ends the program with an error.
+
+Build with `make D=1` and add -fsanitize=thread to CFLAGS of both Makefiles to
+run it under ThreadSanitizer.
+*/
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define test_fs_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	test_fs_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Size of the shared file, and largest size of the files of the writers */
+#define FILE_SIZE (200 * 1000)
+
+/* Largest single read and write */
+#define MAX_IO_SIZE (60 * 1000)
+
+#define MAX_THREADS 64
+
+struct threads {
+	struct fs *fs;
+	size_t iterations;
+	/* Writers work in a directory of their own */
+	int subdirs;
+	/* Content of the shared file */
+	char *ref;
+	int stop_sync;
+};
+
+struct thread {
+	struct threads *t;
+	pthread_t tid;
+	unsigned int seed;
+	int id;
+};
+
+/* Scratch disk, removed on exit */
+static char *diskname;
+
+static void remove_disk(void)
+{
+	unlink(diskname);
+}
+
+static void *reader(void *arg)
+{
+	struct thread *th = arg;
+	struct threads *t = th->t;
+	char *buf;
+
+	buf = malloc(MAX_IO_SIZE);
+	if (!buf)
+		die("Cannot allocate buffer");
+
+	for (size_t it = 0; it < t->iterations; it++) {
+		size_t off = rand_r(&th->seed) % FILE_SIZE;
+		size_t len = 1 + rand_r(&th->seed) % MAX_IO_SIZE;
+		size_t expect = off + len > FILE_SIZE ? FILE_SIZE - off : len;
+		int fd;
+
+		fd = fs_open_ex(t->fs, "shared");
+		if (fd < 0)
+			die("Cannot open shared file");
+		if (fs_lseek_ex(t->fs, fd, off))
+			die("Cannot seek shared file");
+		if (fs_read_ex(t->fs, fd, buf, len) != (int)expect ||
+		    memcmp(buf, t->ref + off, expect))
+			die("Wrong data read at %zu+%zu", off, len);
+		if (fs_close_ex(t->fs, fd))
+			die("Cannot close shared file");
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void *writer(void *arg)
+{
+	struct thread *th = arg;
+	struct threads *t = th->t;
+	char name[FS_PATH_LEN];
+	char *buf, *check;
+
+	buf = malloc(FILE_SIZE);
+	check = malloc(FILE_SIZE);
+	if (!buf || !check)
+		die("Cannot allocate buffers");
+
+	if (t->subdirs) {
+		snprintf(name, sizeof(name), "/w%d", th->id);
+		if (fs_mkdir_ex(t->fs, name))
+			die("Cannot create directory '%s'", name);
+		snprintf(name, sizeof(name), "/w%d/file", th->id);
+	} else {
+		snprintf(name, sizeof(name), "w%d", th->id);
+	}
+
+	for (size_t it = 0; it < t->iterations; it++) {
+		size_t size = rand_r(&th->seed) % FILE_SIZE;
+		size_t done = 0;
+		int fd;
+
+		for (size_t i = 0; i < size; i++)
+			buf[i] = rand_r(&th->seed);
+
+		if (fs_create_ex(t->fs, name))
+			die("Cannot create file '%s'", name);
+		fd = fs_open_ex(t->fs, name);
+		if (fd < 0)
+			die("Cannot open file '%s'", name);
+		while (done < size) {
+			size_t len = 1 + rand_r(&th->seed) % MAX_IO_SIZE;
+
+			if (len > size - done)
+				len = size - done;
+			if (fs_write_ex(t->fs, fd, buf + done, len) != (int)len)
+				die("Cannot write file '%s'", name);
+			done += len;
+		}
+		if (fs_stat_ex(t->fs, fd) != (int)size ||
+		    fs_lseek_ex(t->fs, fd, 0) ||
+		    fs_read_ex(t->fs, fd, check, FILE_SIZE) != (int)size ||
+		    memcmp(buf, check, size))
+			die("Wrong data read back from file '%s'", name);
+		if (fs_close_ex(t->fs, fd))
+			die("Cannot close file '%s'", name);
+		if (fs_delete_ex(t->fs, name))
+			die("Cannot delete file '%s'", name);
+	}
+
+	if (t->subdirs) {
+		snprintf(name, sizeof(name), "/w%d", th->id);
+		if (fs_rmdir_ex(t->fs, name))
+			die("Cannot delete directory '%s'", name);
+	}
+
+	free(buf);
+	free(check);
+	return NULL;
+}
+
+static void *syncer(void *arg)
+{
+	struct threads *t = arg;
+
+	while (!__atomic_load_n(&t->stop_sync, __ATOMIC_RELAXED))
+		if (fs_sync_ex(t->fs))
+			die("Cannot sync");
+
+	return NULL;
+}
+
+void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-n <data blocks>] [-r <readers>] "
+		"[-w <writers>] [-i <iterations>] [-c <cache blocks>] "
+		"[-b <backend>] [-j <journal blocks>] [-f <flush interval ms>] "
+		"[-d] [-s] [-l] <diskname>\n", program);
+	fprintf(stderr, "Creates <diskname>, which must not exist, and removes "
+		"it when done.\n");
+	fprintf(stderr, "Backends are 0 (syscall), 1 (mmap), 2 (io_uring).\n");
+	fprintf(stderr, "-j also makes the metadata durable.\n");
+	fprintf(stderr, "-d gives each writer a directory of its own, on a "
+		"version 2 disk.\n");
+	fprintf(stderr, "-s adds a thread that calls fs_sync() in a loop.\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct thread th[MAX_THREADS];
+	struct fs_options opts;
+	struct fs_format_options format;
+	struct threads t;
+	pthread_t sync_tid;
+	size_t data_blocks = 4096, readers = 6, writers = 6;
+	int opt, sync = 0, fd;
+
+	memset(&t, 0, sizeof(t));
+	t.iterations = 30;
+	fs_options_init(&opts);
+	fs_format_options_init(&format);
+
+	while ((opt = getopt(argc, argv, "n:r:w:i:c:b:j:f:dsl")) != -1) {
+		switch (opt) {
+		case 'n':
+			data_blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			readers = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			writers = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			t.iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			opts.cache_blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			opts.backend = atoi(optarg);
+			break;
+		case 'j':
+			opts.journal_blocks = strtoul(optarg, NULL, 0);
+			opts.durable_metadata = 1;
+			break;
+		case 'f':
+			opts.flush_interval_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			t.subdirs = 1;
+			format.version = 2;
+			break;
+		case 's':
+			sync = 1;
+			break;
+		case 'l':
+			opts.lazy_fat = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind >= argc || readers + writers > MAX_THREADS ||
+	    readers + writers == 0 || readers + writers > FS_OPEN_MAX_COUNT)
+		usage(argv[0]);
+	diskname = argv[optind];
+
+	t.ref = malloc(FILE_SIZE);
+	if (!t.ref)
+		die("Cannot allocate buffer");
+	for (size_t i = 0; i < FILE_SIZE; i++)
+		t.ref[i] = rand();
+
+	if (fs_format_opts(diskname, data_blocks, &format))
+		die("Cannot format %s", diskname);
+	atexit(remove_disk);
+	t.fs = fs_mount_ex(diskname, &opts);
+	if (!t.fs)
+		die("Cannot mount %s", diskname);
+
+	if (fs_create_ex(t.fs, "shared"))
+		die("Cannot create shared file");
+	fd = fs_open_ex(t.fs, "shared");
+	if (fd < 0 || fs_write_ex(t.fs, fd, t.ref, FILE_SIZE) != FILE_SIZE ||
+	    fs_close_ex(t.fs, fd))
+		die("Cannot write shared file");
+
+	if (sync && pthread_create(&sync_tid, NULL, syncer, &t))
+		die("Cannot create syncer");
+	for (size_t i = 0; i < readers + writers; i++) {
+		th[i].t = &t;
+		th[i].id = i;
+		th[i].seed = i + 1;
+		if (pthread_create(&th[i].tid, NULL, i < readers ? reader : writer,
+				   &th[i]))
+			die("Cannot create thread %zu", i);
+	}
+	for (size_t i = 0; i < readers + writers; i++)
+		pthread_join(th[i].tid, NULL);
+	if (sync) {
+		__atomic_store_n(&t.stop_sync, 1, __ATOMIC_RELAXED);
+		pthread_join(sync_tid, NULL);
+	}
+
+	if (fs_delete_ex(t.fs, "shared"))
+		die("Cannot delete shared file");
+	if (fs_umount_ex(t.fs))
+		die("Cannot unmount %s", diskname);
+	free(t.ref);
+
+	printf("threads readers=%zu writers=%zu iterations=%zu ok\n", readers,
+	       writers, t.iterations);
+
+	return 0;
+}
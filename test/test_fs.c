@@ -7,6 +7,8 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <fs.h>
@@ -165,16 +167,17 @@ void thread_fs_rm(void *arg)
 void thread_fs_add(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
+	char *diskname, *filename, *fs_path, *buf;
 	int fd, fs_fd;
 	struct stat st;
 	int written;
 
 	if (t_arg->argc < 2)
-		die("Usage: <diskname> <host filename>");
+		die("Usage: <diskname> <host filename> [<path>]");
 
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
+	fs_path = t_arg->argc > 2 ? t_arg->argv[2] : filename;
 
 	/* Open file on host computer */
 	fd = open(filename, O_RDONLY);
@@ -197,12 +200,12 @@ void thread_fs_add(void *arg)
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
-	if (fs_create(filename)) {
+	if (fs_create(fs_path)) {
 		fs_umount();
 		die("Cannot create file");
 	}
 
-	fs_fd = fs_open(filename);
+	fs_fd = fs_open(fs_path);
 	if (fs_fd < 0) {
 		fs_umount();
 		die("Cannot open file");
@@ -218,32 +221,94 @@ void thread_fs_add(void *arg)
 	if (fs_umount())
 		die("Cannot unmount diskname");
 
-	printf("Wrote file '%s' (%d/%zu bytes)\n", filename, written,
+	printf("Wrote file '%s' (%d/%zu bytes)\n", fs_path, written,
 		   st.st_size);
 
 	munmap(buf, st.st_size);
 	close(fd);
 }
 
+static int print_dirent(const struct fs_dirent *entry, void *arg)
+{
+	printf("%s: %s, size: %zu\n", entry->is_dir ? "dir" : "file",
+	       entry->name, entry->size);
+	return 0;
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
 	char *diskname;
 
 	if (t_arg->argc < 1)
-		die("Usage: <diskname> <filename>");
+		die("Usage: <diskname> [<directory>]");
 
 	diskname = t_arg->argv[0];
 
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
-	fs_ls();
+	if (t_arg->argc < 2) {
+		fs_ls();
+	} else if (fs_readdir(t_arg->argv[1], print_dirent, NULL)) {
+		fs_umount();
+		die("Cannot list directory");
+	}
 
 	if (fs_umount())
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_mkdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *path;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <directory>");
+
+	diskname = t_arg->argv[0];
+	path = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_mkdir(path)) {
+		fs_umount();
+		die("Cannot create directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Created directory '%s'\n", path);
+}
+
+void thread_fs_rmdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *path;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <directory>");
+
+	diskname = t_arg->argv[0];
+	path = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_rmdir(path)) {
+		fs_umount();
+		die("Cannot delete directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Removed directory '%s'\n", path);
+}
+
 void thread_fs_info(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -271,16 +336,351 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+void thread_fs_truncate(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	size_t size;
+	int fs_fd;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <filename> <size>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	size = get_argv(t_arg->argv[2]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	if (fs_truncate(fs_fd, size)) {
+		fs_close(fs_fd);
+		fs_umount();
+		die("Cannot truncate file");
+	}
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Truncated file '%s' to %zu bytes\n", filename, size);
+}
+
+void thread_fs_fallocate(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	size_t size;
+	int fs_fd;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <filename> <size>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	size = get_argv(t_arg->argv[2]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	if (fs_fallocate(fs_fd, size)) {
+		fs_close(fs_fd);
+		fs_umount();
+		die("Cannot allocate file");
+	}
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Allocated file '%s' for %zu bytes\n", filename, size);
+}
+
+/* Byte @i of crash file @file */
+static char crash_byte(size_t file, size_t i)
+{
+	return 'a' + (file * 7 + i) % 26;
+}
+
+/* Read the free and total data block counts printed by fs_info() */
+static void crash_free_ratio(struct fs *fs, size_t *free, size_t *total)
+{
+	char line[128];
+	FILE *out;
+	int saved;
+
+	out = tmpfile();
+	if (!out)
+		die_perror("tmpfile");
+	fflush(stdout);
+	saved = dup(STDOUT_FILENO);
+	if (saved < 0 || dup2(fileno(out), STDOUT_FILENO) < 0)
+		die_perror("dup");
+	fs_info_ex(fs);
+	fflush(stdout);
+	if (dup2(saved, STDOUT_FILENO) < 0)
+		die_perror("dup2");
+	close(saved);
+
+	rewind(out);
+	*total = 0;
+	while (fgets(line, sizeof(line), out))
+		if (sscanf(line, "fat_free_ratio=%zu/%zu", free, total) == 2)
+			break;
+	fclose(out);
+	if (!*total)
+		die("Cannot read fat_free_ratio");
+}
+
+void thread_fs_crash(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_journal_stats js;
+	struct fs_options opts;
+	char *diskname, *buf;
+	char name[FS_PATH_LEN];
+	const char *dir = "";
+	size_t files = 8, size, free_before, free_after, total;
+	int fs_fd, status;
+	struct fs *fs;
+	pid_t pid;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<files>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		files = get_argv(t_arg->argv[1]);
+	if (!files || files > 100)
+		die("Need 1 to 100 files");
+
+	buf = malloc(8 * 1500);
+	if (!buf)
+		die_perror("malloc");
+
+	/*
+	 * Add a journal of an eighth of the disk if there is none yet, large
+	 * enough for directories on most version 2 images, and unmount cleanly
+	 */
+	fs_options_init(&opts);
+	fs = fs_mount_ex(diskname, &opts);
+	if (!fs)
+		die("Cannot mount diskname");
+	crash_free_ratio(fs, &free_before, &total);
+	if (fs_umount_ex(fs))
+		die("Cannot unmount diskname");
+	opts.journal_blocks = total / 8 > 64 ? total / 8 : 64;
+	fs = fs_mount_ex(diskname, &opts);
+	if (!fs)
+		die("Cannot mount diskname");
+	crash_free_ratio(fs, &free_before, &total);
+	/* Version 2 images keep the files in a directory */
+	if (!fs_mkdir_ex(fs, "/crash")) {
+		if (fs_rmdir_ex(fs, "/crash"))
+			die("Cannot delete directory");
+		dir = "/crash/";
+	}
+	if (fs_umount_ex(fs))
+		die("Cannot unmount diskname");
+
+	/*
+	 * The child only relies on durable_metadata: no flusher, no sync, and
+	 * it exits without unmounting
+	 */
+	pid = fork();
+	if (pid < 0)
+		die_perror("fork");
+	if (!pid) {
+		opts.durable_metadata = 1;
+		opts.flush_interval_ms = 0;
+		fs = fs_mount_ex(diskname, &opts);
+		if (!fs)
+			die("Cannot mount diskname");
+		/* A deleted directory must not come back over reused blocks */
+		if (*dir && (fs_mkdir_ex(fs, "/crash") ||
+			     fs_mkdir_ex(fs, "/crash/tmp") ||
+			     fs_rmdir_ex(fs, "/crash/tmp")))
+			die("Cannot create directory");
+		for (size_t f = 0; f < files; f++) {
+			size = (f % 8 + 1) * 1500;
+			for (size_t i = 0; i < size; i++)
+				buf[i] = crash_byte(f, i);
+			snprintf(name, sizeof(name), "%scrash%zu", dir, f);
+			if (fs_create_ex(fs, name))
+				die("Cannot create file");
+			fs_fd = fs_open_ex(fs, name);
+			if (fs_fd < 0)
+				die("Cannot open file");
+			if (fs_write_ex(fs, fs_fd, buf, size) != (int)size)
+				die("Cannot write file");
+			if (fs_close_ex(fs, fs_fd))
+				die("Cannot close file");
+		}
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0)
+		die_perror("waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		die("Writer failed");
+
+	/* The mount replays what the writer committed */
+	fs_options_init(&opts);
+	fs = fs_mount_ex(diskname, &opts);
+	if (!fs)
+		die("Cannot mount diskname");
+	if (fs_journal_stats_ex(fs, &js))
+		die("No journal");
+	printf("Replayed %zu commits (%zu blocks) in %zu us\n",
+	       js.replayed_commits, js.replayed_blocks, js.replay_us);
+
+	for (size_t f = 0; f < files; f++) {
+		size = (f % 8 + 1) * 1500;
+		snprintf(name, sizeof(name), "%scrash%zu", dir, f);
+		fs_fd = fs_open_ex(fs, name);
+		if (fs_fd < 0)
+			die("Cannot open file '%s'", name);
+		if (fs_stat_ex(fs, fs_fd) != (int)size ||
+		    fs_read_ex(fs, fs_fd, buf, size) != (int)size)
+			die("Wrong size for file '%s'", name);
+		for (size_t i = 0; i < size; i++)
+			if (buf[i] != crash_byte(f, i))
+				die("Wrong content for file '%s'", name);
+		if (fs_close_ex(fs, fs_fd))
+			die("Cannot close file");
+	}
+	printf("Checked %zu files\n", files);
+
+	/*
+	 * Deleting the files must give every block back, those of a directory
+	 * once the journal is checkpointed
+	 */
+	for (size_t f = 0; f < files; f++) {
+		snprintf(name, sizeof(name), "%scrash%zu", dir, f);
+		if (fs_delete_ex(fs, name))
+			die("Cannot delete file '%s'", name);
+	}
+	if (*dir && fs_rmdir_ex(fs, "/crash"))
+		die("Cannot delete directory");
+	if (fs_umount_ex(fs))
+		die("Cannot unmount diskname");
+	fs = fs_mount_ex(diskname, &opts);
+	if (!fs)
+		die("Cannot mount diskname");
+	crash_free_ratio(fs, &free_after, &total);
+	if (free_after != free_before)
+		die("fat_free_ratio=%zu/%zu, was %zu/%zu", free_after, total,
+		    free_before, total);
+	printf("fat_free_ratio=%zu/%zu\n", free_after, total);
+
+	if (fs_umount_ex(fs))
+		die("Cannot unmount diskname");
+	free(buf);
+}
+
+void thread_fs_format(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	size_t data_blocks;
+	struct fs_format_options opts;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <data blocks> [<version> [<block size>]]");
+
+	fs_format_options_init(&opts);
+	diskname = t_arg->argv[0];
+	data_blocks = get_argv(t_arg->argv[1]);
+	if (t_arg->argc > 2)
+		opts.version = get_argv(t_arg->argv[2]);
+	if (t_arg->argc > 3)
+		opts.block_size = get_argv(t_arg->argv[3]);
+
+	if (fs_format_opts(diskname, data_blocks, &opts))
+		die("Cannot format diskname");
+}
+
+static long elapsed_us(const struct timespec *t0, const struct timespec *t1)
+{
+	return (t1->tv_sec - t0->tv_sec) * 1000000 +
+		(t1->tv_nsec - t0->tv_nsec) / 1000;
+}
+
+void thread_fs_mount_bench(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_options opts;
+	struct timespec t0, t1;
+	char *diskname;
+	size_t iterations = 100;
+	struct fs *fs;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<iterations>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		iterations = get_argv(t_arg->argv[1]);
+	if (!iterations)
+		die("Need at least one iteration");
+
+	fs_options_init(&opts);
+	for (opts.lazy_fat = 0; opts.lazy_fat <= 1; opts.lazy_fat++) {
+		long total = 0;
+
+		/* Only the mount is timed, unmounting a clean fs is cheap */
+		for (size_t i = 0; i < iterations; i++) {
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			fs = fs_mount_ex(diskname, &opts);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			if (!fs)
+				die("Cannot mount diskname");
+			total += elapsed_us(&t0, &t1);
+			if (fs_umount_ex(fs))
+				die("Cannot unmount diskname");
+		}
+
+		printf("lazy_fat=%d mount_us=%.1f\n", opts.lazy_fat,
+		       (double)total / iterations);
+	}
+}
+
 static struct {
 	const char *name;
 	void(*func)(void *);
 } commands[] = {
+	{ "format",	thread_fs_format },
 	{ "info",	thread_fs_info },
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
-	{ "stat",	thread_fs_stat }
+	{ "stat",	thread_fs_stat },
+	{ "truncate",	thread_fs_truncate },
+	{ "fallocate",	thread_fs_fallocate },
+	{ "mkdir",	thread_fs_mkdir },
+	{ "rmdir",	thread_fs_rmdir },
+	{ "crash",	thread_fs_crash },
+	{ "mount_bench",	thread_fs_mount_bench }
 };
 
 void usage(char *program)